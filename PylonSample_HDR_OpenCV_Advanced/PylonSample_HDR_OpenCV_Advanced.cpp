@@ -36,11 +36,44 @@
 #    include <pylon/PylonGUI.h>
 #endif
 
+// The exposure fusion shared by the samples and tools (CreateHDR)
+#include "../include/HDRFusion.h"
+
 // DEMO: Additional library for showing "progress bar" image.
 #include "../include/StitchImage.h"
 
+// BURST MODE: Pool of preallocated grab buffers
+#include "../include/BurstCapture.h"
+
+// QUEUED FUSION: Queue of brackets between acquisition and fusion (optionally compressed)
+#include "../include/BracketQueue.h"
+
+// RECORDING: Container file for recorded brackets
+#include "../include/BracketDataset.h"
+
+// GAIN-ASSISTED BRACKETING: Exposure time and gain for each image of the bracket
+#include "../include/BracketPlanner.h"
+
+// SEQUENCER CACHE: Which sequencer configuration each camera already holds
+#include "../include/SequencerCache.h"
+
+// MULTI-CAMERA: Opens and configures all cameras in parallel
+#include "../include/CameraBringUp.h"
+
+// INTERLEAVED STREAMS: Routes each frame to the HDR bracket or the regular stream by its sequencer set
+#include "../include/FrameRouter.h"
+
+// EXPOSURE STATISTICS: Histogram, mean level and clipping of each exposure, from the raw grab buffer
+#include "../include/FrameStatistics.h"
+
+// WARM-UP: Runs the fusion on a synthetic bracket before grabbing
+#include "../include/PipelineWarmUp.h"
+
 // STD libraries needed
 #include <vector>
+#include <chrono>
+#include <thread>
+#include <mutex>
 
 // This determines what kind of camera we will use
 #define USE_USB
@@ -74,6 +107,33 @@ using namespace Basler_UsbCameraParams;
 
 // DEMO: Number of individual images to be grabbed before shutting down.
 static const uint32_t c_countOfImagesToGrab = 1000;
+
+// OUTPUT FORMAT: The layout the HDR image is written in (Mono8, Mono16, BGR8 or RGB8 planar, see HDRFusion.h).
+static const HDRFusion::OutputFormat c_outputFormat = HDRFusion::OutputFormat_BGR8;
+
+// ROI FUSION: Only fuse the regions that get inspected, so fusion takes time in proportion to their area.
+// The rest of the HDR image is one exposure of the bracket as it is (the one closest to the middle of the exposure range).
+static const bool c_useRegionFusion = false;
+static const cv::Rect c_inspectionRegions[] = { cv::Rect(100, 100, 400, 300), cv::Rect(800, 500, 256, 256) };
+
+// DEGHOSTING: Parts that move between the exposures of a bracket only come from one exposure (the same reference
+// exposure as for ROI FUSION), instead of showing up once per exposure. Costs a small fraction of the fusion time.
+static const bool c_deghost = false;
+// FP16 PYRAMIDS: Keep the fusion's image pyramids as half floats: half the memory, at an error far below one 8 bit step.
+static const bool c_useHalfFloatPyramids = false;
+// STREAMING: Fuse row by row with a 4 level pyramid, holding a few rows of floats instead of whole float images.
+// Not used while deghosting, which needs whole images.
+static const bool c_useStreamingFusion = false;
+// PYRAMID DEPTH: Stop the fusion pyramid this many levels below full resolution (0: full depth, like MergeMertens), or
+// HDRFusion::c_autoPyramidDepth: where the scene's lighting no longer changes the blend.
+static const int c_pyramidDepth = 0;
+// TONE CURVE: Gamma and contrast (an S-curve, -1..1) of the 8 bit output, applied through a lookup table as it is
+// written. 1 and 0 write the fusion as it is.
+static const float c_outputGamma = 1.0f;
+static const float c_outputContrast = 0.0f;
+// MULTI-CAMERA: Serial numbers of the cameras to set up. They are all opened and configured in parallel.
+// The HDR pipeline of this sample runs on the first one that is ready.
+static const char *c_cameraSerialNumbers[] = { "21792244" };
 // Number of individual images per HDR image
 static const uint32_t c_imagesPerHDR = 3;
 // Lowest exposure time we will use for HDR (in microseconds)
@@ -81,47 +141,739 @@ static const double c_lowExposureTime = 100;
 // Highest exposure time we will use for HDR (in microseconds)
 static const double c_highExposureTime = 100000;
 
+// GAIN-ASSISTED BRACKETING: Cap the exposure time of every image, and brighten the image with analog gain instead.
+// This shortens the bracket (and so raises the HDR frame rate), at the cost of more noise in the bright images.
+static const bool c_useGainAssist = false;
+// Longest exposure time (in microseconds) any image may have, as long as the noise budget allows it.
+static const double c_maxExposureTime = 20000;
+// The noise budget: the most gain (in dB) any image may get. Every 6 dB doubles the noise.
+static const double c_maxGain = 12;
+
+// EXPOSURE ORDER: Program the images in the order the sensor timing model says is fastest (see BracketPlanner.h),
+// instead of always going from low to high exposure.
+// Whether the sensor exposes the next image while the previous one is read out is asked from the camera (see
+// SensorOverlapsExposure()).
+static const bool c_optimizeExposureOrder = false;
+// Camera timestamp ticks per microsecond (USB cameras count in nanoseconds). Used to check the timing model.
+static const double c_timestampTicksPerMicrosecond = 1000;
+
+// PARTIAL ROI: Transfer the shortest exposure with its own ROI and binning. It only matters for the brightest parts
+// of the scene, so it doesn't need the whole frame at full resolution. This cuts the link bandwidth per bracket.
+// Fusion scales the image back up and places it into the full frame.
+static const bool c_usePartialROI = false;
+// The ROI of the shortest exposure, in binned pixels (width or height 0 = full frame).
+static const int64_t c_shortExposureOffsetX = 0;
+static const int64_t c_shortExposureOffsetY = 0;
+static const int64_t c_shortExposureWidth = 0;
+static const int64_t c_shortExposureHeight = 0;
+static const int64_t c_shortExposureBinning = 2;
+
+// INTERLEAVED STREAMS: The sequencer also takes regular frames between the brackets (for example for tracking).
+// The camera free-runs, and each frame goes to the HDR fusion or the regular stream by the set that took it (from the chunk data).
+static const bool c_interleaveNormalFrames = false;
+// Regular frames per bracket. Each one is a sequencer set of its own, so the bracket plus these must fit the camera's sets.
+static const uint32_t c_normalFramesPerBracket = 8;
+// Exposure time of the regular frames (us)
+static const double c_normalExposureTime = 5000;
+
+// EXPOSURE STATISTICS: Compute the statistics of every frame as it arrives, for auto exposure and bracketing decisions.
+static const bool c_computeFrameStatistics = false;
+// Only look at every n-th row (1 = all rows)
+static const uint32_t c_statisticsRowStep = 4;
+
+// WARM-UP: Fuse a synthetic bracket a few times before grabbing, so the first HDR image is as fast as the ones after it.
+// The grab buffers also come from a pool that is faulted in up front. The fusion warmed up is the one the settings
+// pick (see HDRFusion::FuseToFloat()), so it warms up MergeMertens unless another engine is chosen.
+static const bool c_warmUpPipeline = false;
+static const uint32_t c_warmUpRuns = 3;
+// Also lock the grab buffers (and on Linux, all memory of the process) into RAM. Needs the right to lock that much memory.
+static const bool c_lockPipelineMemory = false;
+
+// BURST MODE: Capture brackets into RAM at the sensor's full speed and fuse them all afterwards,
+// instead of fusing each bracket as it arrives. Use this when fusion cannot keep up with the camera.
+static const bool c_useBurstMode = false;
+// Memory (in bytes) the burst may use for grab buffers. The number of brackets per burst is derived from this.
+static const size_t c_burstMemoryBudget = (size_t)1024 * 1024 * 1024;
+
+// QUEUED FUSION: Hand complete brackets to a fusion thread through a queue, so acquisition never waits for fusion.
+static const bool c_useFusionQueue = false;
+// Memory (in bytes) the fusion queue may hold. Brackets that arrive when it is full are dropped.
+static const size_t c_fusionQueueMemoryBudget = (size_t)512 * 1024 * 1024;
+// Losslessly compress brackets while they wait in the fusion queue, so it can hold a longer backlog in the same memory.
+static const bool c_compressQueuedBrackets = true;
+
+// RECORDING: Save every bracket to a dataset file (see BracketDataset.h) for offline fusion and benchmarking.
+static const bool c_recordBrackets = false;
+// The file the brackets are recorded to.
+static const char *c_recordingPath = "brackets.hdrb";
+
+// SEQUENCER CACHE: Only program the sequencer when the camera doesn't already hold this configuration (see SequencerCache.h).
+// Off by default: it saves the sequencer into a user set on the camera (c_sequencerUserSet), which stays there.
+static const bool c_useSequencerCache = false;
+// The host-side file that records which configuration each camera holds.
+static const char *c_sequencerCachePath = "sequencer_cache.txt";
+// The user set the sequencer is saved to. Note: this overwrites whatever was saved in it before.
+static const UserSetSelectorEnums c_sequencerUserSet = UserSetSelector_UserSet1;
+static const UserSetDefaultEnums c_sequencerUserSetDefault = UserSetDefault_UserSet1;
+// Also make the camera load that user set at power-up (UserSetDefault). Off: the camera's power-up setting is left as it is.
+static const bool c_sequencerLoadAtPowerUp = false;
+
+// Time the sample started, for reporting the time to the first HDR image.
+static std::chrono::steady_clock::time_point g_startTime;
+static std::once_flag g_firstHDROnce;
+
+// How every bracket is fused: PARTIAL ROI placements, OUTPUT FORMAT, ROI FUSION regions and DEGHOSTING (set up in main()).
+static HDRFusion::FusionSettings g_fusionSettings;
+
+// EXPOSURE STATISTICS: The latest statistics of each exposure (by sequencer set), for whatever needs them.
+static FrameStatistics::CStatisticsBoard g_exposureStatistics;
+
+// Report how long it took from starting the sample to the first HDR image (only once).
+void ReportFirstHDR()
+{
+	std::call_once(g_firstHDROnce, []
+	{
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - g_startTime).count();
+		std::cout << "Time to first HDR image: " << ms << " ms" << std::endl;
+	});
+}
+
 using namespace std;
 
-// The function which will generate the "HDR" image from a set of images.
-void CreateHDR(std::vector<Pylon::CPylonImage> &images, Pylon::CPylonImage &OutputImage)
+// EXPOSURE STATISTICS: Compute the statistics of a grabbed frame from its raw buffer and publish them for its exposure.
+// Returns false if the pixel format isn't supported.
+bool PublishFrameStatistics(size_t exposureIndex, const GrabResultPtr_t &ptrGrabResult, FrameStatistics::Statistics &statistics)
+{
+	std::string errorMessage = "";
+	if (FrameStatistics::Compute(ptrGrabResult->GetBuffer(), ptrGrabResult->GetPixelType(), ptrGrabResult->GetWidth(), ptrGrabResult->GetHeight(),
+		ptrGrabResult->GetPaddingX(), c_statisticsRowStep, statistics, errorMessage) != 0)
+	{
+		return false;
+	}
+	g_exposureStatistics.Publish(exposureIndex, statistics);
+	return true;
+}
+
+// EXPOSURE STATISTICS: Print the latest statistics of every exposure.
+void PrintExposureStatistics(size_t numExposures)
+{
+	cout << "Latest statistics per exposure (mean level, dark, clipped):" << endl;
+	for (size_t i = 0; i < numExposures; i++)
+	{
+		FrameStatistics::Statistics statistics;
+		uint64_t frameCount = 0;
+		if (g_exposureStatistics.Read(i, statistics, &frameCount))
+		{
+			cout << "  " << i << ": " << (statistics.mean * 100) << "%, " << (statistics.darkFraction * 100) << "%, " << (statistics.clippedFraction * 100) << "%";
+			cout << " (" << frameCount << " frames)" << endl;
+		}
+	}
+}
+
+// GAIN-ASSISTED BRACKETING: The exposure time and gain of each image in the bracket (with at most 'maxGain' dB).
+// PARTIAL ROI: The shortest exposure also gets its own ROI and binning.
+std::vector<BracketPlanner::BracketEntry> PlanBracket(double maxGain = c_maxGain)
+{
+	std::vector<BracketPlanner::BracketEntry> bracket = BracketPlanner::LinearBracket(c_imagesPerHDR, c_lowExposureTime, c_highExposureTime);
+	if (c_useGainAssist)
+		bracket = BracketPlanner::Plan(bracket, c_maxExposureTime, maxGain);
+
+	if (c_usePartialROI)
+	{
+		size_t shortest = 0;
+		for (size_t i = 1; i < bracket.size(); i++)
+		{
+			if (BracketPlanner::EffectiveExposure(bracket[i]) < BracketPlanner::EffectiveExposure(bracket[shortest]))
+				shortest = i;
+		}
+		bracket[shortest].offsetX = c_shortExposureOffsetX;
+		bracket[shortest].offsetY = c_shortExposureOffsetY;
+		bracket[shortest].width = c_shortExposureWidth;
+		bracket[shortest].height = c_shortExposureHeight;
+		bracket[shortest].binning = c_shortExposureBinning;
+	}
+	return bracket;
+}
+
+// PARTIAL ROI: Apply the ROI and binning of a bracket entry to the camera (the sequencer set being configured),
+// and read back what the camera made of it.
+void ApplyROI(Camera_t &camera, BracketPlanner::BracketEntry &entry)
+{
+	int64_t binning = (entry.binning > 1) ? entry.binning : 1;
+	camera.BinningHorizontal.SetValue(binning);
+	camera.BinningVertical.SetValue(binning);
+
+	// Offsets go to 0 first, so that any width and height fit.
+	camera.OffsetX.SetValue(0);
+	camera.OffsetY.SetValue(0);
+	camera.Width.SetValue(entry.width > 0 ? entry.width : camera.WidthMax.GetValue());
+	camera.Height.SetValue(entry.height > 0 ? entry.height : camera.HeightMax.GetValue());
+	camera.OffsetX.SetValue(entry.offsetX);
+	camera.OffsetY.SetValue(entry.offsetY);
+
+	entry.binning = camera.BinningHorizontal.GetValue();
+	entry.offsetX = camera.OffsetX.GetValue();
+	entry.offsetY = camera.OffsetY.GetValue();
+	entry.width = camera.Width.GetValue();
+	entry.height = camera.Height.GetValue();
+}
+
+// PARTIAL ROI: The grab buffers must hold a full frame, whichever set the sequencer is on when grabbing starts.
+// The camera reports the payload size of its current settings, so scale it up to the full, unbinned sensor.
+size_t GetFullFramePayloadSize(Camera_t &camera)
+{
+	double pixels = (double)camera.Width.GetValue() * camera.Height.GetValue();
+	double fullPixels = (double)camera.WidthMax.GetValue() * camera.BinningHorizontal.GetValue() * camera.HeightMax.GetValue() * camera.BinningVertical.GetValue();
+	return (size_t)ceil(camera.PayloadSize.GetValue() * fullPixels / pixels);
+}
+
+// PARTIAL ROI / WARM-UP: Have the camera grab into 'numBuffers' buffers from our own pool, allocated and faulted in now
+// (PARTIAL ROI: big enough for a full frame, whichever set the sequencer starts on). Release them with SetBufferFactory(NULL).
+int UsePreparedBuffers(Camera_t &camera, BurstCapture::BufferPool &pool, size_t numBuffers)
+{
+	std::string errorMessage = "";
+	size_t payloadSize = c_usePartialROI ? GetFullFramePayloadSize(camera) : (size_t)camera.PayloadSize.GetValue();
+	if (pool.Allocate(numBuffers, payloadSize, errorMessage) != 0)
+	{
+		cout << errorMessage << endl;
+		return 1;
+	}
+
+	// WARM-UP: Locking is nice to have. Without it, the buffers are still faulted in.
+	if (c_lockPipelineMemory && pool.Lock(errorMessage) != 0)
+		cout << errorMessage << endl;
+
+	camera.MaxNumBuffer = numBuffers;
+	camera.SetBufferFactory(&pool, Pylon::Cleanup_None);
+	return 0;
+}
+
+// WARM-UP: Fuse a synthetic bracket of the camera's pixel format and the programmed sizes until the fusion runs at its
+// steady speed (OpenCV's thread pool is up, the converter, pyramid and output memory is allocated and faulted in).
+void WarmUpPipeline(Camera_t &camera, const std::vector<BracketPlanner::BracketEntry> &programmedSets)
+{
+	Pylon::EPixelType pixelType = Pylon::CPixelTypeMapper::GetPylonPixelTypeByName(camera.PixelFormat.ToString());
+	std::vector<cv::Size> sizes;
+	for (size_t i = 0; i < programmedSets.size(); i++)
+	{
+		if (c_usePartialROI)
+			sizes.push_back(cv::Size((int)programmedSets[i].width, (int)programmedSets[i].height));
+		else
+			sizes.push_back(cv::Size((int)camera.Width.GetValue(), (int)camera.Height.GetValue()));
+	}
+
+	std::string errorMessage = "";
+	std::vector<Pylon::CPylonImage> images;
+	std::vector<double> fusionMs;
+	if (PipelineWarmUp::CreateSyntheticBracket(pixelType, sizes, images, errorMessage) != 0
+		|| PipelineWarmUp::WarmUpFusion(images, g_fusionSettings, c_warmUpRuns, fusionMs, errorMessage) != 0)
+	{
+		cout << errorMessage << endl;
+		return;
+	}
+
+	cout << "Warm-up fusion (ms):";
+	for (size_t i = 0; i < fusionMs.size(); i++)
+		cout << " " << fusionMs[i];
+	cout << endl;
+
+	// Lock what the warm-up allocated, and what comes later.
+	if (c_lockPipelineMemory && PipelineWarmUp::LockMemory(errorMessage) != 0)
+		cout << errorMessage << endl;
+}
+
+// BURST MODE: Fuses a range of the captured brackets. OpenCV runs these ranges on all cores.
+class BurstFusionBody : public cv::ParallelLoopBody
+{
+private:
+	std::vector<std::vector<GrabResultPtr_t>> &m_brackets;
+	std::vector<Pylon::CPylonImage> &m_hdrImages;
+
+public:
+	BurstFusionBody(std::vector<std::vector<GrabResultPtr_t>> &brackets, std::vector<Pylon::CPylonImage> &hdrImages)
+		: m_brackets(brackets), m_hdrImages(hdrImages)
+	{
+	}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		for (int bracket = range.start; bracket < range.end; bracket++)
+		{
+			// Attach the images to the grab buffers (no copy).
+			std::vector<Pylon::CPylonImage> images(m_brackets[bracket].size());
+			for (size_t i = 0; i < images.size(); i++)
+				images[i].AttachGrabResultBuffer(m_brackets[bracket][i]);
+
+			HDRFusion::CreateHDR(images, m_hdrImages[bracket], g_fusionSettings);
+		}
+	}
+};
+
+// BURST MODE: Capture as many brackets as fit into c_burstMemoryBudget with no processing in the grab loop,
+// then fuse all of them in parallel. Reports capture fps, fusion throughput and total time-to-results.
+int RunBurst(Camera_t &camera)
 {
-	// we will use pylon's image format converter to convert the image to openCV format.
-	Pylon::CImageFormatConverter myConverter;
-	Pylon::PixelType openCVPixelType = Pylon::EPixelType::PixelType_BGR8packed;
-	myConverter.OutputPixelFormat.SetValue(openCVPixelType);
-
-	// Step 1: Convert all stored pylon images to opencv format
-	std::vector<cv::Mat> cv_images;
-	for (int i = 0; i < images.size(); i++)
-	{
-		Pylon::CPylonImage convertedImage;
-		myConverter.Convert(convertedImage, images[i]);
-		cv::Mat cv_image(convertedImage.GetHeight(), convertedImage.GetWidth(), CV_8UC3, (uint8_t*)convertedImage.GetBuffer());
-		cv_images.push_back(cv_image.clone());
-	}
-
-	// merge_mertens will perform the exposure fusion to get the HDR image
-	cv::Ptr<cv::MergeMertens> mergeMertens = cv::createMergeMertens();
-	cv::Ptr<cv::AlignMTB> alignMTB = cv::createAlignMTB();
-
-	// Step 2: align the images (in case the camera moved. But this decreases speed and modifies the final image size)
-	// OPTIMIZATION: If speed is preferred over image quality, comment this out.
-	// alignMTB->process(cv_images, cv_images);
-
-	// Step 3: Create the HDR image
-	cv::Mat fusion;
-	mergeMertens->process(cv_images, fusion);
-	cv::Mat hdrMat;
-	fusion.convertTo(hdrMat, CV_8UC3, 255);
-
-	// Step 4: recovert the HDR image to a pylon image and display it
-	Pylon::CPylonImage hdrImage;
-	hdrImage.AttachUserBuffer(hdrMat.data, (hdrMat.total() * hdrMat.elemSize()), openCVPixelType, hdrMat.cols, hdrMat.rows, 0);
-	OutputImage.CopyImage(hdrImage);
-
-	// Step 5: Clean up for the next HDR image
-	cv_images.clear();
+	// Every frame of the burst keeps its grab buffer until it is fused, so the pool holds the whole burst.
+	size_t payloadSize = c_usePartialROI ? GetFullFramePayloadSize(camera) : (size_t)camera.PayloadSize.GetValue();
+	uint32_t burstBrackets = BurstCapture::BracketsFromBudget(c_burstMemoryBudget, payloadSize, c_imagesPerHDR);
+	uint32_t burstImages = burstBrackets * c_imagesPerHDR;
+	if (burstBrackets == 0)
+	{
+		cout << "The burst memory budget is too small for a single bracket. Exiting..." << endl;
+		return 1;
+	}
+
+	// Allocate and pre-fault the buffers now, so nothing is allocated while the burst is running.
+	BurstCapture::BufferPool bufferPool;
+	std::string errorMessage = "";
+	if (bufferPool.Allocate(burstImages, payloadSize, errorMessage) != 0)
+	{
+		cout << errorMessage << endl;
+		return 1;
+	}
+	if (c_lockPipelineMemory && bufferPool.Lock(errorMessage) != 0)
+		cout << errorMessage << endl;
+	camera.SetBufferFactory(&bufferPool, Pylon::Cleanup_None);
+	camera.MaxNumBuffer = burstImages;
+
+	// No trigger per bracket: let the camera free-run so the sequencer steps through the sets at full speed.
+	camera.TriggerMode.SetValue(TriggerMode_Off);
+
+	// Have the camera tell which sequencer set took each frame, so a dropped frame only costs its own bracket.
+	camera.ChunkModeActive.SetValue(true);
+	camera.ChunkSelector.SetValue(ChunkSelector_SequencerSetActive);
+	camera.ChunkEnable.SetValue(true);
+
+	cout << "Capturing a burst of " << burstBrackets << " brackets (" << burstImages << " images)..." << endl;
+
+	std::vector<GrabResultPtr_t> grabResults;
+	grabResults.reserve(burstImages);
+	GrabResultPtr_t ptrGrabResult;
+
+	std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+	// GRAB LOOP: Only keep the grab results. All processing is deferred until after the burst.
+	camera.StartGrabbing(burstImages);
+	while (camera.IsGrabbing())
+	{
+		camera.RetrieveResult(5000, ptrGrabResult, Pylon::TimeoutHandling_ThrowException);
+		grabResults.push_back(ptrGrabResult);
+	}
+	ptrGrabResult.Release();
+
+	std::chrono::steady_clock::time_point capturedTime = std::chrono::steady_clock::now();
+
+	// Put the brackets together by the set that took each frame (INTERLEAVED STREAMS: regular frames are dropped).
+	// Brackets with a missing or failed frame are left out.
+	std::vector<FrameRouter::Stream> setStreams(c_imagesPerHDR, FrameRouter::Stream_HDR);
+	setStreams.resize(c_imagesPerHDR + (c_interleaveNormalFrames ? c_normalFramesPerBracket : 0), FrameRouter::Stream_Normal);
+	std::vector<std::vector<GrabResultPtr_t>> brackets;
+	FrameRouter::CFrameRouter<GrabResultPtr_t> router(setStreams,
+		[&brackets](std::vector<GrabResultPtr_t> &bracket) { brackets.push_back(bracket); },
+		[](const GrabResultPtr_t &) {});
+	for (size_t i = 0; i < grabResults.size(); i++)
+	{
+		int64_t setIndex = -1;
+		if (grabResults[i]->GrabSucceeded() && grabResults[i]->IsChunkDataAvailable())
+			setIndex = grabResults[i]->ChunkSequencerSetActive.GetValue();
+		router.Route(setIndex, grabResults[i]);
+	}
+	camera.ChunkModeActive.SetValue(false);
+
+	// Fuse all brackets, spread over all cores.
+	std::vector<Pylon::CPylonImage> hdrImages(brackets.size());
+	cv::parallel_for_(cv::Range(0, (int)brackets.size()), BurstFusionBody(brackets, hdrImages));
+
+	std::chrono::steady_clock::time_point fusedTime = std::chrono::steady_clock::now();
+
+	double captureSeconds = std::chrono::duration<double>(capturedTime - startTime).count();
+	double fusionSeconds = std::chrono::duration<double>(fusedTime - capturedTime).count();
+	double totalSeconds = std::chrono::duration<double>(fusedTime - startTime).count();
+	uint32_t fusedBrackets = 0;
+	for (size_t i = 0; i < hdrImages.size(); i++)
+	{
+		if (hdrImages[i].IsValid())
+			fusedBrackets++;
+	}
+
+	cout << endl;
+	cout << "Burst captured: " << grabResults.size() << " images in " << captureSeconds << " s (" << (grabResults.size() / captureSeconds) << " fps)" << endl;
+	cout << "Burst fused: " << fusedBrackets << " of " << burstBrackets << " brackets in " << fusionSeconds << " s (" << (fusedBrackets / fusionSeconds) << " HDR/s on " << cv::getNumThreads() << " threads)" << endl;
+	cout << "Burst routing: " << router.GetStatistics().brokenBrackets << " incomplete brackets left out, " << router.GetStatistics().unroutedFrames << " frames without a known set" << endl;
+	cout << "Time to results: " << totalSeconds << " s" << endl;
+	cout << endl;
+
+	// Give the buffers back to the pool before it goes away, and give the camera its default buffer factory back.
+	brackets.clear();
+	grabResults.clear();
+	camera.SetBufferFactory(NULL, Pylon::Cleanup_None);
+
+	// Show the last result (showing each of them in turn would only time the display).
+	for (size_t i = hdrImages.size(); i > 0; i--)
+	{
+		if (hdrImages[i - 1].IsValid())
+		{
+			Pylon::DisplayImage(0, hdrImages[i - 1]);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+// QUEUED FUSION: Fuses and displays brackets from the queue until it is closed and drained.
+void FusionLoop(BracketQueue::CBracketQueue *pQueue)
+{
+	try
+	{
+		std::vector<Pylon::CPylonImage> images;
+		while (pQueue->IsDrained() == false)
+		{
+			if (pQueue->Pop(images, 100) == false)
+				continue;
+
+			Pylon::CPylonImage hdrImage;
+			HDRFusion::CreateHDR(images, hdrImage, g_fusionSettings);
+			Pylon::DisplayImage(0, hdrImage);
+			ReportFirstHDR();
+			std::cout << "HDR Image Generated! (" << pQueue->GetDepth() << " brackets waiting)" << std::endl;
+		}
+	}
+	catch (GenICam::GenericException &e)
+	{
+		std::cerr << "An exception occurred in the fusion thread." << std::endl
+			<< e.GetDescription() << std::endl;
+	}
+}
+
+// QUEUED FUSION: Show how deep the queue got and what the compression tier did.
+void PrintQueueStatistics(BracketQueue::CBracketQueue &queue)
+{
+	BracketQueue::Statistics stats = queue.GetStatistics();
+	const double MB = 1024.0 * 1024.0;
+
+	cout << endl;
+	cout << "Fusion queue: " << stats.pushedBrackets << " brackets queued, " << stats.droppedBrackets << " dropped, ";
+	cout << "max depth " << stats.maxDepth << ", max memory " << (stats.maxStoredBytes / MB) << " MB" << endl;
+	if (stats.compressOutputBytes > 0)
+	{
+		cout << "Compression: " << stats.compressedBrackets << " brackets, ratio " << ((double)stats.compressInputBytes / stats.compressOutputBytes);
+		cout << ", " << (stats.compressInputBytes / MB / stats.compressSeconds) << " MB/s" << endl;
+	}
+	if (stats.decompressSeconds > 0)
+		cout << "Decompression: " << (stats.decompressOutputBytes / MB / stats.decompressSeconds) << " MB/s" << endl;
+}
+
+// INTERLEAVED STREAMS: Stands in for what the regular stream is for (tracking, for example): shows the newest frame
+// and reports the rate it kept up with, until the mailbox is closed.
+void FastPathLoop(FrameRouter::CLatestFrame<GrabResultPtr_t> *pMailbox)
+{
+	try
+	{
+		GrabResultPtr_t ptrGrabResult;
+		uint64_t processedFrames = 0;
+		std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+		while (pMailbox->IsDrained() == false)
+		{
+			if (pMailbox->Take(ptrGrabResult, 100) == false)
+				continue;
+
+			Pylon::DisplayImage(1, ptrGrabResult);
+			ptrGrabResult.Release();
+			processedFrames++;
+		}
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		std::cout << "Regular stream: " << processedFrames << " frames processed (" << (processedFrames / seconds) << " fps), ";
+		std::cout << pMailbox->GetReplacedFrames() << " skipped for newer ones" << std::endl;
+	}
+	catch (GenICam::GenericException &e)
+	{
+		std::cerr << "An exception occurred in the regular stream thread." << std::endl
+			<< e.GetDescription() << std::endl;
+	}
+}
+
+// INTERLEAVED STREAMS: Grab the free-running bracket + regular frames program and route each frame by the sequencer set
+// the camera reports for it. Complete brackets go to the fusion queue, regular frames to the fast path, so neither waits on the other.
+int RunInterleaved(Camera_t &camera, BurstCapture::BufferPool &grabBufferPool, BracketQueue::CBracketQueue &fusionQueue, std::thread &fusionThread)
+{
+	// Have the camera tell which sequencer set took each frame.
+	camera.ChunkModeActive.SetValue(true);
+	camera.ChunkSelector.SetValue(ChunkSelector_SequencerSetActive);
+	camera.ChunkEnable.SetValue(true);
+
+	// The mailbox and a bracket being assembled hold grab buffers of their own.
+	// (Before the threads start, so returning here leaves none behind.)
+	size_t numGrabBuffers = 10 + c_imagesPerHDR + 2;
+	if (c_usePartialROI || c_warmUpPipeline)
+	{
+		if (UsePreparedBuffers(camera, grabBufferPool, numGrabBuffers) != 0)
+			return 1;
+	}
+	else
+	{
+		camera.MaxNumBuffer = numGrabBuffers;
+	}
+
+	std::string errorMessage = "";
+	if (fusionQueue.Start(c_fusionQueueMemoryBudget, c_compressQueuedBrackets, errorMessage) != 0)
+	{
+		cout << errorMessage << endl;
+		return 1;
+	}
+	fusionThread = std::thread(FusionLoop, &fusionQueue);
+
+	FrameRouter::CLatestFrame<GrabResultPtr_t> fastPath;
+	std::thread fastPathThread(FastPathLoop, &fastPath);
+
+	// The bracket's sets come first, then the regular frames' sets (see SetupSequencer()).
+	std::vector<FrameRouter::Stream> setStreams(c_imagesPerHDR, FrameRouter::Stream_HDR);
+	setStreams.resize(c_imagesPerHDR + c_normalFramesPerBracket, FrameRouter::Stream_Normal);
+
+	// The grab buffers go back to the camera as soon as the bracket is queued (the queue keeps copies).
+	FrameRouter::CFrameRouter<GrabResultPtr_t> router(setStreams,
+		[&fusionQueue](std::vector<GrabResultPtr_t> &bracket)
+		{
+			std::vector<Pylon::CPylonImage> images(bracket.size());
+			for (size_t i = 0; i < bracket.size(); i++)
+				images[i].CopyImage(bracket[i]);
+
+			std::string errorMessage = "";
+			if (fusionQueue.Push(images, errorMessage) != 0)
+				cout << errorMessage << endl;
+		},
+		[&fastPath](const GrabResultPtr_t &frame)
+		{
+			fastPath.Post(frame);
+		});
+
+	GrabResultPtr_t ptrGrabResult;
+	std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+	// GRAB LOOP: Only routing here.
+	try
+	{
+		camera.StartGrabbing(c_countOfImagesToGrab);
+		while (camera.IsGrabbing())
+		{
+			camera.RetrieveResult(5000, ptrGrabResult, Pylon::TimeoutHandling_ThrowException);
+
+			int64_t setIndex = -1;
+			if (ptrGrabResult->GrabSucceeded() && ptrGrabResult->IsChunkDataAvailable())
+				setIndex = ptrGrabResult->ChunkSequencerSetActive.GetValue();
+			else if (ptrGrabResult->GrabSucceeded() == false)
+				std::cout << "Error: " << ptrGrabResult->GetErrorCode() << " " << ptrGrabResult->GetErrorDescription() << std::endl;
+
+			// EXPOSURE STATISTICS: Once per frame, before the frame is handed off.
+			if (c_computeFrameStatistics && setIndex >= 0)
+			{
+				FrameStatistics::Statistics statistics;
+				PublishFrameStatistics((size_t)setIndex, ptrGrabResult, statistics);
+			}
+
+			router.Route(setIndex, ptrGrabResult);
+		}
+		ptrGrabResult.Release();
+		if (c_usePartialROI || c_warmUpPipeline)
+			camera.SetBufferFactory(NULL, Pylon::Cleanup_None);
+	}
+	catch (GenICam::GenericException &)
+	{
+		// The fast path thread must be joined before it goes away. The fusion thread is finished by main().
+		fastPath.Close();
+		fastPathThread.join();
+		throw;
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+	fastPath.Close();
+	fastPathThread.join();
+
+	FrameRouter::Statistics stats = router.GetStatistics();
+	cout << endl;
+	cout << "Grabbed in " << seconds << " s: " << stats.normalFrames << " regular frames (" << (stats.normalFrames / seconds) << " fps), ";
+	cout << stats.brackets << " brackets (" << (stats.brackets / seconds) << " HDR/s)" << endl;
+	cout << "Routing: " << stats.brokenBrackets << " incomplete brackets discarded, " << stats.unroutedFrames << " frames without a known set" << endl;
+	if (c_computeFrameStatistics)
+		PrintExposureStatistics(setStreams.size());
+
+	camera.ChunkModeActive.SetValue(false);
+	return 0;
+}
+
+// EXPOSURE ORDER: Can the sensor expose the next image while the previous one is read out? Newer cameras switch this
+// with OverlapMode, older ones report how long exposures may overlap in ExposureOverlapTimeMax. Cameras with neither
+// are taken to expose and read out one image after the other.
+bool SensorOverlapsExposure(Camera_t &camera)
+{
+	if (GenApi::IsReadable(camera.OverlapMode.GetNode()))
+		return camera.OverlapMode.ToString() == "On";
+	return GenApi::IsReadable(camera.ExposureOverlapTimeMax.GetNode());
+}
+
+// SEQUENCER CACHE: Fingerprint the sequencer configuration we want. If the cache says the camera already holds it,
+// restore it from the camera's user set. Otherwise program every set, save them to the user set and update the cache.
+int SetupSequencer(Camera_t &camera, SequencerCache::CSequencerCache *pCache, std::vector<BracketPlanner::BracketEntry> &programmedSets, bool &cached, std::string &errorMessage)
+{
+	cached = false;
+	programmedSets.clear();
+
+	// check if camera supports the sequencer first
+	if (GenApi::IsWritable(camera.SequencerMode.GetNode()) == false)
+	{
+		errorMessage = "This camera does not support the Sequencer feature.";
+		return 1;
+	}
+
+	SequencerCache::SequencerConfig config;
+	config.serialNumber = camera.GetDeviceInfo().GetSerialNumber().c_str();
+	config.firmwareVersion = camera.DeviceFirmwareVersion.GetValue().c_str();
+	config.imagesPerHDR = c_imagesPerHDR;
+	config.lowExposureTime = c_lowExposureTime;
+	config.highExposureTime = c_highExposureTime;
+	config.maxExposureTime = c_useGainAssist ? c_maxExposureTime : 0;
+	config.maxGain = c_useGainAssist ? c_maxGain : 0;
+	config.optimizedOrder = c_optimizeExposureOrder;
+	config.sensorOverlapsExposure = c_optimizeExposureOrder && SensorOverlapsExposure(camera);
+	config.partialROI = c_usePartialROI;
+	config.partialOffsetX = c_usePartialROI ? c_shortExposureOffsetX : 0;
+	config.partialOffsetY = c_usePartialROI ? c_shortExposureOffsetY : 0;
+	config.partialWidth = c_usePartialROI ? c_shortExposureWidth : 0;
+	config.partialHeight = c_usePartialROI ? c_shortExposureHeight : 0;
+	config.partialBinning = c_usePartialROI ? c_shortExposureBinning : 0;
+	config.normalFramesPerBracket = c_interleaveNormalFrames ? c_normalFramesPerBracket : 0;
+	config.normalExposureTime = c_interleaveNormalFrames ? c_normalExposureTime : 0;
+	uint64_t fingerprint = SequencerCache::Fingerprint(config);
+
+	// If we made the camera load our user set at power-up, it must still do so, or someone else has changed its user sets.
+	bool userSetIntact = (c_sequencerLoadAtPowerUp == false) || camera.UserSetDefault.GetValue() == c_sequencerUserSetDefault;
+	if (pCache != NULL && pCache->Lookup(config.serialNumber, fingerprint, programmedSets) && userSetIntact)
+	{
+		try
+		{
+			camera.SequencerMode.FromString("Off");
+			camera.UserSetSelector.SetValue(c_sequencerUserSet);
+			camera.UserSetLoad.Execute();
+			camera.SequencerMode.FromString("On");
+			cached = true;
+			return 0;
+		}
+		catch (GenICam::GenericException &e)
+		{
+			cout << "Loading the cached sequencer failed (" << e.GetDescription() << "). Programming it again..." << endl;
+			pCache->Remove(config.serialNumber);
+			programmedSets.clear();
+		}
+	}
+
+	// GAIN-ASSISTED BRACKETING: The exposure time and gain of each image.
+	std::vector<BracketPlanner::BracketEntry> bracket = PlanBracket();
+	if (c_useGainAssist)
+	{
+		// Gain must stay where we put it, and can't go past what the camera offers.
+		camera.GainAuto.SetValue(GainAuto_Off);
+		double maxGain = camera.Gain.GetMax();
+		if (c_maxGain > maxGain)
+			bracket = PlanBracket(maxGain);
+	}
+
+	// EXPOSURE ORDER: Let the sensor's timing decide the order of the images. (Cameras that don't report their readout
+	// time keep the planned order.)
+	if (c_optimizeExposureOrder && GenApi::IsReadable(camera.SensorReadoutTime.GetNode()))
+	{
+		BracketPlanner::SensorTiming timing = { camera.SensorReadoutTime.GetValue(), config.sensorOverlapsExposure };
+		bracket = BracketPlanner::OptimizeOrder(bracket, timing);
+	}
+
+	// INTERLEAVED STREAMS: The regular frames follow the bracket, each in a set of its own (full frame, no gain).
+	if (c_interleaveNormalFrames)
+	{
+		for (uint32_t i = 0; i < c_normalFramesPerBracket; i++)
+		{
+			BracketPlanner::BracketEntry entry = {};
+			entry.exposureTime = c_normalExposureTime;
+			bracket.push_back(entry);
+		}
+
+		if ((int64_t)bracket.size() > camera.SequencerSetSelector.GetMax() + 1)
+		{
+			errorMessage = "The bracket and the regular frames need more sequencer sets than the camera has.";
+			return 1;
+		}
+	}
+
+	// ********************************** BEGIN SEQUENCER SETUP **********************************
+
+	// Turn off the sequencer so we can configure it
+	camera.SequencerMode.FromString("Off");
+
+	// Put the sequencer into configuration mode so we can cofigure it
+	camera.SequencerConfigurationMode.FromString("On");
+
+	int numSets = (int)bracket.size();
+	for (int i = 0; i < numSets; i++)
+	{
+		// We will start by configuring sequencer set 0
+		camera.SequencerSetSelector.SetValue(i);
+
+		// Now change some camera settings settings
+		// The first image will have the low exposure, the last the highest, and the ones in between have an increment
+		// (GAIN-ASSISTED BRACKETING: long exposures are shortened and gain makes up the difference)
+		camera.ExposureTime.SetValue(bracket[i].exposureTime);
+		if (c_useGainAssist)
+			camera.Gain.SetValue(bracket[i].gain);
+
+		// PARTIAL ROI: Every set gets its own ROI and binning (the full frame, unless planned otherwise).
+		if (c_usePartialROI)
+			ApplyROI(camera, bracket[i]);
+
+		// Keep what the camera actually uses (it may round what we ask for)
+		bracket[i].exposureTime = camera.ExposureTime.GetValue();
+		if (c_useGainAssist)
+			bracket[i].gain = camera.Gain.GetValue();
+		programmedSets.push_back(bracket[i]);
+
+		// We will advance to the next sequencer set when this one has acquired it's image.
+		// and we will cycle back to the first sequence set after we've run through all of them.
+		if (i == (numSets - 1))
+			camera.SequencerSetNext.SetValue(0);
+		else
+			camera.SequencerSetNext.SetValue(i + 1);
+
+		camera.SequencerPathSelector.SetValue(1);
+		
+		// Save the sequence set
+		camera.SequencerSetSave.Execute();
+	}
+
+	// Now point the sequencer to start at the first set
+	camera.SequencerSetSelector.SetValue(0);
+
+	// Take the sequencer out of configuration mode
+	camera.SequencerConfigurationMode.FromString("Off");
+
+	// SEQUENCER CACHE: Save the sets into the user set, (if asked) make the camera load it at power-up, and remember that it holds them.
+	if (pCache != NULL)
+	{
+		camera.UserSetSelector.SetValue(c_sequencerUserSet);
+		camera.UserSetSave.Execute();
+		if (c_sequencerLoadAtPowerUp)
+			camera.UserSetDefault.SetValue(c_sequencerUserSetDefault);
+
+		std::string cacheError = "";
+		pCache->Update(config.serialNumber, fingerprint, programmedSets);
+		if (pCache->Save(cacheError) != 0)
+			cout << cacheError << endl;
+	}
+
+	// Turn on the sequencer
+	camera.SequencerMode.FromString("On");
+
+	// ********************************** END SEQUENCER SETUP **********************************
+
+	return 0;
 }
 
 int main(int argc, char* argv[])
@@ -129,162 +881,345 @@ int main(int argc, char* argv[])
 	// The exit code of the sample application.
 	int exitCode = 0;
 
+	// Startup timing starts here, before pylon is initialized.
+	g_startTime = std::chrono::steady_clock::now();
+
 	// Automagically call PylonInitialize and PylonTerminate to ensure the pylon runtime system
 	// is initialized during the lifetime of this object.
 	Pylon::PylonAutoInitTerm autoInitTerm;
 
+	// QUEUED FUSION: The queue and the thread that drains it.
+	BracketQueue::CBracketQueue fusionQueue;
+	std::thread fusionThread;
+
 	try
 	{
 		// ********************************** BEGIN SETUP **********************************
 
-		// Use a DeviceInfo object to open a specific camera.
-		Pylon::CDeviceInfo info;
-		info.SetSerialNumber("21792244");
+		// PARTIAL ROI / WARM-UP: Our own grab buffers. Declared before the cameras, so it outlives them.
+		BurstCapture::BufferPool grabBufferPool;
 
-		// Create an instant camera object with the given info.
-		Camera_t camera(Pylon::CTlFactory::GetInstance().CreateFirstDevice(info));
+		// SEQUENCER CACHE: Read which configuration each camera holds.
+		SequencerCache::CSequencerCache sequencerCache;
+		if (c_useSequencerCache)
+		{
+			std::string errorMessage = "";
+			if (sequencerCache.Load(c_sequencerCachePath, errorMessage) != 0)
+				cout << errorMessage << endl;
+		}
 
-		// Print the model name of the camera.
-		std::cout << "Using device " << camera.GetDeviceInfo().GetModelName() << std::endl;
+		// What each sequencer set of each camera actually holds (the camera may round what we ask for)
+		std::vector<std::string> serialNumbers(c_cameraSerialNumbers, c_cameraSerialNumbers + sizeof(c_cameraSerialNumbers) / sizeof(c_cameraSerialNumbers[0]));
+		std::vector<std::vector<BracketPlanner::BracketEntry>> cameraSets(serialNumbers.size());
 
-		// Open the camera to gain access to parameters
-		camera.Open();
+		// MULTI-CAMERA: Everything each camera needs before it can grab. Runs on the camera's own bring-up thread.
+		CameraBringUp::ConfigureFunction<Camera_t> configureCamera = [&sequencerCache, &cameraSets](size_t index, Camera_t &camera, CameraBringUp::CPhaseTimer &timer, std::string &errorMessage) -> int
+		{
+			// SEQUENCER CACHE: Program the sequencer, or load it from the camera if it already holds this configuration.
+			bool sequencerCached = false;
+			if (SetupSequencer(camera, c_useSequencerCache ? &sequencerCache : NULL, cameraSets[index], sequencerCached, errorMessage) != 0)
+				return 1;
+			timer.Mark(sequencerCached ? "sequencer(cached)" : "sequencer");
 
-		// calculate the exposure time increments for the subsequent images
-		double c_exposureTimeIncrement = (c_highExposureTime - c_lowExposureTime) / c_imagesPerHDR;
+			// Setup the trigger mechanism
+			// (INTERLEAVED STREAMS: no trigger, the camera free-runs through the bracket and the regular frames)
+			camera.TriggerSelector.SetValue(TriggerSelector_FrameBurstStart);
+			if (c_interleaveNormalFrames)
+			{
+				camera.TriggerMode.SetValue(TriggerMode_Off);
+			}
+			else
+			{
+				camera.AcquisitionBurstFrameCount.SetValue(c_imagesPerHDR);
+				camera.TriggerMode.SetValue(TriggerMode_On);
+				camera.TriggerSource.SetValue(TriggerSourceEnums::TriggerSource_Software);
+			}
+			timer.Mark("trigger");
 
-		// ********************************** BEGIN SEQUENCER SETUP **********************************
+			return 0;
+		};
 
-		// check if camera supports the sequencer first
-		if (GenApi::IsWritable(camera.SequencerMode.GetNode()) == false)
+		// MULTI-CAMERA: Find, open and configure all cameras at the same time.
+		std::vector<CameraBringUp::CameraSlot<Camera_t>> cameras;
+		if (CameraBringUp::BringUp(serialNumbers, configureCamera, cameras) == 0)
 		{
-			cout << "This camera does not support the Sequencer feature. Exiting..." << endl;
+			cout << "None of the cameras could be set up. Exiting..." << endl;
 			return 1;
 		}
 
-		// Turn off the sequencer so we can configure it
-		camera.SequencerMode.FromString("Off");
+		// The HDR pipeline below runs on the first camera that is ready.
+		size_t cameraIndex = 0;
+		while (cameras[cameraIndex].ready == false)
+			cameraIndex++;
+		Camera_t &camera = *cameras[cameraIndex].camera;
+		// The sets of the bracket (INTERLEAVED STREAMS: the regular frames' sets follow them).
+		std::vector<BracketPlanner::BracketEntry> programmedSets(cameraSets[cameraIndex].begin(), cameraSets[cameraIndex].begin() + c_imagesPerHDR);
+
+		// The exposure time of each image, and (PARTIAL ROI) where each image goes in the full frame.
+		std::vector<double> exposureTimes;
+		for (size_t i = 0; i < programmedSets.size(); i++)
+		{
+			exposureTimes.push_back(programmedSets[i].exposureTime);
+			if (c_usePartialROI)
+			{
+				HDRFusion::FramePlacement placement = { (uint32_t)programmedSets[i].offsetX, (uint32_t)programmedSets[i].offsetY, (uint32_t)programmedSets[i].binning };
+				g_fusionSettings.placements.push_back(placement);
+			}
+		}
 
-		// Put the sequencer into configuration mode so we can cofigure it
-		camera.SequencerConfigurationMode.FromString("On");
+		// OUTPUT FORMAT, ROI FUSION, DEGHOSTING, FP16 PYRAMIDS, STREAMING, PYRAMID DEPTH and TONE CURVE
+		g_fusionSettings.format = c_outputFormat;
+		if (c_useRegionFusion)
+			g_fusionSettings.regions.assign(c_inspectionRegions, c_inspectionRegions + sizeof(c_inspectionRegions) / sizeof(c_inspectionRegions[0]));
+		g_fusionSettings.deghost = c_deghost;
+		if (c_useHalfFloatPyramids)
+			g_fusionSettings.pyramidStorage = ExposureFusion::PyramidStorage_Float16;
+		if (c_useStreamingFusion)
+			g_fusionSettings.engine = HDRFusion::FusionEngine_Streaming;
+		g_fusionSettings.pyramidDepth = c_pyramidDepth;
+		ToneCurve::Settings tone;
+		tone.gamma = c_outputGamma;
+		tone.contrast = c_outputContrast;
+		g_fusionSettings.toneCurve = ToneCurve::Create(tone);
 
-		for (int i = 0; i < c_imagesPerHDR; i++)
+		// The reference exposure is the one closest to the middle of the range (on a log scale, like the exposures).
+		// (EXPOSURE ORDER: the sets aren't necessarily sorted by exposure.)
+		double shortest = BracketPlanner::EffectiveExposure(programmedSets[0]);
+		double longest = shortest;
+		for (size_t i = 1; i < programmedSets.size(); i++)
 		{
-			// We will start by configuring sequencer set 0
-			camera.SequencerSetSelector.SetValue(i);
-
-			// Now change some camera settings settings
-			// The first image will have the low exposure, the last the highest, and the ones in between have an increment
-			if (i == 0)
-				camera.ExposureTime.SetValue(c_lowExposureTime);
-			else if (i == (c_imagesPerHDR - 1))
-				camera.ExposureTime.SetValue(c_highExposureTime);
-			else
-				camera.ExposureTime.SetValue(camera.ExposureTime.GetValue() + c_exposureTimeIncrement);
+			shortest = std::min(shortest, BracketPlanner::EffectiveExposure(programmedSets[i]));
+			longest = std::max(longest, BracketPlanner::EffectiveExposure(programmedSets[i]));
+		}
+		double middle = sqrt(shortest * longest);
+		for (size_t i = 0; i < programmedSets.size(); i++)
+		{
+			double distance = fabs(log(BracketPlanner::EffectiveExposure(programmedSets[i]) / middle));
+			if (g_fusionSettings.referenceIndex < 0 || distance < fabs(log(BracketPlanner::EffectiveExposure(programmedSets[g_fusionSettings.referenceIndex]) / middle)))
+				g_fusionSettings.referenceIndex = (int)i;
+		}
 
-			// We will advance to the next sequencer set when this one has acquired it's image.
-			// and we will cycle back to the first sequence set after we've run through all of them.
-			if (i == (c_imagesPerHDR - 1))
-				camera.SequencerSetNext.SetValue(0);
-			else
-				camera.SequencerSetNext.SetValue(i + 1);
+		// Print the model name of the camera.
+		std::cout << "Using device " << camera.GetDeviceInfo().GetModelName() << std::endl;
+
+		// GAIN-ASSISTED BRACKETING: How long the sensor exposes per HDR image, which limits the HDR frame rate.
+		// (As programmed: the gain may have been capped at what the camera offers.)
+		double bracketDuration = BracketPlanner::BracketDuration(programmedSets);
+		double plainDuration = BracketPlanner::BracketDuration(BracketPlanner::LinearBracket(c_imagesPerHDR, c_lowExposureTime, c_highExposureTime));
+		cout << "Exposure per HDR image: " << (bracketDuration / 1000) << " ms (at most " << (1000000 / bracketDuration) << " HDR/s)";
+		if (c_useGainAssist)
+			cout << ", " << (plainDuration / 1000) << " ms without gain: " << (plainDuration / bracketDuration) << "x faster";
+		cout << endl;
 
-			camera.SequencerPathSelector.SetValue(1);
-			
-			// Save the sequence set
-			camera.SequencerSetSave.Execute();
+		// EXPOSURE ORDER: When the timing model says each exposure of the programmed bracket starts.
+		// This is checked against the camera's timestamps in the grab loop. (Not without the camera's readout time.)
+		std::vector<double> predictedStarts;
+		cout << "Bracket order:";
+		for (size_t i = 0; i < exposureTimes.size(); i++)
+			cout << " " << exposureTimes[i];
+		cout << " us";
+		if (GenApi::IsReadable(camera.SensorReadoutTime.GetNode()))
+		{
+			BracketPlanner::SensorTiming sensorTiming = { camera.SensorReadoutTime.GetValue(), SensorOverlapsExposure(camera) };
+			predictedStarts = BracketPlanner::ExposureStarts(programmedSets, sensorTiming);
+			cout << ", predicted bracket time " << (BracketPlanner::BracketTime(programmedSets, sensorTiming) / 1000) << " ms";
 		}
+		cout << endl;
 
-		// Now point the sequencer to start at the first set
-		camera.SequencerSetSelector.SetValue(0);
+		// WARM-UP: Get the fusion up to speed before the first bracket arrives.
+		if (c_warmUpPipeline)
+			WarmUpPipeline(camera, programmedSets);
 
-		// Take the sequencer out of configuration mode
-		camera.SequencerConfigurationMode.FromString("Off");
+		// BURST MODE: capture first, fuse afterwards.
+		if (c_useBurstMode)
+		{
+			exitCode = RunBurst(camera);
+		}
+		else if (c_interleaveNormalFrames)
+		{
+			// INTERLEAVED STREAMS: the grab loop only routes, fusion and the regular stream run on threads of their own.
+			exitCode = RunInterleaved(camera, grabBufferPool, fusionQueue, fusionThread);
+		}
+		else
+		{
+			Pylon::CPylonImage image; // Pylon image to hold an individual incoming image
+			std::vector<Pylon::CPylonImage> images; // vector to store the incoming images we will process
+			std::vector<uint64_t> timestamps; // RECORDING: camera timestamps of the incoming images
 
-		// Turn on the sequencer
-		camera.SequencerMode.FromString("On");
+			// DEMO: We can show the user a 'progress bar' of individual images stitched together.
+			Pylon::CPylonImage stitchedImage;		
 
-		// ********************************** END SEQUENCER SETUP **********************************
+			// EXPOSURE ORDER: Sum of the measured start of each exposure (relative to the first of its bracket), over all brackets.
+			std::vector<double> measuredStarts(c_imagesPerHDR, 0);
+			uint32_t measuredBrackets = 0;
 
-		// Setup the trigger mechanism
-		camera.TriggerSelector.SetValue(TriggerSelector_FrameBurstStart);
-		camera.AcquisitionBurstFrameCount.SetValue(c_imagesPerHDR);
-		camera.TriggerMode.SetValue(TriggerMode_On);
-		camera.TriggerSource.SetValue(TriggerSourceEnums::TriggerSource_Software);
-	
-		Pylon::CPylonImage image; // Pylon image to hold an individual incoming image
-		std::vector<Pylon::CPylonImage> images; // vector to store the incoming images we will process
+			// how we will keep track of the images
+			int imageCounter = 0;
 
-		// DEMO: We can show the user a 'progress bar' of individual images stitched together.
-		Pylon::CPylonImage stitchedImage;		
+			// GRAB ENGINE: The Grab Engine will receive the incoming images into buffers and hold them for retrieval.
+			// Access to the image is through a "Grab Result", which hold the image and other information.
+			// MaxNumBuffer can be used to control how many buffers are used in the Grab Engine.
+			// If you see statistics about "missed images" or "buffer underruns", increase this value (default is 10).
+			camera.MaxNumBuffer = 10;
 
-		// how we will keep track of the images
-		int imageCounter = 0;
+			// PARTIAL ROI / WARM-UP: Use grab buffers that fit a full frame and are faulted in already.
+			if (c_usePartialROI || c_warmUpPipeline)
+			{
+				if (UsePreparedBuffers(camera, grabBufferPool, 10) != 0)
+					return 1;
+			}
 
-		// GRAB ENGINE: The Grab Engine will receive the incoming images into buffers and hold them for retrieval.
-		// Access to the image is through a "Grab Result", which hold the image and other information.
-		// MaxNumBuffer can be used to control how many buffers are used in the Grab Engine.
-		// If you see statistics about "missed images" or "buffer underruns", increase this value (default is 10).
-		camera.MaxNumBuffer = 10;
+			// This smart pointer points to the "Grab Result" provided by the Grab Engine.
+			GrabResultPtr_t ptrGrabResult;
 
-		// This smart pointer points to the "Grab Result" provided by the Grab Engine.
-		GrabResultPtr_t ptrGrabResult;
+			// RECORDING: Create the dataset file.
+			BracketDataset::CBracketDatasetWriter datasetWriter;
+			if (c_recordBrackets)
+			{
+				std::string errorMessage = "";
+				if (datasetWriter.Open(c_recordingPath, c_imagesPerHDR, errorMessage) != 0)
+				{
+					cout << errorMessage << endl;
+					return 1;
+				}
+			}
 
-		// ********************************** END SETUP **********************************
+			// QUEUED FUSION: Start the fusion thread before the camera, so it is ready for the first bracket.
+			// (Last in the setup: every early return above leaves no thread behind.)
+			if (c_useFusionQueue)
+			{
+				std::string errorMessage = "";
+				if (fusionQueue.Start(c_fusionQueueMemoryBudget, c_compressQueuedBrackets, errorMessage) != 0)
+				{
+					cout << errorMessage << endl;
+					return 1;
+				}
+				fusionThread = std::thread(FusionLoop, &fusionQueue);
+			}
 
-		// Start the Grab Engine (StopGrabbing() will be called automatically when c_countOfImagesToGrab have been grabbed).
-		camera.StartGrabbing(c_countOfImagesToGrab);
+			// ********************************** END SETUP **********************************
 
-		// Send a kickoff trigger. Subsequent triggers will be sent later in the Grab Loop.
-		camera.TriggerSoftware.Execute();
+			// Start the Grab Engine (StopGrabbing() will be called automatically when c_countOfImagesToGrab have been grabbed).
+			camera.StartGrabbing(c_countOfImagesToGrab);
 
-		// GRAB LOOP: Here we will retrieve images from the Grab Engine and process them.
-		while (camera.IsGrabbing())
-		{
-			// Retrieve a "Grab Result" from the Grab Engine. If nothing shows up by the timeout end, throw an exception.
-			camera.RetrieveResult(5000, ptrGrabResult, Pylon::TimeoutHandling_ThrowException);
+			// Send a kickoff trigger. Subsequent triggers will be sent later in the Grab Loop.
+			camera.TriggerSoftware.Execute();
 
-			// Does the Grab Result actually contain an image?
-			if (ptrGrabResult->GrabSucceeded())
+			// GRAB LOOP: Here we will retrieve images from the Grab Engine and process them.
+			while (camera.IsGrabbing())
 			{
-				imageCounter++;
-				std::cout << "Image " << imageCounter << " Retrieved." << std::endl;
+				// Retrieve a "Grab Result" from the Grab Engine. If nothing shows up by the timeout end, throw an exception.
+				camera.RetrieveResult(5000, ptrGrabResult, Pylon::TimeoutHandling_ThrowException);
 
-				// Store this image.
-				image.CopyImage(ptrGrabResult);
-				images.push_back(image);
+				// Does the Grab Result actually contain an image?
+				if (ptrGrabResult->GrabSucceeded())
+				{
+					imageCounter++;
+					std::cout << "Image " << imageCounter << " Retrieved.";
 
-				// DEMO: we can show the user a 'progress bar' by stitching images side by side
-				std::string errorMessage = "";
-				StitchImage::StitchToRight(stitchedImage, image, &stitchedImage, errorMessage);
-				Pylon::DisplayImage(1, stitchedImage);
-				if (imageCounter == c_imagesPerHDR)
-					stitchedImage.Release();
+					// EXPOSURE STATISTICS: From the raw buffer, before anything else touches the image.
+					if (c_computeFrameStatistics)
+					{
+						FrameStatistics::Statistics statistics;
+						if (PublishFrameStatistics(imageCounter - 1, ptrGrabResult, statistics))
+							std::cout << " (mean " << (statistics.mean * 100) << "%, clipped " << (statistics.clippedFraction * 100) << "%)";
+					}
+					std::cout << std::endl;
+
+					// Store this image.
+					image.CopyImage(ptrGrabResult);
+					images.push_back(image);
+					timestamps.push_back(ptrGrabResult->GetTimeStamp());
+
+					// DEMO: we can show the user a 'progress bar' by stitching images side by side
+					std::string errorMessage = "";
+					StitchImage::StitchToRight(stitchedImage, image, &stitchedImage, errorMessage);
+					Pylon::DisplayImage(1, stitchedImage);
+					if (imageCounter == c_imagesPerHDR)
+						stitchedImage.Release();
+				}
+				else
+				{
+					// The grab result failed. Show the error message that came with it.
+					std::cout << "Error: " << ptrGrabResult->GetErrorCode() << " " << ptrGrabResult->GetErrorDescription() << std::endl;
+				}
+					
+				// Once we have all the images, do HDR processing	
+				if (images.size() == c_imagesPerHDR)
+				{
+					// First, we can now send another trigger to the camera to get a head start on the next batch of images.
+					cout << "Received all images. Sending trigger for next batch..." << endl;
+					camera.TriggerSoftware.Execute();
+
+					// EXPOSURE ORDER: Where the camera's timestamps put each exposure.
+					if (timestamps.size() == c_imagesPerHDR)
+					{
+						for (size_t i = 0; i < timestamps.size(); i++)
+							measuredStarts[i] += (timestamps[i] - timestamps[0]) / c_timestampTicksPerMicrosecond;
+						measuredBrackets++;
+					}
+
+					// RECORDING: Save the bracket before it is processed.
+					if (c_recordBrackets)
+					{
+						std::string errorMessage = "";
+						if (datasetWriter.WriteBracket(images, exposureTimes, timestamps, errorMessage, g_fusionSettings.placements) != 0)
+							cout << errorMessage << endl;
+					}
+
+					if (c_useFusionQueue)
+					{
+						// QUEUED FUSION: The fusion thread will create and display the HDR Image.
+						std::string errorMessage = "";
+						if (fusionQueue.Push(images, errorMessage) != 0)
+							cout << errorMessage << endl;
+					}
+					else
+					{
+						// Create and display the HDR Image.
+						std::cout << "Generating HDR Image for current batch..." << std::endl;
+						Pylon::CPylonImage hdrImage;
+						HDRFusion::CreateHDR(images, hdrImage, g_fusionSettings);
+						Pylon::DisplayImage(0, hdrImage);
+						ReportFirstHDR();
+						std::cout << "HDR Image Generated!" << std::endl;
+						std::cout << std::endl;
+					}
+
+					// Clean up for the next run
+					imageCounter = 0;
+					images.clear();
+					timestamps.clear();
+				}
 			}
-			else
+
+			// PARTIAL ROI / WARM-UP: Give the last buffer back to the pool, and give the camera its default buffer factory back.
+			if (c_usePartialROI || c_warmUpPipeline)
 			{
-				// The grab result failed. Show the error message that came with it.
-				std::cout << "Error: " << ptrGrabResult->GetErrorCode() << " " << ptrGrabResult->GetErrorDescription() << std::endl;
+				ptrGrabResult.Release();
+				camera.SetBufferFactory(NULL, Pylon::Cleanup_None);
 			}
-					
-			// Once we have all the images, do HDR processing	
-			if (images.size() == c_imagesPerHDR)
+
+			if (c_computeFrameStatistics)
+				PrintExposureStatistics(c_imagesPerHDR);
+
+			// EXPOSURE ORDER: Compare the timing model with what the camera measured.
+			if (measuredBrackets > 0 && predictedStarts.empty() == false)
 			{
-				// First, we can now send another trigger to the camera to get a head start on the next batch of images.
-				cout << "Received all images. Sending trigger for next batch..." << endl;
-				camera.TriggerSoftware.Execute();
-
-				// Create and display the HDR Image.
-				std::cout << "Generating HDR Image for current batch..." << std::endl;
-				Pylon::CPylonImage hdrImage;
-				CreateHDR(images, hdrImage);
-				Pylon::DisplayImage(0, hdrImage);
-				std::cout << "HDR Image Generated!" << std::endl;
-				std::cout << std::endl;
-
-				// Clean up for the next run
-				imageCounter = 0;
-				images.clear();
+				cout << "Exposure start (predicted / measured, us):";
+				for (size_t i = 0; i < measuredStarts.size() && i < predictedStarts.size(); i++)
+					cout << " " << predictedStarts[i] << " / " << (measuredStarts[i] / measuredBrackets);
+				cout << endl;
+			}
+
+			// RECORDING: Write the index, so the file can be read.
+			if (c_recordBrackets)
+			{
+				std::string errorMessage = "";
+				if (datasetWriter.Close(errorMessage) != 0)
+					cout << errorMessage << endl;
+				else
+					cout << "Brackets recorded to " << c_recordingPath << endl;
 			}
 		}
 	}
@@ -296,6 +1231,15 @@ int main(int argc, char* argv[])
 		exitCode = 1;
 	}
 
+	// QUEUED FUSION: Let the fusion thread finish the backlog.
+	if (fusionThread.joinable())
+	{
+		fusionQueue.Close();
+		fusionThread.join();
+		fusionQueue.Stop();
+		PrintQueueStatistics(fusionQueue);
+	}
+
 	// Comment the following two lines to disable waiting on exit.
 	std::cerr << std::endl << "Press Enter to exit." << std::endl;
 	while (std::cin.get() != '\n');
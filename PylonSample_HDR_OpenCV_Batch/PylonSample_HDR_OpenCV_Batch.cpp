@@ -0,0 +1,887 @@
+/*
+// PylonSample_HDR_OpenCV_Batch.cpp
+//
+// Offline tool that fuses recorded brackets into HDR images, using all cores.
+// Work is scheduled on a work-stealing pool both across brackets and across tiles within a bracket,
+// so small images keep every core busy and large images are fused in cache-sized pieces.
+// Only a bounded number of brackets is loaded at a time, and results are written to disk as they finish.
+//
+// Usage: PylonSample_HDR_OpenCV_Batch <input directory or .hdrb file> <output directory> [options]
+//   --threads 1,2,4,8   Run once per thread count and report brackets per second for each (default: all cores).
+//   --tile N            Fuse images larger than N x N pixels in tiles of N x N (default 1024, 0 = never tile).
+//   --margin N          Extra pixels fused around each tile so tile borders match (default 64). Tiled brackets are
+//                       fused only as deep as the margin reaches (5 levels for 64, see HDRFusion::GetPyramidSupport()).
+//   --inflight N        Maximum number of brackets held in memory at once (default 2 per thread).
+//   --nowrite           Fuse, but don't write the results (for benchmarking).
+//   --async N           Instead, issue N concurrent fusion requests through the coroutine API (HDRPipelineAsync.h)
+//                       and report requests per second. Needs a C++20 build.
+//   --deghost           Keep parts that moved during a bracket from showing up more than once (see Deghosting.h).
+//   --exposurefusion    Fuse with ExposureFusion.h instead of OpenCV's MergeMertens.
+//   --fp16              Keep the fusion pyramids as half floats (half the memory, see ExposureFusion.h).
+//   --stream            Fuse row by row, holding only a few rows of pyramids (see StreamingFusion.h). Never tiles.
+//   --depth N|auto      Stop the fusion pyramid N levels below full resolution, or where the scene needs (see ExposureFusion.h).
+//   --gamma G           Write the results with a gamma of G (through a lookup table, see ToneCurve.h).
+//   --contrast C        Write the results through an S-curve of strength C (-1..1).
+//   --weights C,S,E     The exponents of the contrast, saturation and well-exposedness weights (default 1,1,0). MergeMertens
+//                       computes all three terms; with --exposurefusion or --stream, 0 skips a term (see ExposureFusion.h).
+//
+// Usage: PylonSample_HDR_OpenCV_Batch --rebuild-index <.hdrb file>
+//   Repairs the index of a dataset file whose recording was interrupted.
+//
+// Usage: PylonSample_HDR_OpenCV_Batch --evaluate
+//   Fuses synthetic brackets (see FusionEvaluation.h) in each way the fusion can be set up, and reports the time
+//   and the image quality of each.
+//
+// The input is either a dataset file recorded by the Advanced sample (see BracketDataset.h), or a directory
+// that holds the images of each bracket as <bracket name>_<exposure index>.<png|tif|tiff|bmp>,
+// for example "frame0001_0.png", "frame0001_1.png", "frame0001_2.png".
+// Each fused image is written to the output directory as <bracket name>_hdr.png.
+//
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Uses OpenCV libraries. License information can be found here:
+// https://opencv.org/license/
+*/
+
+// Include files to use OpenCV
+// This Sample uses OpenCV 3.0
+// The Visual Studio project uses static OpenCV libraries
+#include <opencv2/opencv.hpp>
+#include <opencv2/photo/photo.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+// Include files to use the PYLON API.
+#include <pylon/PylonIncludes.h>
+
+// The exposure fusion shared by the samples and tools
+#include "../include/HDRFusion.h"
+
+// Thread pool that schedules brackets and tiles
+#include "../include/WorkStealingPool.h"
+
+// Container file for recorded brackets
+#include "../include/BracketDataset.h"
+
+// Coroutine API for embedding the pipeline (C++20 builds only)
+#include "../include/HDRPipelineAsync.h"
+
+// Synthetic brackets, timing and quality measures for --evaluate
+#include "../include/FusionEvaluation.h"
+
+// STD libraries needed
+#include <vector>
+#include <map>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+// Default tile size (in pixels). Images larger than this are fused tile by tile.
+static const int c_defaultTileSize = 1024;
+// Default number of pixels fused around each tile and then thrown away, so the tile borders don't show.
+static const int c_defaultTileMargin = 64;
+// EVALUATION: Timed runs per measurement (the median is reported).
+static const int c_evaluationRuns = 5;
+
+struct BatchOptions
+{
+	std::string inputPath;
+	std::string outputPath;
+	std::vector<size_t> threadCounts;
+	int tileSize = c_defaultTileSize;
+	int tileMargin = c_defaultTileMargin;
+	size_t maxInFlight = 0; // 0 = 2 per thread
+	bool writeResults = true;
+	std::string rebuildIndexPath;
+	size_t asyncRequests = 0; // 0 = run the batch instead
+	HDRFusion::FusionSettings fusionSettings;
+	bool evaluate = false;
+};
+
+// Where the recorded brackets come from.
+class CBracketSource
+{
+public:
+	virtual ~CBracketSource() {}
+	virtual size_t GetCount() = 0;
+	virtual std::string GetName(size_t index) = 0;
+	virtual bool Load(size_t index, std::vector<cv::Mat> &images) = 0;
+};
+
+// Brackets stored as image files in a directory, named <bracket name>_<exposure index>.<ext>.
+class CDirectorySource : public CBracketSource
+{
+private:
+	std::vector<std::string> m_names;
+	std::vector<std::vector<std::string>> m_files;
+
+public:
+	int Open(const std::string &directory, std::string &errorMessage)
+	{
+		errorMessage = "ERROR: ";
+		errorMessage.append(__FUNCTION__);
+		errorMessage.append("(): ");
+
+		try
+		{
+			const char *extensions[] = { "png", "tif", "tiff", "bmp" };
+			std::map<std::string, std::map<int, std::string>> brackets;
+
+			for (size_t e = 0; e < sizeof(extensions) / sizeof(extensions[0]); e++)
+			{
+				std::vector<cv::String> files;
+				cv::glob(directory + "/*." + extensions[e], files, false);
+
+				for (size_t i = 0; i < files.size(); i++)
+				{
+					std::string file = files[i];
+					size_t slash = file.find_last_of("/\\");
+					size_t dot = file.find_last_of('.');
+					size_t underscore = file.find_last_of('_');
+					if (underscore == std::string::npos || dot == std::string::npos || underscore < slash + 1 || underscore > dot)
+						continue;
+
+					std::string name = file.substr(slash + 1, underscore - slash - 1);
+					int exposureIndex = atoi(file.substr(underscore + 1, dot - underscore - 1).c_str());
+					brackets[name][exposureIndex] = file;
+				}
+			}
+
+			for (std::map<std::string, std::map<int, std::string>>::iterator it = brackets.begin(); it != brackets.end(); ++it)
+			{
+				std::vector<std::string> files;
+				for (std::map<int, std::string>::iterator file = it->second.begin(); file != it->second.end(); ++file)
+					files.push_back(file->second);
+				m_names.push_back(it->first);
+				m_files.push_back(files);
+			}
+
+			if (m_names.empty())
+			{
+				errorMessage.append("No brackets found in ");
+				errorMessage.append(directory);
+				return 1;
+			}
+
+			return 0;
+		}
+		catch (std::exception &e)
+		{
+			errorMessage.append("EXCEPTION: ");
+			errorMessage.append(e.what());
+			return 1;
+		}
+	}
+
+	virtual size_t GetCount()
+	{
+		return m_names.size();
+	}
+
+	virtual std::string GetName(size_t index)
+	{
+		return m_names[index];
+	}
+
+	virtual bool Load(size_t index, std::vector<cv::Mat> &images)
+	{
+		images.clear();
+		for (size_t i = 0; i < m_files[index].size(); i++)
+		{
+			cv::Mat image = cv::imread(m_files[index][i], cv::IMREAD_COLOR);
+			if (image.empty())
+				return false;
+			images.push_back(image);
+		}
+		return images.size() > 1;
+	}
+};
+
+// Brackets recorded into a dataset file. The file is memory-mapped, so loading a bracket reads nothing up front.
+class CDatasetSource : public CBracketSource
+{
+private:
+	BracketDataset::CBracketDatasetReader m_reader;
+
+public:
+	int Open(const std::string &path, std::string &errorMessage)
+	{
+		return m_reader.Open(path, errorMessage);
+	}
+
+	virtual size_t GetCount()
+	{
+		return (size_t)m_reader.GetBracketCount();
+	}
+
+	virtual std::string GetName(size_t index)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "bracket%06u", (unsigned int)index);
+		return name;
+	}
+
+	virtual bool Load(size_t index, std::vector<cv::Mat> &images)
+	{
+		images.clear();
+
+		Pylon::CImageFormatConverter converter;
+		converter.OutputPixelFormat.SetValue(HDRFusion::c_openCVPixelType);
+
+		// Frames recorded with their own ROI or binning are placed into the full frame before fusion.
+		std::vector<HDRFusion::FramePlacement> placements;
+		bool partialFrames = false;
+
+		for (uint32_t i = 0; i < m_reader.GetImagesPerBracket(); i++)
+		{
+			const BracketDataset::FrameEntry &entry = m_reader.GetFrameEntry(index, i);
+			HDRFusion::FramePlacement placement = { entry.offsetX, entry.offsetY, entry.binning };
+			placements.push_back(placement);
+			if (entry.offsetX != 0 || entry.offsetY != 0 || entry.binning > 1)
+				partialFrames = true;
+
+			// Frames recorded in the fusion format are used in place (a view on the mapped file).
+			cv::Mat frame = m_reader.GetFrameMat(index, i);
+			if (!frame.empty() && (Pylon::EPixelType)entry.pixelType == HDRFusion::c_openCVPixelType)
+			{
+				images.push_back(frame);
+				continue;
+			}
+
+			// Everything else is converted straight from the mapped file.
+			Pylon::CPylonImage image;
+			m_reader.GetFrameImage(index, i, image);
+			cv::Mat converted((int)entry.height, (int)entry.width, CV_8UC3);
+			converter.Convert(converted.data, converted.total() * converted.elemSize(), image);
+			images.push_back(converted);
+		}
+
+		// Also catches partial frames at offset 0: any size mismatch means placing is needed.
+		for (size_t i = 1; i < images.size(); i++)
+		{
+			if (images[i].size() != images[0].size())
+				partialFrames = true;
+		}
+		if (partialFrames)
+			HDRFusion::PlaceImages(images, placements);
+
+		return images.size() > 1;
+	}
+};
+
+// One bracket on its way through the pool.
+struct BracketJob
+{
+	size_t index = 0;
+	std::vector<cv::Mat> images;
+	cv::Mat hdrMat;
+	std::atomic<int> tilesLeft;
+	std::atomic<bool> failed{ false }; // a tile failed: the result isn't written
+};
+
+// STREAMING: Fuse a bracket row by row, straight into its BGR8 result. Only a few rows of each pyramid level are held
+// at any time, whatever the size of the images, so there is nothing to gain from tiles.
+void StreamBracket(BracketJob &job, const HDRFusion::FusionSettings &fusionSettings)
+{
+	StreamingFusion::Settings settings;
+	settings.depth = fusionSettings.streamingDepth;
+	settings.weights = fusionSettings.weights;
+
+	cv::Size size = job.images[0].size();
+	job.hdrMat.create(size, CV_8UC3);
+	StreamingFusion::CStreamingFusion stream(size, job.images.size(), settings, [&job, &fusionSettings](int y, const float *pBGR)
+	{
+		cv::Mat row = job.hdrMat.row(y);
+		HDRFusion::WriteOutput(cv::Mat(1, job.hdrMat.cols, CV_32FC3, (void*)pBGR), HDRFusion::OutputFormat_BGR8, row, fusionSettings.toneCurve.get());
+	});
+
+	std::vector<const uint8_t*> rows(job.images.size());
+	for (int y = 0; y < size.height; y++)
+	{
+		for (size_t i = 0; i < job.images.size(); i++)
+			rows[i] = job.images[i].ptr<uint8_t>(y);
+		stream.PushRow(rows);
+	}
+}
+
+// Runs the whole batch on 'numThreads' threads. Returns the number of brackets fused.
+size_t RunBatch(CBracketSource &source, const BatchOptions &options, size_t numThreads)
+{
+	// Our pool already keeps every core busy. OpenCV's own threads on top of that would only compete with it.
+	cv::setNumThreads(1);
+
+	WorkStealingPool::CWorkStealingPool pool(numThreads);
+	size_t maxInFlight = (options.maxInFlight > 0) ? options.maxInFlight : 2 * pool.GetNumThreads();
+
+	// BOUNDED MEMORY: no more than maxInFlight brackets are loaded at any time.
+	std::mutex inFlightLock;
+	std::condition_variable inFlightChanged;
+	size_t inFlight = 0;
+	std::atomic<size_t> fusedBrackets(0);
+	std::mutex printLock;
+
+	// Write the result (unless a tile of it failed) and free the bracket's slot.
+	std::function<void(std::shared_ptr<BracketJob>)> finishBracket = [&](std::shared_ptr<BracketJob> job)
+	{
+		if (options.writeResults && job->failed == false)
+		{
+			std::string file = options.outputPath + "/" + source.GetName(job->index) + "_hdr.png";
+			if (cv::imwrite(file, job->hdrMat) == false)
+			{
+				std::lock_guard<std::mutex> lock(printLock);
+				std::cout << "Error: could not write " << file << std::endl;
+			}
+		}
+
+		job->images.clear();
+		job->hdrMat.release();
+		if (job->failed == false)
+			fusedBrackets++;
+
+		std::lock_guard<std::mutex> lock(inFlightLock);
+		inFlight--;
+		inFlightChanged.notify_all();
+	};
+
+	// Tiles only match at their borders where the margin covers the pyramid. Its coarser levels (the overall brightness)
+	// would come out differently in each tile, so tiled brackets stop the pyramid at the levels the margin covers.
+	HDRFusion::FusionSettings tileSettings = options.fusionSettings;
+	int tileDepth = 1;
+	while (HDRFusion::GetPyramidSupport(tileDepth + 1) <= options.tileMargin)
+		tileDepth++;
+	if (tileSettings.pyramidDepth <= 0 || tileSettings.pyramidDepth > tileDepth)
+		tileSettings.pyramidDepth = tileDepth;
+
+	std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+	for (size_t index = 0; index < source.GetCount(); index++)
+	{
+		{
+			std::unique_lock<std::mutex> lock(inFlightLock);
+			inFlightChanged.wait(lock, [&] { return inFlight < maxInFlight; });
+			inFlight++;
+		}
+
+		pool.Submit([&, index]
+		{
+			std::shared_ptr<BracketJob> job(new BracketJob());
+			job->index = index;
+
+			try
+			{
+				if (source.Load(index, job->images) == false)
+				{
+					{
+						std::lock_guard<std::mutex> lock(printLock);
+						std::cout << "Error: could not load bracket " << source.GetName(index) << std::endl;
+					}
+					std::lock_guard<std::mutex> lock(inFlightLock);
+					inFlight--;
+					inFlightChanged.notify_all();
+					return;
+				}
+
+				int width = job->images[0].cols;
+				int height = job->images[0].rows;
+				int tileSize = options.tileSize;
+
+				if (options.fusionSettings.engine == HDRFusion::FusionEngine_Streaming && options.fusionSettings.deghost == false)
+				{
+					StreamBracket(*job, options.fusionSettings);
+					finishBracket(job);
+					return;
+				}
+
+				// Small images are fused in one piece.
+				if (tileSize <= 0 || (width <= tileSize && height <= tileSize))
+				{
+					HDRFusion::FuseImages(job->images, job->hdrMat, options.fusionSettings);
+					finishBracket(job);
+					return;
+				}
+
+				// Large images are split into tiles. The tiles go onto this worker's deque, so idle workers steal them.
+				int tilesX = (width + tileSize - 1) / tileSize;
+				int tilesY = (height + tileSize - 1) / tileSize;
+				job->hdrMat.create(height, width, CV_8UC3);
+				job->tilesLeft = tilesX * tilesY;
+
+				for (int ty = 0; ty < tilesY; ty++)
+				{
+					for (int tx = 0; tx < tilesX; tx++)
+					{
+						cv::Rect tile(tx * tileSize, ty * tileSize, std::min(tileSize, width - tx * tileSize), std::min(tileSize, height - ty * tileSize));
+
+						pool.Submit([&, job, tile]
+						{
+							try
+							{
+								// Fuse the tile plus a margin, then keep only the tile itself.
+								cv::Rect padded(tile.x - options.tileMargin, tile.y - options.tileMargin, tile.width + 2 * options.tileMargin, tile.height + 2 * options.tileMargin);
+								padded &= cv::Rect(0, 0, job->hdrMat.cols, job->hdrMat.rows);
+
+								std::vector<cv::Mat> tileImages;
+								for (size_t i = 0; i < job->images.size(); i++)
+									tileImages.push_back(job->images[i](padded));
+
+								cv::Mat tileHdr;
+								HDRFusion::FuseImages(tileImages, tileHdr, tileSettings);
+								cv::Mat tileOutput = job->hdrMat(tile);
+								tileHdr(cv::Rect(tile.x - padded.x, tile.y - padded.y, tile.width, tile.height)).copyTo(tileOutput);
+							}
+							catch (std::exception &e)
+							{
+								job->failed = true;
+								std::lock_guard<std::mutex> lock(printLock);
+								std::cout << "Error: fusing a tile of bracket " << source.GetName(job->index) << " failed: " << e.what() << std::endl;
+							}
+
+							// The last tile to finish writes the bracket.
+							if (--job->tilesLeft == 0)
+								finishBracket(job);
+						});
+					}
+				}
+			}
+			catch (std::exception &e)
+			{
+				{
+					std::lock_guard<std::mutex> lock(printLock);
+					std::cout << "Error: fusing bracket " << source.GetName(index) << " failed: " << e.what() << std::endl;
+				}
+				std::lock_guard<std::mutex> lock(inFlightLock);
+				inFlight--;
+				inFlightChanged.notify_all();
+			}
+		});
+	}
+
+	pool.Wait();
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	std::cout << pool.GetNumThreads() << " threads: " << fusedBrackets << " brackets in " << seconds << " s = "
+		<< (fusedBrackets / seconds) << " brackets/s (" << pool.GetStealCount() << " steals)" << std::endl;
+
+	return fusedBrackets;
+}
+
+#ifdef HDRPIPELINEASYNC_AVAILABLE
+// One embedded client: awaits the fusion of a bracket, without holding a thread while it waits.
+HDRAsync::Task<bool> FuseRequest(HDRAsync::CFusionService &service, std::vector<cv::Mat> images)
+{
+	HDRAsync::FusionResult result = co_await service.Fuse(images);
+	co_return result.error.empty() && !result.cancelled;
+}
+
+// Issue many concurrent requests through the coroutine API and report the throughput.
+// The brackets are loaded once up front (and reused round robin), so this measures the API and the fusion, not the disk.
+size_t RunAsync(CBracketSource &source, const BatchOptions &options, size_t numThreads)
+{
+	std::vector<std::vector<cv::Mat>> brackets(source.GetCount());
+	for (size_t i = 0; i < brackets.size(); i++)
+	{
+		if (source.Load(i, brackets[i]) == false)
+		{
+			std::cout << "Error: loading bracket " << source.GetName(i) << " failed." << std::endl;
+			return 0;
+		}
+	}
+
+	// The service's pool already keeps every core busy (see RunBatch()).
+	cv::setNumThreads(1);
+	HDRAsync::CFusionService service(numThreads, options.fusionSettings);
+	std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+	std::vector<HDRAsync::Task<bool>> requests;
+	for (size_t i = 0; i < options.asyncRequests; i++)
+		requests.push_back(FuseRequest(service, brackets[i % brackets.size()]));
+	for (size_t i = 0; i < requests.size(); i++)
+		requests[i].Start();
+
+	size_t fused = 0;
+	for (size_t i = 0; i < requests.size(); i++)
+	{
+		if (requests[i].Get())
+			fused++;
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	std::cout << service.GetNumThreads() << " threads: " << fused << " of " << requests.size() << " async requests in " << seconds << " s = "
+		<< (fused / seconds) << " requests/s" << std::endl;
+
+	return fused;
+}
+#endif
+
+// One way of fusing that --evaluate measures.
+struct FusionVariant
+{
+	std::string name;
+	HDRFusion::FusionSettings settings;
+	size_t compareTo = 0; // the variant whose result this one should match
+};
+
+// Fuse synthetic brackets with a moving object in every variant. Reports per variant the time per fusion, how far its
+// result is from the variant it should match, and how close it gets to the fusion of the same scene without the motion
+// (in the area the object crossed: the lower, the more ghosts).
+void RunEvaluation()
+{
+	std::vector<FusionVariant> variants(5);
+	variants[0].name = "MergeMertens";
+	variants[1].name = "ExposureFusion";
+	variants[1].settings.engine = HDRFusion::FusionEngine_ExposureFusion;
+	variants[2].name = "ExposureFusion + deghosting";
+	variants[2].settings.engine = HDRFusion::FusionEngine_ExposureFusion;
+	variants[2].settings.deghost = true;
+	variants[3].name = "ExposureFusion, FP16 pyramids";
+	variants[3].settings.engine = HDRFusion::FusionEngine_ExposureFusion;
+	variants[3].settings.pyramidStorage = ExposureFusion::PyramidStorage_Float16;
+	variants[3].compareTo = 1;
+	variants[4].name = "Streaming, 4 levels";
+	variants[4].settings.engine = HDRFusion::FusionEngine_Streaming;
+	variants[4].settings.streamingDepth = 4;
+	variants[4].compareTo = 1;
+
+	const cv::Size sizes[] = { cv::Size(1024, 768), cv::Size(2448, 2048) };
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	{
+		cv::Size size = sizes[s];
+		FusionEvaluation::MovingObjectBracket bracket;
+		FusionEvaluation::CreateMovingObjectBracket(size, 3, 1, size.height / 6, size.height / 8, bracket);
+		cv::Rect frame(0, 0, size.width, size.height);
+
+		std::cout << std::endl << size.width << " x " << size.height << ", 3 exposures, object moving " << size.height / 8 << " pixels per exposure:" << std::endl;
+		std::cout << "  ms per fusion | PSNR vs the variant it should match (dB) | PSNR where it moved vs no motion (dB) | variant" << std::endl;
+
+		std::vector<cv::Mat> fusions(variants.size());
+		for (size_t v = 0; v < variants.size(); v++)
+		{
+			const HDRFusion::FusionSettings &settings = variants[v].settings;
+			cv::Mat &fusion = fusions[v];
+			double ms = FusionEvaluation::TimeMs([&] { HDRFusion::FuseToFloat(bracket.images, fusion, settings); }, c_evaluationRuns);
+
+			// Without the motion, deghosting has nothing to do.
+			HDRFusion::FusionSettings staticSettings = settings;
+			staticSettings.deghost = false;
+			cv::Mat noMotion;
+			HDRFusion::FuseToFloat(bracket.staticImages, noMotion, staticSettings);
+
+			const FusionVariant &reference = variants[variants[v].compareTo];
+			std::cout << "  " << ms << " | " << FusionEvaluation::Psnr(fusion, fusions[variants[v].compareTo], frame) << " (" << reference.name << ") | "
+				<< FusionEvaluation::Psnr(fusion, noMotion, bracket.motionArea) << " | " << variants[v].name << std::endl;
+		}
+		std::cout << "  Pyramid memory: " << ExposureFusion::GetBlendMemory(size, ExposureFusion::PyramidStorage_Float32) / (1024 * 1024) << " MB as floats, "
+			<< ExposureFusion::GetBlendMemory(size, ExposureFusion::PyramidStorage_Float16) / (1024 * 1024) << " MB as half floats" << std::endl;
+		StreamingFusion::Settings streaming;
+		streaming.depth = variants[4].settings.streamingDepth;
+		StreamingFusion::CStreamingFusion stream(size, bracket.images.size(), streaming, [](int, const float*) {});
+		std::cout << "  Streaming: " << stream.GetMemory() / 1024 << " KB of rows, output " << stream.GetLatency() << " rows behind the input" << std::endl;
+
+		// PYRAMID OUTPUT: 3 scales of the result from the collapse, against pyrDown'ing the result afterwards.
+		HDRFusion::FusionSettings levelSettings = variants[1].settings;
+		levelSettings.pyramidOutputLevels = 3;
+		std::vector<cv::Mat> levels;
+		double plainMs = FusionEvaluation::TimeMs([&] { cv::Mat fusion; HDRFusion::FuseToFloat(bracket.images, fusion, levelSettings); }, c_evaluationRuns);
+		double levelsMs = FusionEvaluation::TimeMs([&] { cv::Mat fusion; HDRFusion::FuseToFloat(bracket.images, fusion, levelSettings, &levels); }, c_evaluationRuns);
+		double pyrDownMs = FusionEvaluation::TimeMs([&] { levels.clear(); HDRFusion::Detail::ReduceLevels(fusions[1], 3, levels); }, c_evaluationRuns);
+		std::cout << "  Pyramid output, 3 scales: " << levelsMs - plainMs << " ms from the collapse, " << pyrDownMs << " ms with pyrDown" << std::endl;
+
+		// PYRAMID DEPTH: every depth the image allows, and the one the auto depth picks, against the full depth.
+		HDRFusion::FusionSettings depthSettings = variants[1].settings;
+		int fullDepth = ExposureFusion::GetPyramidDepth(size);
+		std::vector<cv::Mat> depthWeights;
+		ExposureFusion::ComputeWeights(bracket.images, depthSettings.weights, depthWeights);
+		ExposureFusion::NormalizeWeights(depthWeights);
+		int autoDepth = ExposureFusion::GetAutoPyramidDepth(depthWeights);
+		std::cout << "  Pyramid depth | ms per fusion | PSNR vs full depth (dB)" << std::endl;
+		for (int depth = 1; depth <= fullDepth + 1; depth++)
+		{
+			// The last row is the auto depth, its time including the measurement.
+			depthSettings.pyramidDepth = (depth <= fullDepth) ? depth : HDRFusion::c_autoPyramidDepth;
+			cv::Mat fusion;
+			double ms = FusionEvaluation::TimeMs([&] { HDRFusion::FuseToFloat(bracket.images, fusion, depthSettings); }, c_evaluationRuns);
+			std::cout << "  " << ((depth <= fullDepth) ? std::to_string(depth) : "auto (" + std::to_string(autoDepth) + ")") << " | " << ms << " | "
+				<< FusionEvaluation::Psnr(fusion, fusions[1], frame) << std::endl;
+		}
+
+		// TONE CURVE: gamma 2.2 and some contrast on the way to BGR8, through the table against one float pass per step.
+		ToneCurve::Settings tone;
+		tone.gamma = 2.2f;
+		tone.contrast = 0.3f;
+		std::shared_ptr<const ToneCurve::CToneLut> toneCurve = ToneCurve::Create(tone);
+		cv::Mat output;
+		double linearMs = FusionEvaluation::TimeMs([&] { HDRFusion::WriteOutput(fusions[1], HDRFusion::OutputFormat_BGR8, output); }, c_evaluationRuns);
+		double tableMs = FusionEvaluation::TimeMs([&] { HDRFusion::WriteOutput(fusions[1], HDRFusion::OutputFormat_BGR8, output, toneCurve.get()); }, c_evaluationRuns);
+		double floatMs = FusionEvaluation::TimeMs([&]
+		{
+			// x + contrast * (3x^2 - 2x^3 - x), after the gamma.
+			cv::Mat toned;
+			cv::Mat squared;
+			cv::Mat cubed;
+			cv::threshold(fusions[1], toned, 0, 0, cv::THRESH_TOZERO);
+			cv::pow(toned, 1.0 / tone.gamma, toned);
+			cv::multiply(toned, toned, squared);
+			cv::multiply(squared, toned, cubed);
+			cv::addWeighted(toned, 1.0 - tone.contrast, squared, 3.0 * tone.contrast, 0, toned);
+			cv::addWeighted(toned, 1.0, cubed, -2.0 * tone.contrast, 0, toned);
+			toned.convertTo(output, CV_8UC3, 255);
+		}, c_evaluationRuns);
+		std::cout << "  Writing BGR8: " << linearMs << " ms as it is, " << tableMs << " ms with a tone curve through the table, "
+			<< floatMs << " ms with the same curve in float passes" << std::endl;
+
+		// WEIGHT TERMS: the weights with every combination of terms switched on (exponent 1), each with its own kernel.
+		std::cout << "  Weight terms | ms for the weights" << std::endl;
+		for (int terms = 1; terms < 8; terms++)
+		{
+			ExposureFusion::Parameters parameters;
+			parameters.contrastWeight = (terms & ExposureFusion::WeightTerm_Contrast) ? 1.0f : 0.0f;
+			parameters.saturationWeight = (terms & ExposureFusion::WeightTerm_Saturation) ? 1.0f : 0.0f;
+			parameters.exposureWeight = (terms & ExposureFusion::WeightTerm_Exposure) ? 1.0f : 0.0f;
+			std::string name;
+			name += (parameters.contrastWeight != 0) ? "contrast " : "";
+			name += (parameters.saturationWeight != 0) ? "saturation " : "";
+			name += (parameters.exposureWeight != 0) ? "exposure " : "";
+			if (terms == ExposureFusion::WeightTerm_Exposure)
+				name += "(table) ";
+			std::vector<cv::Mat> termWeights;
+			double ms = FusionEvaluation::TimeMs([&] { ExposureFusion::ComputeWeights(bracket.images, parameters, termWeights); }, c_evaluationRuns);
+			std::cout << "  " << name << "| " << ms << std::endl;
+		}
+
+		// The deghosting stage on its own, against the fusion it is part of.
+		HDRFusion::FusionSettings settings = variants[2].settings;
+		std::vector<cv::Mat> weights;
+		std::vector<cv::Mat> masks;
+		ExposureFusion::ComputeWeights(bracket.images, settings.weights, weights);
+		size_t referenceIndex = HDRFusion::GetReferenceIndex(settings, bracket.images.size());
+		double maskMs = FusionEvaluation::TimeMs([&] { Deghosting::ComputeMotionMasks(bracket.images, referenceIndex, settings.deghosting, masks); }, c_evaluationRuns);
+		// Each run suppresses a fresh copy of the weights (the same weights again and again would shrink toward denormals).
+		// The copy's own time is taken off.
+		std::vector<cv::Mat> runWeights(weights.size());
+		std::function<void()> copyWeights = [&]
+		{
+			for (size_t i = 0; i < weights.size(); i++)
+				weights[i].copyTo(runWeights[i]);
+		};
+		double copyMs = FusionEvaluation::TimeMs(copyWeights, c_evaluationRuns);
+		double suppressMs = FusionEvaluation::TimeMs([&] { copyWeights(); Deghosting::SuppressMotion(runWeights, masks); }, c_evaluationRuns) - copyMs;
+		double fusionMs = FusionEvaluation::TimeMs([&] { cv::Mat fusion; HDRFusion::FuseToFloat(bracket.images, fusion, settings); }, c_evaluationRuns);
+		std::cout << "  Deghosting: " << maskMs << " ms for the masks + " << suppressMs << " ms to apply them = "
+			<< 100.0 * (maskMs + suppressMs) / fusionMs << " % of the fusion" << std::endl;
+	}
+}
+
+int ParseArguments(int argc, char* argv[], BatchOptions &options, std::string &errorMessage)
+{
+	errorMessage = "ERROR: ";
+	errorMessage.append(__FUNCTION__);
+	errorMessage.append("(): ");
+
+	std::vector<std::string> positional;
+	ToneCurve::Settings tone;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool hasValue = (i + 1 < argc);
+
+		if (arg == "--threads" && hasValue)
+		{
+			std::stringstream list(argv[++i]);
+			std::string count;
+			while (std::getline(list, count, ','))
+				options.threadCounts.push_back((size_t)atoi(count.c_str()));
+		}
+		else if (arg == "--tile" && hasValue)
+			options.tileSize = atoi(argv[++i]);
+		else if (arg == "--margin" && hasValue)
+			options.tileMargin = atoi(argv[++i]);
+		else if (arg == "--inflight" && hasValue)
+			options.maxInFlight = (size_t)atoi(argv[++i]);
+		else if (arg == "--nowrite")
+			options.writeResults = false;
+		else if (arg == "--rebuild-index" && hasValue)
+			options.rebuildIndexPath = argv[++i];
+		else if (arg == "--async" && hasValue)
+			options.asyncRequests = (size_t)atoi(argv[++i]);
+		else if (arg == "--deghost")
+		{
+			options.fusionSettings.engine = HDRFusion::FusionEngine_ExposureFusion;
+			options.fusionSettings.deghost = true;
+		}
+		else if (arg == "--exposurefusion")
+			options.fusionSettings.engine = HDRFusion::FusionEngine_ExposureFusion;
+		else if (arg == "--fp16")
+			options.fusionSettings.pyramidStorage = ExposureFusion::PyramidStorage_Float16;
+		else if (arg == "--stream")
+			options.fusionSettings.engine = HDRFusion::FusionEngine_Streaming;
+		else if (arg == "--depth" && hasValue)
+		{
+			std::string depth = argv[++i];
+			options.fusionSettings.pyramidDepth = (depth == "auto") ? HDRFusion::c_autoPyramidDepth : atoi(depth.c_str());
+		}
+		else if (arg == "--gamma" && hasValue)
+			tone.gamma = (float)atof(argv[++i]);
+		else if (arg == "--contrast" && hasValue)
+			tone.contrast = (float)atof(argv[++i]);
+		else if (arg == "--weights" && hasValue)
+		{
+			std::stringstream list(argv[++i]);
+			std::string value;
+			float *pWeights[3] = { &options.fusionSettings.weights.contrastWeight, &options.fusionSettings.weights.saturationWeight,
+				&options.fusionSettings.weights.exposureWeight };
+			for (int w = 0; w < 3 && std::getline(list, value, ','); w++)
+				*pWeights[w] = (float)atof(value.c_str());
+		}
+		else if (arg == "--evaluate")
+			options.evaluate = true;
+		else if (arg.compare(0, 2, "--") == 0)
+		{
+			errorMessage.append("Unknown option ");
+			errorMessage.append(arg);
+			return 1;
+		}
+		else
+			positional.push_back(arg);
+	}
+	options.fusionSettings.toneCurve = ToneCurve::Create(tone);
+
+	if ((!options.rebuildIndexPath.empty() || options.evaluate) && positional.empty())
+		return 0;
+
+	if (positional.size() != 2)
+	{
+		errorMessage.append("Usage: PylonSample_HDR_OpenCV_Batch <input directory> <output directory> [--threads 1,2,4] [--tile N] [--margin N] [--inflight N] [--nowrite] [--async N] [--deghost] [--fp16] [--stream] [--depth N|auto] [--gamma G] [--contrast C] [--weights C,S,E]\n"
+			"       PylonSample_HDR_OpenCV_Batch --rebuild-index <.hdrb file>\n"
+			"       PylonSample_HDR_OpenCV_Batch --evaluate");
+		return 1;
+	}
+
+	options.inputPath = positional[0];
+	options.outputPath = positional[1];
+	if (options.threadCounts.empty())
+		options.threadCounts.push_back(0);
+
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	// The exit code of the sample application.
+	int exitCode = 0;
+
+	// Automagically call PylonInitialize and PylonTerminate to ensure the pylon runtime system
+	// is initialized during the lifetime of this object.
+	Pylon::PylonAutoInitTerm autoInitTerm;
+
+	try
+	{
+		BatchOptions options;
+		std::string errorMessage = "";
+		if (ParseArguments(argc, argv, options, errorMessage) != 0)
+		{
+			std::cout << errorMessage << std::endl;
+			return 1;
+		}
+
+		// Repair a dataset file instead of fusing.
+		if (!options.rebuildIndexPath.empty())
+		{
+			if (BracketDataset::RebuildIndex(options.rebuildIndexPath, errorMessage) != 0)
+			{
+				std::cout << errorMessage << std::endl;
+				return 1;
+			}
+			std::cout << "Index of " << options.rebuildIndexPath << " rebuilt." << std::endl;
+			return 0;
+		}
+
+		// Measure the fusion on synthetic brackets instead of fusing.
+		if (options.evaluate)
+		{
+			RunEvaluation();
+			return 0;
+		}
+
+		// A .hdrb file is a recorded dataset. Anything else is a directory of image files.
+		CDirectorySource directorySource;
+		CDatasetSource datasetSource;
+		CBracketSource *pSource = NULL;
+		const std::string datasetExtension = ".hdrb";
+		if (options.inputPath.size() > datasetExtension.size() && options.inputPath.compare(options.inputPath.size() - datasetExtension.size(), datasetExtension.size(), datasetExtension) == 0)
+		{
+			if (datasetSource.Open(options.inputPath, errorMessage) != 0)
+			{
+				std::cout << errorMessage << std::endl;
+				return 1;
+			}
+			pSource = &datasetSource;
+		}
+		else
+		{
+			if (directorySource.Open(options.inputPath, errorMessage) != 0)
+			{
+				std::cout << errorMessage << std::endl;
+				return 1;
+			}
+			pSource = &directorySource;
+		}
+		CBracketSource &source = *pSource;
+
+		std::cout << "Fusing " << source.GetCount() << " brackets from " << options.inputPath << std::endl;
+
+		if (options.asyncRequests > 0)
+		{
+#ifdef HDRPIPELINEASYNC_AVAILABLE
+			for (size_t i = 0; i < options.threadCounts.size(); i++)
+			{
+				if (source.GetCount() == 0 || RunAsync(source, options, options.threadCounts[i]) != options.asyncRequests)
+					exitCode = 1;
+			}
+#else
+			std::cout << "ERROR: --async needs a build with C++20 coroutine support." << std::endl;
+			exitCode = 1;
+#endif
+			return exitCode;
+		}
+
+		// One run per requested thread count, so the scaling can be compared.
+		for (size_t i = 0; i < options.threadCounts.size(); i++)
+		{
+			if (RunBatch(source, options, options.threadCounts[i]) != source.GetCount())
+				exitCode = 1;
+		}
+	}
+	catch (GenICam::GenericException &e)
+	{
+		// Error handling.
+		std::cerr << "An exception occurred." << std::endl
+			<< e.GetDescription() << std::endl;
+		exitCode = 1;
+	}
+	catch (std::exception &e)
+	{
+		// Error handling.
+		std::cerr << "An exception occurred." << std::endl
+			<< e.what() << std::endl;
+		exitCode = 1;
+	}
+
+	return exitCode;
+}
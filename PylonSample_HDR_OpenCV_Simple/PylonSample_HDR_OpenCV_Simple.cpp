@@ -38,6 +38,7 @@
 
 // STD libraries needed
 #include <vector>
+#include <chrono>
 
 // This determines what kind of camera we will use
 #define USE_USB
@@ -47,12 +48,14 @@
 #include <pylon/1394/Basler1394InstantCamera.h>
 typedef Pylon::CBasler1394InstantCamera Camera_t;
 typedef Pylon::CBasler1394GrabResultPtr GrabResultPtr_t;
+typedef Pylon::CBasler1394CameraEventHandler CameraEventHandler_t;
 using namespace Basler_IIDC1394CameraParams;
 #elif defined ( USE_GIGE )
 // Settings for using Basler GigE cameras.
 #include <pylon/gige/BaslerGigEInstantCamera.h>
 typedef Pylon::CBaslerGigEInstantCamera Camera_t;
 typedef Pylon::CBaslerGigEGrabResultPtr GrabResultPtr_t;
+typedef Pylon::CBaslerGigECameraEventHandler CameraEventHandler_t;
 using namespace Basler_GigECameraParams;
 #elif defined ( USE_CAMERALINK )
 // Settings for using Basler Camera Link cameras.
@@ -64,6 +67,7 @@ using namespace Basler_CLCameraParams;
 #include <pylon/usb/BaslerUsbInstantCamera.h>
 typedef Pylon::CBaslerUsbInstantCamera Camera_t;
 typedef Pylon::CBaslerUsbGrabResultPtr GrabResultPtr_t;
+typedef Pylon::CBaslerUsbCameraEventHandler CameraEventHandler_t;
 using namespace Basler_UsbCameraParams;
 #else
 #error Camera type is not specified. For example, define USE_GIGE for using GigE cameras.
@@ -78,6 +82,55 @@ static const double c_lowExposureTime = 100;
 // Highest exposure time we will use for HDR (in microseconds)
 static const double c_highExposureTime = 100000;
 
+// EVENT-DRIVEN TRIGGERING: Trigger the next image from the camera's ExposureEnd event instead of from the grab loop.
+// The next exposure then starts while the current image is still being read out and transferred.
+static const bool c_useExposureEndEvents = false;
+// Identifies the ExposureEnd event in the event handler.
+static const intptr_t c_exposureEndEventId = 100;
+
+// EVENT-DRIVEN TRIGGERING: Called (on pylon's event thread) each time an exposure has ended.
+// Sets the exposure time of the next image and triggers it right away.
+class CExposureEndTrigger : public CameraEventHandler_t
+{
+private:
+	std::vector<double> m_exposureTimes;
+	size_t m_nextExposure;
+	uint32_t m_triggersLeft;
+
+public:
+	// 'exposureTimes' are the exposure times of one HDR image. The first one has already been triggered.
+	CExposureEndTrigger(const std::vector<double> &exposureTimes, uint32_t triggersLeft)
+		: m_exposureTimes(exposureTimes), m_nextExposure(1 % exposureTimes.size()), m_triggersLeft(triggersLeft)
+	{
+	}
+
+	virtual void OnCameraEvent(Camera_t &camera, intptr_t userProvidedId, GenApi::INode * /*pNode*/)
+	{
+		if (userProvidedId != c_exposureEndEventId || m_triggersLeft == 0)
+			return;
+
+		try
+		{
+			camera.ExposureTime.SetValue(m_exposureTimes[m_nextExposure]);
+			m_nextExposure = (m_nextExposure + 1) % m_exposureTimes.size();
+
+			// The sensor may not accept a new trigger right at the end of the exposure. Wait until it does.
+			if (camera.WaitForFrameTriggerReady(1000, Pylon::TimeoutHandling_Return))
+			{
+				camera.TriggerSoftware.Execute();
+				m_triggersLeft--;
+			}
+			else
+				std::cout << "Error: the camera did not become ready for the next trigger." << std::endl;
+		}
+		catch (GenICam::GenericException &e)
+		{
+			std::cerr << "An exception occurred in the event handler." << std::endl
+				<< e.GetDescription() << std::endl;
+		}
+	}
+};
+
 int main(int argc, char* argv[])
 {
 	// The exit code of the sample application.
@@ -95,9 +148,19 @@ int main(int argc, char* argv[])
 		Pylon::CDeviceInfo info;
 		info.SetSerialNumber("21734321");
 
+		// EVENT-DRIVEN TRIGGERING: The handler is created before the camera, so it outlives the camera's event thread.
+		std::vector<double> exposureTimes;
+		for (uint32_t i = 0; i < c_imagesPerHDR; i++)
+			exposureTimes.push_back(c_lowExposureTime + i * (c_highExposureTime - c_lowExposureTime) / c_imagesPerHDR);
+		CExposureEndTrigger exposureEndTrigger(exposureTimes, c_countOfImagesToGrab - 1);
+
 		// Create an instant camera object with the given info.
 		Camera_t camera(Pylon::CTlFactory::GetInstance().CreateFirstDevice(info));
 
+		// EVENT-DRIVEN TRIGGERING: Camera events have to be enabled before the camera is opened.
+		if (c_useExposureEndEvents)
+			camera.GrabCameraEvents.SetValue(true);
+
 		// Print the model name of the camera.
 		std::cout << "Using device " << camera.GetDeviceInfo().GetModelName() << std::endl;
 
@@ -114,6 +177,14 @@ int main(int argc, char* argv[])
 		// calculate the exposure time increments for the subsequent images
 		double c_exposureTimeIncrement = (c_highExposureTime - c_lowExposureTime) / c_imagesPerHDR;
 
+		// EVENT-DRIVEN TRIGGERING: Let the camera report the end of each exposure, and trigger the next image from there.
+		if (c_useExposureEndEvents)
+		{
+			camera.EventSelector.SetValue(EventSelector_ExposureEnd);
+			camera.EventNotification.SetValue(EventNotification_On);
+			camera.RegisterCameraEventHandler(&exposureEndTrigger, "EventExposureEnd", c_exposureEndEventId, Pylon::RegistrationMode_ReplaceAll, Pylon::Cleanup_None);
+		}
+
 		// we will use pylon's image format converter to convert the image to openCV format.
 		Pylon::CImageFormatConverter myConverter;
 		Pylon::PixelType openCVPixelType = Pylon::EPixelType::PixelType_BGR8packed;
@@ -141,6 +212,10 @@ int main(int argc, char* argv[])
 		// This smart pointer points to the "Grab Result" provided by the Grab Engine.
 		GrabResultPtr_t ptrGrabResult;
 
+		// We measure the average time between images, to compare the two ways of triggering.
+		std::chrono::steady_clock::time_point firstImageTime, lastImageTime;
+		uint32_t imagesReceived = 0;
+
 		// ********************************** END SETUP **********************************
 		
 		// Start the Grab Engine (StopGrabbing() will be called automatically when c_countOfImagesToGrab have been grabbed).
@@ -160,19 +235,27 @@ int main(int argc, char* argv[])
 			{
 				imageCounter++;
 
+				lastImageTime = std::chrono::steady_clock::now();
+				if (imagesReceived++ == 0)
+					firstImageTime = lastImageTime;
+
 				// OPTIMIZATION:
 				// We can already trigger the camera again and expose the next image while we work on this one.
-				if (imageCounter != c_imagesPerHDR)
+				// (EVENT-DRIVEN TRIGGERING: the event handler has already done this, at the end of the exposure.)
+				if (c_useExposureEndEvents == false)
 				{
-					// if we don't have all the images, set the next exposure time
-					camera.ExposureTime.SetValue(camera.ExposureTime.GetValue() + c_exposureTimeIncrement);
-					camera.TriggerSoftware.Execute();
-				}
-				if (imageCounter == c_imagesPerHDR)
-				{
-					// if we do have all the images, start the next batch with the low exposure time
-					camera.ExposureTime.SetValue(c_lowExposureTime);
-					camera.TriggerSoftware.Execute();
+					if (imageCounter != c_imagesPerHDR)
+					{
+						// if we don't have all the images, set the next exposure time
+						camera.ExposureTime.SetValue(camera.ExposureTime.GetValue() + c_exposureTimeIncrement);
+						camera.TriggerSoftware.Execute();
+					}
+					if (imageCounter == c_imagesPerHDR)
+					{
+						// if we do have all the images, start the next batch with the low exposure time
+						camera.ExposureTime.SetValue(c_lowExposureTime);
+						camera.TriggerSoftware.Execute();
+					}
 				}
 
 				// Store this image.
@@ -227,6 +310,17 @@ int main(int argc, char* argv[])
 			}
 
 		}
+
+		// Report the achieved frame interval (switch c_useExposureEndEvents to compare).
+		if (imagesReceived > 1)
+		{
+			double interval = std::chrono::duration<double, std::milli>(lastImageTime - firstImageTime).count() / (imagesReceived - 1);
+			std::cout << "Average frame interval " << (c_useExposureEndEvents ? "(triggered on ExposureEnd events): " : "(triggered from the grab loop): ")
+				<< interval << " ms, " << (1000.0 / interval) << " fps" << std::endl;
+		}
+
+		if (c_useExposureEndEvents)
+			camera.DeregisterCameraEventHandler(&exposureEndTrigger, "EventExposureEnd");
 	}
 	catch (GenICam::GenericException &e)
 	{
@@ -0,0 +1,213 @@
+// BracketCodec.h
+// A fast lossless coder for raw camera images, used to hold more brackets in memory while they wait for fusion.
+// Each sample is predicted from its left neighbour of the same colour (or the one above at the start of a row),
+// and the residuals are bit-packed in blocks of 16 with one width byte per block.
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRACKETCODEC_H
+#define BRACKETCODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace BracketCodec
+{
+	// Number of residuals packed together with one width byte.
+	static const int c_blockSize = 16;
+
+	// The largest possible encoded size of 'numSamples' samples of 'sampleBytes' (1 or 2) bytes each.
+	size_t MaxEncodedSize(size_t numSamples, int sampleBytes);
+
+	// Encode a 'width' x 'height' image of samples (width counts samples, not pixels).
+	// pixelPeriod: distance to the previous sample of the same colour in a row (1 mono, 2 Bayer, 3 RGB).
+	// rowPeriod: distance to the previous row of the same colour (1 mono/RGB, 2 Bayer).
+	// Returns the number of bytes written to 'dst', which must hold MaxEncodedSize() bytes.
+	size_t Encode(const uint8_t *src, int width, int height, int sampleBytes, int pixelPeriod, int rowPeriod, uint8_t *dst);
+
+	// Decode what Encode() wrote. Returns false if 'src' is truncated or corrupt.
+	bool Decode(const uint8_t *src, size_t srcSize, int width, int height, int sampleBytes, int pixelPeriod, int rowPeriod, uint8_t *dst);
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+namespace BracketCodec
+{
+	namespace Detail
+	{
+		template <typename T, typename S>
+		T ZigZag(T residual)
+		{
+			S s = (S)residual;
+			return (T)(((unsigned int)s << 1) ^ (unsigned int)(s >> (sizeof(T) * 8 - 1)));
+		}
+
+		template <typename T>
+		T UnZigZag(T z)
+		{
+			return (T)((z >> 1) ^ (T)(0 - (z & 1)));
+		}
+
+		template <typename T>
+		uint8_t *PackBlock(const T *block, uint8_t *out)
+		{
+			unsigned int all = 0;
+			for (int i = 0; i < c_blockSize; i++)
+				all |= block[i];
+
+			int bits = 0;
+			while (all != 0)
+			{
+				bits++;
+				all >>= 1;
+			}
+
+			*out++ = (uint8_t)bits;
+
+			// 16 values of 'bits' bits are exactly 2 * bits bytes, so every block ends on a byte boundary.
+			uint32_t acc = 0;
+			int accBits = 0;
+			for (int i = 0; i < c_blockSize && bits > 0; i++)
+			{
+				acc |= (uint32_t)block[i] << accBits;
+				accBits += bits;
+				while (accBits >= 8)
+				{
+					*out++ = (uint8_t)acc;
+					acc >>= 8;
+					accBits -= 8;
+				}
+			}
+			return out;
+		}
+
+		template <typename T>
+		const uint8_t *UnpackBlock(const uint8_t *in, const uint8_t *end, T *block)
+		{
+			if (in >= end)
+				return NULL;
+
+			int bits = *in++;
+			if (bits > (int)sizeof(T) * 8 || in + 2 * bits > end)
+				return NULL;
+
+			uint32_t acc = 0;
+			int accBits = 0;
+			uint32_t mask = (bits == 32) ? 0xFFFFFFFF : ((1u << bits) - 1);
+			for (int i = 0; i < c_blockSize; i++)
+			{
+				while (accBits < bits)
+				{
+					acc |= (uint32_t)(*in++) << accBits;
+					accBits += 8;
+				}
+				block[i] = (T)(acc & mask);
+				acc >>= bits;
+				accBits -= bits;
+			}
+			return in;
+		}
+
+		template <typename T, typename S>
+		size_t Encode(const T *src, int width, int height, int pixelPeriod, int rowPeriod, uint8_t *dst)
+		{
+			uint8_t *out = dst;
+			T block[c_blockSize];
+			int n = 0;
+
+			for (int y = 0; y < height; y++)
+			{
+				const T *row = src + (size_t)y * width;
+				const T *above = (y >= rowPeriod) ? row - (size_t)rowPeriod * width : NULL;
+
+				for (int x = 0; x < width; x++)
+				{
+					T prediction = (x >= pixelPeriod) ? row[x - pixelPeriod] : (above != NULL ? above[x] : 0);
+					block[n++] = ZigZag<T, S>((T)(row[x] - prediction));
+					if (n == c_blockSize)
+					{
+						out = PackBlock(block, out);
+						n = 0;
+					}
+				}
+			}
+
+			if (n > 0)
+			{
+				for (int i = n; i < c_blockSize; i++)
+					block[i] = 0;
+				out = PackBlock(block, out);
+			}
+
+			return (size_t)(out - dst);
+		}
+
+		template <typename T>
+		bool Decode(const uint8_t *src, size_t srcSize, int width, int height, int pixelPeriod, int rowPeriod, T *dst)
+		{
+			const uint8_t *in = src;
+			const uint8_t *end = src + srcSize;
+			T block[c_blockSize];
+			int n = c_blockSize;
+
+			for (int y = 0; y < height; y++)
+			{
+				T *row = dst + (size_t)y * width;
+				const T *above = (y >= rowPeriod) ? row - (size_t)rowPeriod * width : NULL;
+
+				for (int x = 0; x < width; x++)
+				{
+					if (n == c_blockSize)
+					{
+						in = UnpackBlock(in, end, block);
+						if (in == NULL)
+							return false;
+						n = 0;
+					}
+
+					T prediction = (x >= pixelPeriod) ? row[x - pixelPeriod] : (above != NULL ? above[x] : 0);
+					row[x] = (T)(prediction + UnZigZag(block[n++]));
+				}
+			}
+
+			return true;
+		}
+	}
+}
+
+size_t BracketCodec::MaxEncodedSize(size_t numSamples, int sampleBytes)
+{
+	size_t numBlocks = (numSamples + c_blockSize - 1) / c_blockSize;
+	return numBlocks * (1 + c_blockSize * sampleBytes);
+}
+
+size_t BracketCodec::Encode(const uint8_t *src, int width, int height, int sampleBytes, int pixelPeriod, int rowPeriod, uint8_t *dst)
+{
+	if (sampleBytes == 2)
+		return Detail::Encode<uint16_t, int16_t>((const uint16_t*)src, width, height, pixelPeriod, rowPeriod, dst);
+	else
+		return Detail::Encode<uint8_t, int8_t>(src, width, height, pixelPeriod, rowPeriod, dst);
+}
+
+bool BracketCodec::Decode(const uint8_t *src, size_t srcSize, int width, int height, int sampleBytes, int pixelPeriod, int rowPeriod, uint8_t *dst)
+{
+	if (sampleBytes == 2)
+		return Detail::Decode<uint16_t>(src, srcSize, width, height, pixelPeriod, rowPeriod, (uint16_t*)dst);
+	else
+		return Detail::Decode<uint8_t>(src, srcSize, width, height, pixelPeriod, rowPeriod, dst);
+}
+
+// *********************************************************************************************************
+
+#endif
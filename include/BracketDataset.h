@@ -0,0 +1,619 @@
+// BracketDataset.h
+// A container file for recorded brackets that can be memory-mapped and read in any order.
+//
+// File layout (all offsets and sizes are multiples of c_alignment):
+//   [file header, one page]
+//   [frame record]...       each record: [frame header, one page][payload, padded to a page]
+//   [index]                 one FrameEntry per frame, in bracket order (written by Close())
+//
+// Every payload starts on a page, so a mapped frame can be handed to OpenCV or pylon as is (no copy).
+// Every record repeats its index entry in its own header, so a file whose index was never written
+// (the recording was interrupted) can be repaired with RebuildIndex().
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRACKETDATASET_H
+#define BRACKETDATASET_H
+
+#ifndef LINUX_BUILD
+#define WIN_BUILD
+#endif
+
+#ifdef WIN_BUILD
+#define _CRT_SECURE_NO_WARNINGS // suppress fopen_s warnings for convinience
+#endif
+
+#include <opencv2/opencv.hpp>
+
+// Include Pylon libraries (if needed)
+#include <pylon/PylonIncludes.h>
+
+// FramePlacement of partial-ROI frames
+#include "HDRFusion.h"
+
+#ifdef WIN_BUILD
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <cstring>
+
+namespace BracketDataset
+{
+	static const char c_fileMagic[8] = { 'H', 'D', 'R', 'B', 'R', 'K', 'T', '1' };
+	static const char c_frameMagic[8] = { 'H', 'D', 'R', 'F', 'R', 'A', 'M', 'E' };
+	static const uint32_t c_version = 1;
+	static const uint64_t c_alignment = 4096;
+
+	struct FileHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t alignment;
+		uint32_t imagesPerBracket;
+		uint32_t reserved;
+		uint64_t bracketCount;
+		uint64_t indexOffset; // 0 while recording. Run RebuildIndex() on files that were never closed.
+		uint64_t indexSize;
+	};
+
+	struct FrameEntry
+	{
+		uint64_t offset; // of the payload, from the start of the file
+		uint64_t size; // of the payload, without padding
+		uint64_t timestamp; // camera timestamp (ticks)
+		double exposureTime; // microseconds
+		uint32_t pixelType; // Pylon::EPixelType
+		uint32_t width;
+		uint32_t height;
+		uint16_t paddingX;
+		uint16_t binning; // 0 or 1 = none
+		uint64_t bracketIndex;
+		uint32_t exposureIndex;
+		uint16_t offsetX; // where a partial-ROI frame sits in the full frame (in its own, binned pixels)
+		uint16_t offsetY;
+	};
+
+	struct FrameHeader
+	{
+		char magic[8];
+		FrameEntry entry;
+	};
+
+	// The OpenCV type of a frame that can be viewed as a cv::Mat without conversion (-1 if it can't).
+	int GetMatType(Pylon::EPixelType pixelType);
+
+	// Writes brackets one after the other. Close() appends the index.
+	class CBracketDatasetWriter
+	{
+	private:
+		FILE *m_file = NULL;
+		std::string m_path;
+		FileHeader m_header;
+		std::vector<FrameEntry> m_index;
+		std::vector<uint8_t> m_padding;
+
+		int WriteHeader(std::string &errorMessage);
+
+	public:
+		CBracketDatasetWriter();
+		~CBracketDatasetWriter();
+
+		int Open(const std::string &path, uint32_t imagesPerBracket, std::string &errorMessage);
+		// exposureTimes and timestamps hold one value per image. So do placements, or it is empty (all full frames).
+		int WriteBracket(std::vector<Pylon::CPylonImage> &images, const std::vector<double> &exposureTimes, const std::vector<uint64_t> &timestamps, std::string &errorMessage,
+			const std::vector<HDRFusion::FramePlacement> &placements = std::vector<HDRFusion::FramePlacement>());
+		int Close(std::string &errorMessage);
+		bool IsOpen();
+	};
+
+	// Maps a dataset file and gives random access to its brackets.
+	class CBracketDatasetReader
+	{
+	private:
+		const uint8_t *m_pData = NULL;
+		uint64_t m_size = 0;
+		FileHeader m_header;
+		const FrameEntry *m_pIndex = NULL;
+#ifdef WIN_BUILD
+		HANDLE m_file = INVALID_HANDLE_VALUE;
+		HANDLE m_mapping = NULL;
+#else
+		int m_file = -1;
+#endif
+
+	public:
+		CBracketDatasetReader();
+		~CBracketDatasetReader();
+
+		int Open(const std::string &path, std::string &errorMessage);
+		void Close();
+
+		uint64_t GetBracketCount();
+		uint32_t GetImagesPerBracket();
+		const FrameEntry &GetFrameEntry(uint64_t bracketIndex, uint32_t exposureIndex);
+
+		// A cv::Mat header on the mapped frame (no copy). Empty if the pixel format has no matching cv::Mat type.
+		cv::Mat GetFrameMat(uint64_t bracketIndex, uint32_t exposureIndex);
+		// A pylon image attached to the mapped frame (no copy). Works for every pixel format.
+		void GetFrameImage(uint64_t bracketIndex, uint32_t exposureIndex, Pylon::CPylonImage &image);
+		void GetBracketImages(uint64_t bracketIndex, std::vector<Pylon::CPylonImage> &images);
+	};
+
+	// Scan the frame records of a file and (re)write its index. Drops a trailing incomplete record and bracket.
+	int RebuildIndex(const std::string &path, std::string &errorMessage);
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+namespace BracketDataset
+{
+	namespace Detail
+	{
+		int Seek(FILE *file, uint64_t offset)
+		{
+#ifdef WIN_BUILD
+			return _fseeki64(file, (__int64)offset, SEEK_SET);
+#else
+			return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+		}
+
+		uint64_t Tell(FILE *file)
+		{
+#ifdef WIN_BUILD
+			return (uint64_t)_ftelli64(file);
+#else
+			return (uint64_t)ftello(file);
+#endif
+		}
+
+		uint64_t Align(uint64_t value)
+		{
+			return (value + c_alignment - 1) / c_alignment * c_alignment;
+		}
+	}
+}
+
+int BracketDataset::GetMatType(Pylon::EPixelType pixelType)
+{
+	if (Pylon::IsPacked(pixelType) || Pylon::IsYUV(pixelType))
+		return -1;
+
+	uint32_t samplesPerPixel = Pylon::SamplesPerPixel(pixelType);
+	uint32_t bitsPerSample = Pylon::BitPerPixel(pixelType) / samplesPerPixel;
+	if (samplesPerPixel != 1 && samplesPerPixel != 3)
+		return -1;
+
+	if (bitsPerSample == 8)
+		return CV_MAKETYPE(CV_8U, samplesPerPixel);
+	if (bitsPerSample == 16)
+		return CV_MAKETYPE(CV_16U, samplesPerPixel);
+	return -1;
+}
+
+BracketDataset::CBracketDatasetWriter::CBracketDatasetWriter()
+{
+	memset(&m_header, 0, sizeof(m_header));
+	m_padding.resize((size_t)c_alignment, 0);
+}
+
+BracketDataset::CBracketDatasetWriter::~CBracketDatasetWriter()
+{
+	std::string errorMessage = "";
+	Close(errorMessage);
+}
+
+int BracketDataset::CBracketDatasetWriter::WriteHeader(std::string &errorMessage)
+{
+	if (Detail::Seek(m_file, 0) != 0 || fwrite(&m_header, sizeof(m_header), 1, m_file) != 1)
+	{
+		errorMessage.append("Could not write the file header");
+		return 1;
+	}
+	if (fwrite(&m_padding[0], (size_t)c_alignment - sizeof(m_header), 1, m_file) != 1)
+	{
+		errorMessage.append("Could not write the file header");
+		return 1;
+	}
+	return 0;
+}
+
+int BracketDataset::CBracketDatasetWriter::Open(const std::string &path, uint32_t imagesPerBracket, std::string &errorMessage)
+{
+	errorMessage = "ERROR: ";
+	errorMessage.append(__FUNCTION__);
+	errorMessage.append("(): ");
+
+	if (m_file != NULL)
+	{
+		errorMessage.append("A file is already open");
+		return 1;
+	}
+
+	m_file = fopen(path.c_str(), "wb+");
+	if (m_file == NULL)
+	{
+		errorMessage.append("Could not create ");
+		errorMessage.append(path);
+		return 1;
+	}
+
+	m_path = path;
+	m_index.clear();
+	memset(&m_header, 0, sizeof(m_header));
+	memcpy(m_header.magic, c_fileMagic, sizeof(c_fileMagic));
+	m_header.version = c_version;
+	m_header.alignment = (uint32_t)c_alignment;
+	m_header.imagesPerBracket = imagesPerBracket;
+
+	return WriteHeader(errorMessage);
+}
+
+int BracketDataset::CBracketDatasetWriter::WriteBracket(std::vector<Pylon::CPylonImage> &images, const std::vector<double> &exposureTimes, const std::vector<uint64_t> &timestamps, std::string &errorMessage,
+	const std::vector<HDRFusion::FramePlacement> &placements)
+{
+	errorMessage = "ERROR: ";
+	errorMessage.append(__FUNCTION__);
+	errorMessage.append("(): ");
+
+	try
+	{
+		if (m_file == NULL)
+		{
+			errorMessage.append("No file is open");
+			return 1;
+		}
+		if (images.size() != m_header.imagesPerBracket)
+		{
+			errorMessage.append("Wrong number of images in the bracket");
+			return 1;
+		}
+
+		for (size_t i = 0; i < images.size(); i++)
+		{
+			uint64_t recordOffset = Detail::Tell(m_file);
+
+			FrameHeader frameHeader;
+			memset(&frameHeader, 0, sizeof(frameHeader));
+			memcpy(frameHeader.magic, c_frameMagic, sizeof(c_frameMagic));
+			FrameEntry &entry = frameHeader.entry;
+			entry.offset = recordOffset + c_alignment;
+			entry.size = images[i].GetImageSize();
+			entry.timestamp = (i < timestamps.size()) ? timestamps[i] : 0;
+			entry.exposureTime = (i < exposureTimes.size()) ? exposureTimes[i] : 0;
+			entry.pixelType = (uint32_t)images[i].GetPixelType();
+			entry.width = images[i].GetWidth();
+			entry.height = images[i].GetHeight();
+			entry.paddingX = (uint16_t)images[i].GetPaddingX();
+			if (i < placements.size())
+			{
+				entry.binning = (uint16_t)placements[i].binning;
+				entry.offsetX = (uint16_t)placements[i].offsetX;
+				entry.offsetY = (uint16_t)placements[i].offsetY;
+			}
+			entry.bracketIndex = m_header.bracketCount;
+			entry.exposureIndex = (uint32_t)i;
+
+			size_t payloadPadding = (size_t)(Detail::Align(entry.size) - entry.size);
+			if (fwrite(&frameHeader, sizeof(frameHeader), 1, m_file) != 1
+				|| fwrite(&m_padding[0], (size_t)c_alignment - sizeof(frameHeader), 1, m_file) != 1
+				|| fwrite(images[i].GetBuffer(), (size_t)entry.size, 1, m_file) != 1
+				|| (payloadPadding > 0 && fwrite(&m_padding[0], payloadPadding, 1, m_file) != 1))
+			{
+				errorMessage.append("Could not write to ");
+				errorMessage.append(m_path);
+				return 1;
+			}
+
+			m_index.push_back(entry);
+		}
+
+		m_header.bracketCount++;
+		return 0;
+	}
+	catch (GenICam::GenericException &e)
+	{
+		errorMessage.append("EXCEPTION: ");
+		errorMessage.append(e.GetDescription());
+		return 1;
+	}
+	catch (std::exception &e)
+	{
+		errorMessage.append("EXCEPTION: ");
+		errorMessage.append(e.what());
+		return 1;
+	}
+}
+
+int BracketDataset::CBracketDatasetWriter::Close(std::string &errorMessage)
+{
+	errorMessage = "ERROR: ";
+	errorMessage.append(__FUNCTION__);
+	errorMessage.append("(): ");
+
+	if (m_file == NULL)
+		return 0;
+
+	int result = 0;
+	m_header.indexOffset = Detail::Tell(m_file);
+	m_header.indexSize = m_index.size() * sizeof(FrameEntry);
+	if (!m_index.empty() && fwrite(&m_index[0], (size_t)m_header.indexSize, 1, m_file) != 1)
+	{
+		errorMessage.append("Could not write the index");
+		result = 1;
+	}
+	else
+		result = WriteHeader(errorMessage);
+
+	fclose(m_file);
+	m_file = NULL;
+	m_index.clear();
+	return result;
+}
+
+bool BracketDataset::CBracketDatasetWriter::IsOpen()
+{
+	return m_file != NULL;
+}
+
+BracketDataset::CBracketDatasetReader::CBracketDatasetReader()
+{
+	memset(&m_header, 0, sizeof(m_header));
+}
+
+BracketDataset::CBracketDatasetReader::~CBracketDatasetReader()
+{
+	Close();
+}
+
+int BracketDataset::CBracketDatasetReader::Open(const std::string &path, std::string &errorMessage)
+{
+	errorMessage = "ERROR: ";
+	errorMessage.append(__FUNCTION__);
+	errorMessage.append("(): ");
+
+	Close();
+
+#ifdef WIN_BUILD
+	m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	LARGE_INTEGER fileSize;
+	if (m_file == INVALID_HANDLE_VALUE || GetFileSizeEx(m_file, &fileSize) == FALSE)
+	{
+		errorMessage.append("Could not open ");
+		errorMessage.append(path);
+		Close();
+		return 1;
+	}
+	m_size = (uint64_t)fileSize.QuadPart;
+	m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (m_mapping != NULL)
+		m_pData = (const uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	m_file = open(path.c_str(), O_RDONLY);
+	struct stat fileStat;
+	if (m_file < 0 || fstat(m_file, &fileStat) != 0)
+	{
+		errorMessage.append("Could not open ");
+		errorMessage.append(path);
+		Close();
+		return 1;
+	}
+	m_size = (uint64_t)fileStat.st_size;
+	void *pMap = mmap(NULL, (size_t)m_size, PROT_READ, MAP_SHARED, m_file, 0);
+	if (pMap != MAP_FAILED)
+		m_pData = (const uint8_t*)pMap;
+#endif
+
+	if (m_pData == NULL)
+	{
+		errorMessage.append("Could not map ");
+		errorMessage.append(path);
+		Close();
+		return 1;
+	}
+
+	if (m_size < c_alignment)
+	{
+		errorMessage.append("File is too small");
+		Close();
+		return 1;
+	}
+	memcpy(&m_header, m_pData, sizeof(m_header));
+
+	if (memcmp(m_header.magic, c_fileMagic, sizeof(c_fileMagic)) != 0 || m_header.version != c_version || m_header.alignment != c_alignment)
+	{
+		errorMessage.append("Not a bracket dataset (or an unsupported version)");
+		Close();
+		return 1;
+	}
+	if (m_header.indexOffset == 0)
+	{
+		errorMessage.append("The file has no index. The recording was probably interrupted: rebuild the index first.");
+		Close();
+		return 1;
+	}
+	if (m_header.indexOffset + m_header.indexSize > m_size || m_header.indexSize != m_header.bracketCount * m_header.imagesPerBracket * sizeof(FrameEntry))
+	{
+		errorMessage.append("The index is damaged: rebuild it.");
+		Close();
+		return 1;
+	}
+
+	m_pIndex = (const FrameEntry*)(m_pData + m_header.indexOffset);
+	for (uint64_t i = 0; i < m_header.bracketCount * m_header.imagesPerBracket; i++)
+	{
+		if (m_pIndex[i].offset + m_pIndex[i].size > m_header.indexOffset)
+		{
+			errorMessage.append("The index points outside of the file: rebuild it.");
+			Close();
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void BracketDataset::CBracketDatasetReader::Close()
+{
+#ifdef WIN_BUILD
+	if (m_pData != NULL)
+		UnmapViewOfFile(m_pData);
+	if (m_mapping != NULL)
+		CloseHandle(m_mapping);
+	if (m_file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_file);
+	m_mapping = NULL;
+	m_file = INVALID_HANDLE_VALUE;
+#else
+	if (m_pData != NULL)
+		munmap((void*)m_pData, (size_t)m_size);
+	if (m_file >= 0)
+		close(m_file);
+	m_file = -1;
+#endif
+	m_pData = NULL;
+	m_pIndex = NULL;
+	m_size = 0;
+	memset(&m_header, 0, sizeof(m_header));
+}
+
+uint64_t BracketDataset::CBracketDatasetReader::GetBracketCount()
+{
+	return m_header.bracketCount;
+}
+
+uint32_t BracketDataset::CBracketDatasetReader::GetImagesPerBracket()
+{
+	return m_header.imagesPerBracket;
+}
+
+const BracketDataset::FrameEntry &BracketDataset::CBracketDatasetReader::GetFrameEntry(uint64_t bracketIndex, uint32_t exposureIndex)
+{
+	if (bracketIndex >= m_header.bracketCount || exposureIndex >= m_header.imagesPerBracket)
+		throw OUT_OF_RANGE_EXCEPTION("Bracket %u, exposure %u is not in the dataset", (unsigned int)bracketIndex, exposureIndex);
+
+	return m_pIndex[bracketIndex * m_header.imagesPerBracket + exposureIndex];
+}
+
+cv::Mat BracketDataset::CBracketDatasetReader::GetFrameMat(uint64_t bracketIndex, uint32_t exposureIndex)
+{
+	const FrameEntry &entry = GetFrameEntry(bracketIndex, exposureIndex);
+	int type = GetMatType((Pylon::EPixelType)entry.pixelType);
+	if (type < 0 || entry.height == 0)
+		return cv::Mat();
+
+	size_t step = (size_t)(entry.size / entry.height);
+	return cv::Mat((int)entry.height, (int)entry.width, type, (void*)(m_pData + entry.offset), step);
+}
+
+void BracketDataset::CBracketDatasetReader::GetFrameImage(uint64_t bracketIndex, uint32_t exposureIndex, Pylon::CPylonImage &image)
+{
+	const FrameEntry &entry = GetFrameEntry(bracketIndex, exposureIndex);
+	image.AttachUserBuffer((void*)(m_pData + entry.offset), (size_t)entry.size, (Pylon::EPixelType)entry.pixelType, entry.width, entry.height, entry.paddingX);
+}
+
+void BracketDataset::CBracketDatasetReader::GetBracketImages(uint64_t bracketIndex, std::vector<Pylon::CPylonImage> &images)
+{
+	images.resize(m_header.imagesPerBracket);
+	for (uint32_t i = 0; i < m_header.imagesPerBracket; i++)
+		GetFrameImage(bracketIndex, i, images[i]);
+}
+
+int BracketDataset::RebuildIndex(const std::string &path, std::string &errorMessage)
+{
+	errorMessage = "ERROR: ";
+	errorMessage.append(__FUNCTION__);
+	errorMessage.append("(): ");
+
+	FILE *file = fopen(path.c_str(), "rb+");
+	if (file == NULL)
+	{
+		errorMessage.append("Could not open ");
+		errorMessage.append(path);
+		return 1;
+	}
+
+	FileHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, c_fileMagic, sizeof(c_fileMagic)) != 0 || header.alignment != c_alignment || header.imagesPerBracket == 0)
+	{
+		errorMessage.append("Not a bracket dataset");
+		fclose(file);
+		return 1;
+	}
+
+	Detail::Seek(file, 0);
+	if (fseek(file, 0, SEEK_END) != 0)
+	{
+		errorMessage.append("Could not seek");
+		fclose(file);
+		return 1;
+	}
+	uint64_t fileSize = Detail::Tell(file);
+
+	// Walk the records. Stop at the first one that isn't complete (or at the old index, which isn't a record).
+	std::vector<FrameEntry> index;
+	uint64_t offset = c_alignment;
+	while (offset + c_alignment <= fileSize)
+	{
+		FrameHeader frameHeader;
+		if (Detail::Seek(file, offset) != 0 || fread(&frameHeader, sizeof(frameHeader), 1, file) != 1)
+			break;
+		if (memcmp(frameHeader.magic, c_frameMagic, sizeof(c_frameMagic)) != 0)
+			break;
+
+		FrameEntry &entry = frameHeader.entry;
+		uint64_t recordEnd = offset + c_alignment + Detail::Align(entry.size);
+		uint64_t expectedBracket = index.size() / header.imagesPerBracket;
+		uint32_t expectedExposure = (uint32_t)(index.size() % header.imagesPerBracket);
+		if (entry.offset != offset + c_alignment || recordEnd > fileSize || entry.bracketIndex != expectedBracket || entry.exposureIndex != expectedExposure)
+			break;
+
+		index.push_back(entry);
+		offset = recordEnd;
+	}
+
+	// Only keep whole brackets.
+	size_t completeFrames = index.size() / header.imagesPerBracket * header.imagesPerBracket;
+	index.resize(completeFrames);
+	uint64_t indexOffset = c_alignment;
+	if (!index.empty())
+		indexOffset = index.back().offset + Detail::Align(index.back().size);
+
+	header.bracketCount = completeFrames / header.imagesPerBracket;
+	header.indexOffset = indexOffset;
+	header.indexSize = completeFrames * sizeof(FrameEntry);
+
+	int result = 0;
+	if (Detail::Seek(file, indexOffset) != 0 || (!index.empty() && fwrite(&index[0], (size_t)header.indexSize, 1, file) != 1)
+		|| Detail::Seek(file, 0) != 0 || fwrite(&header, sizeof(header), 1, file) != 1)
+	{
+		errorMessage.append("Could not write the index");
+		result = 1;
+	}
+
+	fclose(file);
+	return result;
+}
+
+// *********************************************************************************************************
+
+#endif
@@ -0,0 +1,203 @@
+// BracketPlanner.h
+// Plans the exposure time and gain of each image in a bracket.
+//
+// What matters for the fused image is how bright each image is, which is exposure time x gain.
+// Long exposures make the bracket slow (its duration is the sum of its exposure times), so the planner
+// caps the exposure time and makes up the difference with analog gain. Gain also amplifies noise,
+// so how much gain any image may get is limited by a noise budget (in dB).
+//
+// It also picks the order of the images. With overlapped exposure, the next exposure may run while the previous
+// image is read out, but it can't end before that readout is done. So the order decides how much of each readout
+// is hidden behind an exposure. The planner tries every order against this timing model and keeps the fastest
+// (and, among equally fast ones, the one whose exposures lie closest together, so the least motion falls between them).
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRACKETPLANNER_H
+#define BRACKETPLANNER_H
+
+#include <stdint.h>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+namespace BracketPlanner
+{
+	// One image of the bracket (one sequencer set).
+	struct BracketEntry
+	{
+		double exposureTime; // microseconds
+		double gain;         // dB
+		// The set's own ROI and binning, to transfer less of the exposures that only matter in parts of the image.
+		// Width or height 0 = the full frame. Binning 0 or 1 = none. In binned pixels, like the camera's parameters.
+		int64_t offsetX;
+		int64_t offsetY;
+		int64_t width;
+		int64_t height;
+		int64_t binning;
+	};
+
+	// Exposure time x gain (as a factor), in microseconds: how bright the image is.
+	double EffectiveExposure(const BracketEntry &entry);
+
+	// The bracket the samples have always used: 'count' exposures from 'lowExposureTime' to 'highExposureTime', no gain.
+	std::vector<BracketEntry> LinearBracket(uint32_t count, double lowExposureTime, double highExposureTime);
+
+	// Replace every exposure time above 'maxExposureTime' by 'maxExposureTime' plus the gain that keeps the image
+	// equally bright. No image gets more than 'maxGain' dB (the noise budget): past that, the exposure time grows again.
+	std::vector<BracketEntry> Plan(const std::vector<BracketEntry> &bracket, double maxExposureTime, double maxGain);
+
+	// The time the sensor spends exposing one bracket (microseconds).
+	double BracketDuration(const std::vector<BracketEntry> &bracket);
+
+	// The sensor timing model.
+	struct SensorTiming
+	{
+		double readoutTime;      // microseconds per image
+		bool overlappedExposure; // can an exposure run during the readout of the previous image?
+	};
+
+	// When each exposure of a bracket starts (microseconds after the first one starts).
+	std::vector<double> ExposureStarts(const std::vector<BracketEntry> &bracket, const SensorTiming &timing);
+
+	// From the start of the first exposure to the end of the last readout (microseconds).
+	double BracketTime(const std::vector<BracketEntry> &bracket, const SensorTiming &timing);
+
+	// From the middle of the first exposure to the middle of the last one: how much the scene can move within a bracket.
+	double MotionSpan(const std::vector<BracketEntry> &bracket, const SensorTiming &timing);
+
+	// The same images in the order that makes the bracket fastest (and then the least spread out).
+	// Tries every order, which is fine for the handful of images in a bracket.
+	std::vector<BracketEntry> OptimizeOrder(const std::vector<BracketEntry> &bracket, const SensorTiming &timing);
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+double BracketPlanner::EffectiveExposure(const BracketEntry &entry)
+{
+	return entry.exposureTime * pow(10.0, entry.gain / 20.0);
+}
+
+std::vector<BracketPlanner::BracketEntry> BracketPlanner::LinearBracket(uint32_t count, double lowExposureTime, double highExposureTime)
+{
+	std::vector<BracketEntry> bracket;
+	double increment = (highExposureTime - lowExposureTime) / count;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		BracketEntry entry = {};
+		entry.exposureTime = (i == count - 1 && i > 0) ? highExposureTime : lowExposureTime + i * increment;
+		bracket.push_back(entry);
+	}
+	return bracket;
+}
+
+std::vector<BracketPlanner::BracketEntry> BracketPlanner::Plan(const std::vector<BracketEntry> &bracket, double maxExposureTime, double maxGain)
+{
+	std::vector<BracketEntry> planned;
+	for (size_t i = 0; i < bracket.size(); i++)
+	{
+		BracketEntry entry = bracket[i];
+		double effective = EffectiveExposure(bracket[i]);
+		if (effective > maxExposureTime)
+		{
+			entry.gain = 20.0 * log10(effective / maxExposureTime);
+			if (entry.gain > maxGain)
+				entry.gain = maxGain;
+			entry.exposureTime = effective / pow(10.0, entry.gain / 20.0);
+		}
+		planned.push_back(entry);
+	}
+	return planned;
+}
+
+double BracketPlanner::BracketDuration(const std::vector<BracketEntry> &bracket)
+{
+	double duration = 0;
+	for (size_t i = 0; i < bracket.size(); i++)
+		duration += bracket[i].exposureTime;
+	return duration;
+}
+
+std::vector<double> BracketPlanner::ExposureStarts(const std::vector<BracketEntry> &bracket, const SensorTiming &timing)
+{
+	std::vector<double> starts;
+	double start = 0;
+	for (size_t i = 0; i < bracket.size(); i++)
+	{
+		if (i > 0)
+		{
+			double previousEnd = starts[i - 1] + bracket[i - 1].exposureTime;
+			double readoutEnd = previousEnd + timing.readoutTime;
+			if (timing.overlappedExposure)
+				start = std::max(previousEnd, readoutEnd - bracket[i].exposureTime);
+			else
+				start = readoutEnd;
+		}
+		starts.push_back(start);
+	}
+	return starts;
+}
+
+double BracketPlanner::BracketTime(const std::vector<BracketEntry> &bracket, const SensorTiming &timing)
+{
+	if (bracket.empty())
+		return 0;
+
+	std::vector<double> starts = ExposureStarts(bracket, timing);
+	return starts.back() + bracket.back().exposureTime + timing.readoutTime;
+}
+
+double BracketPlanner::MotionSpan(const std::vector<BracketEntry> &bracket, const SensorTiming &timing)
+{
+	if (bracket.empty())
+		return 0;
+
+	std::vector<double> starts = ExposureStarts(bracket, timing);
+	return (starts.back() + bracket.back().exposureTime / 2) - (bracket.front().exposureTime / 2);
+}
+
+std::vector<BracketPlanner::BracketEntry> BracketPlanner::OptimizeOrder(const std::vector<BracketEntry> &bracket, const SensorTiming &timing)
+{
+	// Orders that differ by less than this (microseconds) count as equally fast.
+	const double tolerance = 1.0;
+
+	std::vector<size_t> order(bracket.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+
+	std::vector<BracketEntry> best = bracket;
+	double bestTime = BracketTime(bracket, timing);
+	double bestSpan = MotionSpan(bracket, timing);
+
+	std::vector<BracketEntry> candidate(bracket.size());
+	while (std::next_permutation(order.begin(), order.end()))
+	{
+		for (size_t i = 0; i < order.size(); i++)
+			candidate[i] = bracket[order[i]];
+
+		double time = BracketTime(candidate, timing);
+		double span = MotionSpan(candidate, timing);
+		if (time < bestTime - tolerance || (time < bestTime + tolerance && span < bestSpan - tolerance))
+		{
+			best = candidate;
+			bestTime = time;
+			bestSpan = span;
+		}
+	}
+	return best;
+}
+
+// *********************************************************************************************************
+
+#endif
@@ -0,0 +1,454 @@
+// BracketQueue.h
+// A queue of image brackets between acquisition and fusion, with an optional lossless compression tier.
+// When fusion falls behind, a background thread compresses the waiting brackets so the queue can absorb a
+// longer backlog in the same memory. Brackets are decompressed when they are popped for fusion.
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRACKETQUEUE_H
+#define BRACKETQUEUE_H
+
+// Include Pylon libraries (if needed)
+#include <pylon/PylonIncludes.h>
+
+#include "BracketCodec.h"
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstring>
+
+namespace BracketQueue
+{
+	struct Statistics
+	{
+		uint64_t pushedBrackets = 0;
+		uint64_t droppedBrackets = 0;
+		uint64_t compressedBrackets = 0;
+		size_t maxDepth = 0;
+		size_t maxStoredBytes = 0;
+		uint64_t compressInputBytes = 0;
+		uint64_t compressOutputBytes = 0;
+		double compressSeconds = 0;
+		uint64_t decompressOutputBytes = 0;
+		double decompressSeconds = 0;
+	};
+
+	class CBracketQueue
+	{
+	private:
+		struct Frame
+		{
+			Pylon::EPixelType pixelType = Pylon::EPixelType::PixelType_Undefined;
+			uint32_t width = 0;
+			uint32_t height = 0;
+			size_t imageSize = 0;
+			std::vector<uint8_t> data;
+			bool raw = false; // data holds the image as is (the pixel format can't be coded, or coding didn't help)
+		};
+
+		struct Entry
+		{
+			std::vector<Pylon::CPylonImage> images; // the bracket, until it is compressed
+			std::vector<Frame> frames; // the bracket, once it is compressed
+			bool compressed = false;
+			bool compressing = false;
+			bool popped = false;
+			size_t rawBytes = 0;
+			size_t storedBytes = 0;
+		};
+
+		std::deque<std::shared_ptr<Entry>> m_entries;
+		std::mutex m_lock;
+		std::condition_variable m_entryAdded;
+		std::thread m_compressorThread;
+		size_t m_memoryBudget = 0;
+		size_t m_storedBytes = 0;
+		bool m_useCompression = false;
+		bool m_closed = false;
+		bool m_stopCompressor = false;
+		Statistics m_statistics;
+
+		void CompressorLoop();
+		static bool GetCodecLayout(Pylon::EPixelType pixelType, int &sampleBytes, int &pixelPeriod, int &rowPeriod);
+		static void CompressImage(const Pylon::CPylonImage &image, Frame &frame);
+		static void DecompressImage(const Frame &frame, Pylon::CPylonImage &image);
+
+	public:
+		CBracketQueue();
+		~CBracketQueue();
+
+		// memoryBudget: how many bytes of brackets the queue may hold before new brackets are dropped (0 = no limit).
+		// useCompression: compress waiting brackets on a background thread.
+		int Start(size_t memoryBudget, bool useCompression, std::string &errorMessage);
+		void Stop();
+
+		// Add a bracket. The images must own their buffers (use CopyImage(), not AttachGrabResultBuffer()).
+		// Returns 1 (and drops the bracket) if the queue is over its memory budget.
+		int Push(const std::vector<Pylon::CPylonImage> &images, std::string &errorMessage);
+
+		// Take the oldest bracket, decompressing it if needed. Waits up to timeoutMs for one to arrive.
+		// Returns false on timeout, or when the queue is closed and empty.
+		bool Pop(std::vector<Pylon::CPylonImage> &images, unsigned int timeoutMs);
+
+		// No more brackets will be pushed. Pop() returns false once the queue is drained.
+		void Close();
+		bool IsDrained();
+
+		size_t GetDepth();
+		Statistics GetStatistics();
+	};
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+BracketQueue::CBracketQueue::CBracketQueue()
+{
+	// nothing
+}
+
+BracketQueue::CBracketQueue::~CBracketQueue()
+{
+	Stop();
+}
+
+int BracketQueue::CBracketQueue::Start(size_t memoryBudget, bool useCompression, std::string &errorMessage)
+{
+	errorMessage = "ERROR: ";
+	errorMessage.append(__FUNCTION__);
+	errorMessage.append("(): ");
+
+	try
+	{
+		Stop();
+
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_entries.clear();
+		m_memoryBudget = memoryBudget;
+		m_storedBytes = 0;
+		m_useCompression = useCompression;
+		m_closed = false;
+		m_stopCompressor = false;
+		m_statistics = Statistics();
+
+		if (m_useCompression)
+			m_compressorThread = std::thread(&CBracketQueue::CompressorLoop, this);
+
+		return 0;
+	}
+	catch (std::exception &e)
+	{
+		errorMessage.append("EXCEPTION: ");
+		errorMessage.append(e.what());
+		return 1;
+	}
+	catch (...)
+	{
+		errorMessage.append("EXCEPTION: ");
+		errorMessage.append("UNKNOWN.");
+		return 1;
+	}
+}
+
+void BracketQueue::CBracketQueue::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_stopCompressor = true;
+		m_closed = true;
+	}
+	m_entryAdded.notify_all();
+
+	if (m_compressorThread.joinable())
+		m_compressorThread.join();
+}
+
+int BracketQueue::CBracketQueue::Push(const std::vector<Pylon::CPylonImage> &images, std::string &errorMessage)
+{
+	errorMessage = "ERROR: ";
+	errorMessage.append(__FUNCTION__);
+	errorMessage.append("(): ");
+
+	try
+	{
+		std::shared_ptr<Entry> entry(new Entry());
+		entry->images = images;
+		for (size_t i = 0; i < images.size(); i++)
+			entry->rawBytes += images[i].GetImageSize();
+		entry->storedBytes = entry->rawBytes;
+
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+
+			if (m_closed)
+			{
+				errorMessage.append("Queue is closed");
+				return 1;
+			}
+
+			if (m_memoryBudget > 0 && m_storedBytes + entry->storedBytes > m_memoryBudget)
+			{
+				m_statistics.droppedBrackets++;
+				errorMessage.append("Queue is over its memory budget. Bracket dropped.");
+				return 1;
+			}
+
+			m_entries.push_back(entry);
+			m_storedBytes += entry->storedBytes;
+			m_statistics.pushedBrackets++;
+			if (m_entries.size() > m_statistics.maxDepth)
+				m_statistics.maxDepth = m_entries.size();
+			if (m_storedBytes > m_statistics.maxStoredBytes)
+				m_statistics.maxStoredBytes = m_storedBytes;
+		}
+		m_entryAdded.notify_all();
+
+		return 0;
+	}
+	catch (GenICam::GenericException &e)
+	{
+		errorMessage.append("EXCEPTION: ");
+		errorMessage.append(e.GetDescription());
+		return 1;
+	}
+	catch (std::exception &e)
+	{
+		errorMessage.append("EXCEPTION: ");
+		errorMessage.append(e.what());
+		return 1;
+	}
+	catch (...)
+	{
+		errorMessage.append("EXCEPTION: ");
+		errorMessage.append("UNKNOWN.");
+		return 1;
+	}
+}
+
+bool BracketQueue::CBracketQueue::Pop(std::vector<Pylon::CPylonImage> &images, unsigned int timeoutMs)
+{
+	std::shared_ptr<Entry> entry;
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+		if (m_entryAdded.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this] { return !m_entries.empty() || m_closed; }) == false)
+			return false;
+		if (m_entries.empty())
+			return false;
+
+		entry = m_entries.front();
+		m_entries.pop_front();
+		entry->popped = true;
+		m_storedBytes -= entry->storedBytes;
+	}
+
+	// A bracket that is still being compressed keeps its images until the compressor is done, so use those.
+	if (entry->compressed == false)
+	{
+		images = entry->images;
+		return true;
+	}
+
+	std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+	images.resize(entry->frames.size());
+	size_t decompressedBytes = 0;
+	for (size_t i = 0; i < entry->frames.size(); i++)
+	{
+		DecompressImage(entry->frames[i], images[i]);
+		decompressedBytes += entry->frames[i].imageSize;
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_statistics.decompressOutputBytes += decompressedBytes;
+	m_statistics.decompressSeconds += seconds;
+	return true;
+}
+
+void BracketQueue::CBracketQueue::Close()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_closed = true;
+	}
+	m_entryAdded.notify_all();
+}
+
+bool BracketQueue::CBracketQueue::IsDrained()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_closed && m_entries.empty();
+}
+
+size_t BracketQueue::CBracketQueue::GetDepth()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_entries.size();
+}
+
+BracketQueue::Statistics BracketQueue::CBracketQueue::GetStatistics()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_statistics;
+}
+
+void BracketQueue::CBracketQueue::CompressorLoop()
+{
+	std::unique_lock<std::mutex> lock(m_lock);
+
+	while (m_stopCompressor == false)
+	{
+		// The oldest bracket is next in line for fusion, so compressing it would only cost time.
+		// Compress the next oldest one that is still raw.
+		std::shared_ptr<Entry> entry;
+		for (size_t i = 1; i < m_entries.size(); i++)
+		{
+			if (m_entries[i]->compressed == false && m_entries[i]->compressing == false)
+			{
+				entry = m_entries[i];
+				break;
+			}
+		}
+
+		if (!entry)
+		{
+			m_entryAdded.wait_for(lock, std::chrono::milliseconds(100));
+			continue;
+		}
+
+		entry->compressing = true;
+		std::vector<Pylon::CPylonImage> images = entry->images;
+		lock.unlock();
+
+		std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+		std::vector<Frame> frames(images.size());
+		size_t storedBytes = 0;
+		for (size_t i = 0; i < images.size(); i++)
+		{
+			CompressImage(images[i], frames[i]);
+			storedBytes += frames[i].data.size();
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		images.clear();
+
+		lock.lock();
+		entry->compressing = false;
+		m_statistics.compressInputBytes += entry->rawBytes;
+		m_statistics.compressOutputBytes += storedBytes;
+		m_statistics.compressSeconds += seconds;
+
+		// If fusion took the bracket while we were working on it, the compressed copy is not needed anymore.
+		if (entry->popped == false)
+		{
+			entry->frames.swap(frames);
+			entry->images.clear();
+			entry->compressed = true;
+			m_storedBytes = m_storedBytes - entry->storedBytes + storedBytes;
+			entry->storedBytes = storedBytes;
+			m_statistics.compressedBrackets++;
+		}
+	}
+}
+
+bool BracketQueue::CBracketQueue::GetCodecLayout(Pylon::EPixelType pixelType, int &sampleBytes, int &pixelPeriod, int &rowPeriod)
+{
+	if (Pylon::IsPacked(pixelType) || Pylon::IsYUV(pixelType))
+		return false;
+
+	uint32_t samplesPerPixel = Pylon::SamplesPerPixel(pixelType);
+	uint32_t bitsPerSample = Pylon::BitPerPixel(pixelType) / samplesPerPixel;
+	if (bitsPerSample == 8)
+		sampleBytes = 1;
+	else if (bitsPerSample == 16)
+		sampleBytes = 2;
+	else
+		return false;
+
+	if (Pylon::IsBayer(pixelType))
+	{
+		pixelPeriod = 2;
+		rowPeriod = 2;
+	}
+	else
+	{
+		pixelPeriod = (int)samplesPerPixel;
+		rowPeriod = 1;
+	}
+	return true;
+}
+
+void BracketQueue::CBracketQueue::CompressImage(const Pylon::CPylonImage &image, Frame &frame)
+{
+	frame.pixelType = image.GetPixelType();
+	frame.width = image.GetWidth();
+	frame.height = image.GetHeight();
+	frame.imageSize = image.GetImageSize();
+
+	const uint8_t *pImage = (const uint8_t*)image.GetBuffer();
+	int sampleBytes = 0;
+	int pixelPeriod = 0;
+	int rowPeriod = 0;
+	if (GetCodecLayout(frame.pixelType, sampleBytes, pixelPeriod, rowPeriod) && frame.height > 0)
+	{
+		int samplesPerRow = (int)(frame.imageSize / frame.height / sampleBytes);
+		frame.data.resize(BracketCodec::MaxEncodedSize((size_t)samplesPerRow * frame.height, sampleBytes));
+		size_t encodedSize = BracketCodec::Encode(pImage, samplesPerRow, (int)frame.height, sampleBytes, pixelPeriod, rowPeriod, frame.data.data());
+		if (encodedSize < frame.imageSize)
+		{
+			frame.data.resize(encodedSize);
+			frame.data.shrink_to_fit();
+			frame.raw = false;
+			return;
+		}
+	}
+
+	// Not worth coding: keep the image as is.
+	frame.data.assign(pImage, pImage + frame.imageSize);
+	frame.raw = true;
+}
+
+void BracketQueue::CBracketQueue::DecompressImage(const Frame &frame, Pylon::CPylonImage &image)
+{
+	size_t paddingX = 0;
+	if (frame.height > 0)
+	{
+		size_t rowBytes = frame.imageSize / frame.height;
+		size_t packedRowBytes = (size_t)Pylon::ComputeBufferSize(frame.pixelType, frame.width, 1);
+		if (rowBytes > packedRowBytes)
+			paddingX = rowBytes - packedRowBytes;
+	}
+	image.Reset(frame.pixelType, frame.width, frame.height, paddingX);
+
+	uint8_t *pImage = (uint8_t*)image.GetBuffer();
+	if (frame.raw)
+	{
+		memcpy(pImage, frame.data.data(), frame.imageSize);
+		return;
+	}
+
+	int sampleBytes = 0;
+	int pixelPeriod = 0;
+	int rowPeriod = 0;
+	GetCodecLayout(frame.pixelType, sampleBytes, pixelPeriod, rowPeriod);
+	int samplesPerRow = (int)(frame.imageSize / frame.height / sampleBytes);
+	if (BracketCodec::Decode(frame.data.data(), frame.data.size(), samplesPerRow, (int)frame.height, sampleBytes, pixelPeriod, rowPeriod, pImage) == false)
+		throw RUNTIME_EXCEPTION("BracketQueue: corrupt compressed image");
+}
+
+// *********************************************************************************************************
+
+#endif
@@ -0,0 +1,264 @@
+// BurstCapture.h
+// A preallocated, pre-faulted pool of grab buffers for capturing short bursts into RAM at full sensor speed.
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BURSTCAPTURE_H
+#define BURSTCAPTURE_H
+
+#ifndef LINUX_BUILD
+#define WIN_BUILD
+#endif
+
+// Include Pylon libraries (if needed)
+#include <pylon/PylonIncludes.h>
+
+#ifdef WIN_BUILD
+#include <malloc.h>
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <stdlib.h>
+#include <sys/mman.h>
+#endif
+
+#include <vector>
+#include <mutex>
+#include <cstring>
+
+namespace BurstCapture
+{
+	// Buffers are aligned to a page so the driver can DMA into them without bounce copies.
+	static const size_t c_bufferAlignment = 4096;
+
+	// How many whole brackets of 'payloadSize' bytes fit into 'memoryBudget' bytes.
+	uint32_t BracketsFromBudget(size_t memoryBudget, size_t payloadSize, uint32_t imagesPerHDR);
+
+	// A buffer factory for the Grab Engine that hands out buffers from a pool allocated (and touched) up front.
+	// With this, no memory is allocated or page-faulted in while the burst is running.
+	class BufferPool : public Pylon::IBufferFactory
+	{
+	private:
+		std::vector<uint8_t*> m_buffers;
+		std::vector<uint8_t*> m_freeBuffers;
+		size_t m_bufferSize = 0;
+		bool m_locked = false;
+		std::mutex m_lock;
+
+	public:
+		BufferPool();
+		~BufferPool();
+
+		// Allocate 'numBuffers' buffers of 'bufferSize' bytes and write to every page of them.
+		int Allocate(size_t numBuffers, size_t bufferSize, std::string &errorMessage);
+		// Lock the buffers into RAM, so they can't be paged out between bursts. Needs the right to lock that much memory
+		// (RLIMIT_MEMLOCK on Linux; on Windows the working set is grown to fit).
+		int Lock(std::string &errorMessage);
+		void Release();
+		size_t GetNumBuffers();
+		size_t GetBufferSize();
+
+		// Pylon::IBufferFactory
+		virtual void AllocateBuffer(size_t bufferSize, void** pCreatedBuffer, intptr_t& bufferContext);
+		virtual void FreeBuffer(void* pCreatedBuffer, intptr_t bufferContext);
+		virtual void DestroyBufferFactory();
+	};
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+uint32_t BurstCapture::BracketsFromBudget(size_t memoryBudget, size_t payloadSize, uint32_t imagesPerHDR)
+{
+	if (payloadSize == 0 || imagesPerHDR == 0)
+		return 0;
+
+	return (uint32_t)(memoryBudget / (payloadSize * imagesPerHDR));
+}
+
+BurstCapture::BufferPool::BufferPool()
+{
+	// nothing
+}
+
+BurstCapture::BufferPool::~BufferPool()
+{
+	Release();
+}
+
+int BurstCapture::BufferPool::Allocate(size_t numBuffers, size_t bufferSize, std::string &errorMessage)
+{
+	errorMessage = "ERROR: ";
+	errorMessage.append(__FUNCTION__);
+	errorMessage.append("(): ");
+
+	try
+	{
+		Release();
+
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_bufferSize = bufferSize;
+
+		for (size_t i = 0; i < numBuffers; i++)
+		{
+#ifdef WIN_BUILD
+			uint8_t *pBuffer = (uint8_t*)_aligned_malloc(bufferSize, c_bufferAlignment);
+#else
+			uint8_t *pBuffer = NULL;
+			if (posix_memalign((void**)&pBuffer, c_bufferAlignment, bufferSize) != 0)
+				pBuffer = NULL;
+#endif
+			if (pBuffer == NULL)
+			{
+				errorMessage.append("Out of memory after ");
+				errorMessage.append(std::to_string(i));
+				errorMessage.append(" buffers");
+				return 1;
+			}
+
+			// Pre-fault: touching every page now means the OS maps it now, not during the burst.
+			memset(pBuffer, 0, bufferSize);
+
+			m_buffers.push_back(pBuffer);
+			m_freeBuffers.push_back(pBuffer);
+		}
+
+		return 0;
+	}
+	catch (std::exception &e)
+	{
+		errorMessage.append("EXCEPTION: ");
+		errorMessage.append(e.what());
+		return 1;
+	}
+	catch (...)
+	{
+		errorMessage.append("EXCEPTION: ");
+		errorMessage.append("UNKNOWN.");
+		return 1;
+	}
+}
+
+int BurstCapture::BufferPool::Lock(std::string &errorMessage)
+{
+	errorMessage = "ERROR: ";
+	errorMessage.append(__FUNCTION__);
+	errorMessage.append("(): ");
+
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (m_locked)
+		return 0;
+
+#ifdef WIN_BUILD
+	// VirtualLock() can only lock what fits into the minimum working set.
+	SIZE_T minimumSize = 0;
+	SIZE_T maximumSize = 0;
+	SIZE_T poolSize = m_buffers.size() * m_bufferSize;
+	if (GetProcessWorkingSetSize(GetCurrentProcess(), &minimumSize, &maximumSize) == FALSE
+		|| SetProcessWorkingSetSize(GetCurrentProcess(), minimumSize + poolSize, maximumSize + poolSize) == FALSE)
+	{
+		errorMessage.append("Could not grow the working set to fit the buffers");
+		return 1;
+	}
+#endif
+
+	for (size_t i = 0; i < m_buffers.size(); i++)
+	{
+#ifdef WIN_BUILD
+		bool locked = (VirtualLock(m_buffers[i], m_bufferSize) != FALSE);
+#else
+		bool locked = (mlock(m_buffers[i], m_bufferSize) == 0);
+#endif
+		if (locked == false)
+		{
+			// Leave nothing half locked.
+			for (size_t j = 0; j < i; j++)
+			{
+#ifdef WIN_BUILD
+				VirtualUnlock(m_buffers[j], m_bufferSize);
+#else
+				munlock(m_buffers[j], m_bufferSize);
+#endif
+			}
+			errorMessage.append("Could not lock the buffers into memory (not allowed to lock that much?)");
+			return 1;
+		}
+	}
+
+	m_locked = true;
+	return 0;
+}
+
+void BurstCapture::BufferPool::Release()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	for (size_t i = 0; i < m_buffers.size(); i++)
+	{
+#ifdef WIN_BUILD
+		if (m_locked)
+			VirtualUnlock(m_buffers[i], m_bufferSize);
+		_aligned_free(m_buffers[i]);
+#else
+		if (m_locked)
+			munlock(m_buffers[i], m_bufferSize);
+		free(m_buffers[i]);
+#endif
+	}
+
+	m_buffers.clear();
+	m_freeBuffers.clear();
+	m_bufferSize = 0;
+	m_locked = false;
+}
+
+size_t BurstCapture::BufferPool::GetNumBuffers()
+{
+	return m_buffers.size();
+}
+
+size_t BurstCapture::BufferPool::GetBufferSize()
+{
+	return m_bufferSize;
+}
+
+void BurstCapture::BufferPool::AllocateBuffer(size_t bufferSize, void** pCreatedBuffer, intptr_t& bufferContext)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	// The Grab Engine asks for MaxNumBuffer buffers at StartGrabbing(). Set MaxNumBuffer to the pool size.
+	if (bufferSize > m_bufferSize || m_freeBuffers.empty())
+		throw RUNTIME_EXCEPTION("BufferPool: no free buffer of %u bytes. Check MaxNumBuffer and PayloadSize.", (unsigned int)bufferSize);
+
+	*pCreatedBuffer = m_freeBuffers.back();
+	m_freeBuffers.pop_back();
+	bufferContext = 0;
+}
+
+void BurstCapture::BufferPool::FreeBuffer(void* pCreatedBuffer, intptr_t /*bufferContext*/)
+{
+	// The memory stays in the pool so the next burst does not need to allocate or fault it in again.
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_freeBuffers.push_back((uint8_t*)pCreatedBuffer);
+}
+
+void BurstCapture::BufferPool::DestroyBufferFactory()
+{
+	// nothing. The pool is owned by the application, so register it with Pylon::Cleanup_None.
+}
+
+// *********************************************************************************************************
+
+#endif
@@ -0,0 +1,206 @@
+// CameraBringUp.h
+// Brings up several cameras at once: each one is created, opened and configured on its own thread,
+// so the startup time is that of the slowest camera instead of the sum of all of them.
+// Prints the progress of every camera as it happens, keeps the error of each camera that failed,
+// and reports how long every phase took per camera.
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CAMERABRINGUP_H
+#define CAMERABRINGUP_H
+
+// Include Pylon libraries (if needed)
+#include <pylon/PylonIncludes.h>
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+namespace CameraBringUp
+{
+	// Records how long each phase of one camera's startup took.
+	class CPhaseTimer
+	{
+	private:
+		std::chrono::steady_clock::time_point m_last;
+
+	public:
+		std::vector<std::pair<std::string, double>> phases; // name, milliseconds
+
+		CPhaseTimer();
+		// End the current phase (it started at the previous Mark(), or at construction).
+		void Mark(const std::string &phase);
+		double GetTotal() const;
+	};
+
+	template <class Camera>
+	struct CameraSlot
+	{
+		std::string serialNumber;
+		std::unique_ptr<Camera> camera;
+		CPhaseTimer timer;
+		bool ready = false;
+		std::string errorMessage;
+	};
+
+	// Called on the camera's own thread once it is open. Set up parameters here, and Mark() each phase on the timer.
+	// Returns 0 on success. Throwing a GenICam or std exception counts as failure, too.
+	template <class Camera>
+	using ConfigureFunction = std::function<int(size_t index, Camera &camera, CPhaseTimer &timer, std::string &errorMessage)>;
+
+	// Serializes console output of the bring-up threads.
+	std::mutex g_printLock;
+
+	// Find, open and configure every camera in 'serialNumbers' in parallel. 'slots' gets one entry per serial number.
+	// Returns the number of cameras that are ready.
+	template <class Camera>
+	size_t BringUp(const std::vector<std::string> &serialNumbers, ConfigureFunction<Camera> configure, std::vector<CameraSlot<Camera>> &slots);
+
+	// Print the startup time of every phase per camera.
+	template <class Camera>
+	void PrintPhaseTimes(const std::vector<CameraSlot<Camera>> &slots, double discoveryMs, double wallMs);
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+CameraBringUp::CPhaseTimer::CPhaseTimer() : m_last(std::chrono::steady_clock::now())
+{
+}
+
+void CameraBringUp::CPhaseTimer::Mark(const std::string &phase)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	phases.push_back(std::make_pair(phase, std::chrono::duration<double, std::milli>(now - m_last).count()));
+	m_last = now;
+}
+
+double CameraBringUp::CPhaseTimer::GetTotal() const
+{
+	double total = 0;
+	for (size_t i = 0; i < phases.size(); i++)
+		total += phases[i].second;
+	return total;
+}
+
+template <class Camera>
+size_t CameraBringUp::BringUp(const std::vector<std::string> &serialNumbers, ConfigureFunction<Camera> configure, std::vector<CameraSlot<Camera>> &slots)
+{
+	std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+	slots.clear();
+	slots.resize(serialNumbers.size());
+
+	// Discovery: one enumeration of the bus for all cameras. Enumerating once per camera would only be slower.
+	Pylon::DeviceInfoList_t devices;
+	Pylon::CTlFactory::GetInstance().EnumerateDevices(devices);
+	double discoveryMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < serialNumbers.size(); i++)
+	{
+		CameraSlot<Camera> &slot = slots[i];
+		slot.serialNumber = serialNumbers[i];
+
+		size_t device = 0;
+		while (device < devices.size() && std::string(devices[device].GetSerialNumber().c_str()) != slot.serialNumber)
+			device++;
+		if (device == devices.size())
+		{
+			slot.errorMessage = "Camera not found";
+			std::lock_guard<std::mutex> lock(g_printLock);
+			std::cout << "[" << slot.serialNumber << "] Error: " << slot.errorMessage << std::endl;
+			continue;
+		}
+
+		Pylon::CDeviceInfo info = devices[device];
+		threads.push_back(std::thread([&slot, info, i, configure]
+		{
+			try
+			{
+				slot.timer = CPhaseTimer();
+				slot.camera.reset(new Camera(Pylon::CTlFactory::GetInstance().CreateDevice(info)));
+				slot.camera->Open();
+				slot.timer.Mark("open");
+				{
+					std::lock_guard<std::mutex> lock(g_printLock);
+					std::cout << "[" << slot.serialNumber << "] Opened " << info.GetModelName() << std::endl;
+				}
+
+				std::string errorMessage = "";
+				if (configure(i, *slot.camera, slot.timer, errorMessage) != 0)
+					slot.errorMessage = errorMessage;
+				else
+					slot.ready = true;
+			}
+			catch (GenICam::GenericException &e)
+			{
+				slot.errorMessage = e.GetDescription();
+			}
+			catch (std::exception &e)
+			{
+				slot.errorMessage = e.what();
+			}
+
+			std::lock_guard<std::mutex> lock(g_printLock);
+			if (slot.ready)
+				std::cout << "[" << slot.serialNumber << "] Ready after " << slot.timer.GetTotal() << " ms" << std::endl;
+			else
+				std::cout << "[" << slot.serialNumber << "] Error: " << slot.errorMessage << std::endl;
+		}));
+	}
+
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+
+	double wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+	PrintPhaseTimes(slots, discoveryMs, wallMs);
+
+	size_t numReady = 0;
+	for (size_t i = 0; i < slots.size(); i++)
+	{
+		if (slots[i].ready)
+			numReady++;
+	}
+	return numReady;
+}
+
+template <class Camera>
+void CameraBringUp::PrintPhaseTimes(const std::vector<CameraSlot<Camera>> &slots, double discoveryMs, double wallMs)
+{
+	std::lock_guard<std::mutex> lock(g_printLock);
+
+	std::cout << "Startup times (ms), discovery " << discoveryMs << " ms for all cameras:" << std::endl;
+	double serialMs = discoveryMs;
+	for (size_t i = 0; i < slots.size(); i++)
+	{
+		std::cout << "  " << std::left << std::setw(12) << slots[i].serialNumber << std::right;
+		for (size_t p = 0; p < slots[i].timer.phases.size(); p++)
+			std::cout << "  " << slots[i].timer.phases[p].first << " " << std::fixed << std::setprecision(1) << slots[i].timer.phases[p].second;
+		std::cout << "  total " << slots[i].timer.GetTotal() << (slots[i].ready ? "" : "  (failed)") << std::endl;
+		std::cout.unsetf(std::ios::fixed);
+		std::cout << std::setprecision(6);
+		serialMs += slots[i].timer.GetTotal();
+	}
+	std::cout << "Startup took " << wallMs << " ms (one camera after the other: about " << serialMs << " ms)" << std::endl;
+}
+
+// *********************************************************************************************************
+
+#endif
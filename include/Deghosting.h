@@ -0,0 +1,174 @@
+// Deghosting.h
+// Keeps things that move during a bracket from showing up several times (as "ghosts") in the fused image.
+//
+// Aligning the images (AlignMTB) only corrects a shift of the whole image, and it is slow. Parts that move on the
+// conveyor need a local answer: find where each exposure disagrees with a reference exposure, and let only the
+// reference be seen there. Each image and the reference are brought to the same brightness (by matching their
+// histograms, so no exposure times or camera response are needed) and compared at a fraction of the resolution,
+// which is cheap and ignores noise. Where they differ, the image's fusion weights are taken away.
+// Pixels that are (nearly) black or white in either image can't be compared, so they never count as moving.
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Uses OpenCV libraries. License information can be found here:
+// https://opencv.org/license/
+
+#ifndef DEGHOSTING_H
+#define DEGHOSTING_H
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
+
+namespace Deghosting
+{
+	struct Settings
+	{
+		int levels = 3;          // compare at 1/2^levels of the resolution
+		float threshold = 0.1f;  // difference (of full scale) after matching the brightness, above which a pixel moved
+		int dilation = 1;        // grow the masks by this many pixels (of the small images), to cover the edges of what moved
+		int clipMargin = 8;      // grey levels at either end that are too dark or too bright to compare
+	};
+
+	// One motion mask per image (CV_32FC1, 1/2^levels of the size): 1 where the image shows something else than the
+	// reference, 0 where they agree. The reference's own mask is empty. 'images' are CV_8UC3.
+	void ComputeMotionMasks(const std::vector<cv::Mat> &images, size_t referenceIndex, const Settings &settings, std::vector<cv::Mat> &masks);
+
+	// Take the fusion weights (CV_32FC1, not yet normalized) of each image away where its mask says it moved.
+	void SuppressMotion(std::vector<cv::Mat> &weights, const std::vector<cv::Mat> &masks);
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+namespace Deghosting
+{
+	namespace Detail
+	{
+		// The grey image at 1/2^levels of the size.
+		inline void Shrink(const cv::Mat &image, int levels, cv::Mat &gray)
+		{
+			cv::Mat small = image;
+			for (int level = 0; level < levels; level++)
+			{
+				cv::Mat down;
+				cv::pyrDown(small, down);
+				small = down;
+			}
+			cv::cvtColor(small, gray, cv::COLOR_BGR2GRAY);
+		}
+
+		// The grey level of 'reference' that each grey level of 'gray' corresponds to: the one at the same place in the histogram.
+		inline void MatchHistograms(const cv::Mat &gray, const cv::Mat &reference, uint8_t lut[256])
+		{
+			uint32_t histogram[256] = { 0 };
+			uint32_t referenceHistogram[256] = { 0 };
+			for (int y = 0; y < gray.rows; y++)
+			{
+				const uint8_t *pGray = gray.ptr<uint8_t>(y);
+				const uint8_t *pReference = reference.ptr<uint8_t>(y);
+				for (int x = 0; x < gray.cols; x++)
+				{
+					histogram[pGray[x]]++;
+					referenceHistogram[pReference[x]]++;
+				}
+			}
+
+			// Each level stands for the middle of the samples it holds.
+			uint64_t below = 0;
+			uint64_t referenceBelow = 0;
+			int match = 0;
+			for (int level = 0; level < 256; level++)
+			{
+				uint64_t position = 2 * below + histogram[level];
+				while (match < 255 && 2 * (referenceBelow + referenceHistogram[match]) < position)
+					referenceBelow += referenceHistogram[match++];
+				lut[level] = (uint8_t)match;
+				below += histogram[level];
+			}
+		}
+	}
+}
+
+void Deghosting::ComputeMotionMasks(const std::vector<cv::Mat> &images, size_t referenceIndex, const Settings &settings, std::vector<cv::Mat> &masks)
+{
+	masks.clear();
+	masks.resize(images.size());
+	if (images.empty())
+		return;
+	referenceIndex = std::min(referenceIndex, images.size() - 1);
+
+	cv::Mat reference;
+	Detail::Shrink(images[referenceIndex], settings.levels, reference);
+
+	int threshold = (int)(settings.threshold * 255);
+	int low = settings.clipMargin;
+	int high = 255 - settings.clipMargin;
+	cv::Mat kernel = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(2 * settings.dilation + 1, 2 * settings.dilation + 1));
+
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		if (i == referenceIndex)
+			continue;
+
+		cv::Mat gray;
+		Detail::Shrink(images[i], settings.levels, gray);
+
+		uint8_t lut[256];
+		Detail::MatchHistograms(gray, reference, lut);
+
+		cv::Mat moved(gray.size(), CV_8UC1);
+		for (int y = 0; y < gray.rows; y++)
+		{
+			const uint8_t *pGray = gray.ptr<uint8_t>(y);
+			const uint8_t *pReference = reference.ptr<uint8_t>(y);
+			uint8_t *pMoved = moved.ptr<uint8_t>(y);
+			for (int x = 0; x < gray.cols; x++)
+			{
+				bool comparable = pGray[x] >= low && pGray[x] <= high && pReference[x] >= low && pReference[x] <= high;
+				pMoved[x] = (comparable && abs((int)lut[pGray[x]] - (int)pReference[x]) > threshold) ? 255 : 0;
+			}
+		}
+
+		if (settings.dilation > 0)
+			cv::dilate(moved, moved, kernel);
+		moved.convertTo(masks[i], CV_32FC1, 1.0 / 255);
+	}
+}
+
+void Deghosting::SuppressMotion(std::vector<cv::Mat> &weights, const std::vector<cv::Mat> &masks)
+{
+	for (size_t i = 0; i < weights.size() && i < masks.size(); i++)
+	{
+		if (masks[i].empty())
+			continue;
+
+		// Upsampling the small mask smoothly also softens its edges, so no seams show where the weights change.
+		cv::Mat mask;
+		cv::resize(masks[i], mask, weights[i].size(), 0, 0, cv::INTER_LINEAR);
+		for (int y = 0; y < mask.rows; y++)
+		{
+			const float *pMask = mask.ptr<float>(y);
+			float *pWeight = weights[i].ptr<float>(y);
+			for (int x = 0; x < mask.cols; x++)
+				pWeight[x] *= 1.0f - pMask[x];
+		}
+	}
+}
+
+// *********************************************************************************************************
+
+#endif
@@ -0,0 +1,1031 @@
+// ExposureFusion.h
+// Exposure fusion (Mertens, Kautz and Van Reeth) in the open, so the stages in between can be changed.
+//
+// It computes the same as OpenCV's MergeMertens: every pixel of every image gets a weight (contrast x saturation x
+// well-exposedness, each raised to its own power), the weights are normalized to add up to 1 at each pixel, and the
+// images are blended by their weights in a Laplacian pyramid. MergeMertens does all of that in one call, so there is
+// no way to get at the weights. Here each step is a function of its own, and the weights can be changed before
+// they are normalized (for example by deghosting, see Deghosting.h). Only the terms switched on are computed (a kernel
+// for each combination), and the well-exposedness on its own is three table lookups per pixel.
+//
+// The pyramids are built with our own 5 tap kernels (the same filters and borders as OpenCV's pyrDown and pyrUp), so they
+// can be stored in half floats: all pyramid levels together take as much memory as the images themselves, several
+// times over, and most of the time of the blend goes into reading and writing them. Stored as halves, that traffic
+// halves. All arithmetic is done in float. The full resolution weights are read as they are.
+//
+// Each image is split into planar channels once, so every kernel works on one channel at a time and reads it
+// linearly. All pyramid levels live in one block of memory (see Detail::PyramidArena), every plane and every row
+// on a 64 byte boundary, laid out once per image size instead of being allocated level by level.
+//
+// Building a Laplacian pyramid the usual way takes three passes per level (pyrDown, pyrUp, subtract) and a temporary
+// for each. Here one pass over the rows of a level computes the next Gaussian level and this Laplacian level, and
+// blends it right away. The last image's levels are blended and the blended pyramid collapsed in one pass per level.
+// The filters work 4 values at a time with SSE2 where available.
+// The collapse goes through the fused result at every scale (1/2, 1/4, ...) on its way to full resolution, so those
+// levels can be handed out as well, for analysis that works on several scales, for the cost of a copy.
+//
+// MergeMertens always goes down to a few pixels. The pyramid can stop earlier ('maxDepth'): its coarsest level is then
+// blended as it is, like the top level always is. That changes nothing where the weights no longer change at that
+// scale, which GetAutoPyramidDepth() measures. Large images save the passes over their coarse levels, small ones
+// (regions) the tiny levels that cost more in overhead than in work.
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Uses OpenCV libraries. License information can be found here:
+// https://opencv.org/license/
+
+#ifndef EXPOSUREFUSION_H
+#define EXPOSUREFUSION_H
+
+#include <opencv2/opencv.hpp>
+
+// Half float storage of the pyramids
+#include "HalfFloat.h"
+
+#include <stdint.h>
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#    include <emmintrin.h>
+#    define EXPOSUREFUSION_SSE2
+#endif
+
+namespace ExposureFusion
+{
+	// The exponent of each term of the weight. 0 switches a term off. The defaults are MergeMertens' defaults.
+	struct Parameters
+	{
+		float contrastWeight = 1.0f;
+		float saturationWeight = 1.0f;
+		float exposureWeight = 0.0f;
+	};
+
+	// The terms of the weight.
+	enum WeightTerm
+	{
+		WeightTerm_Contrast = 1,
+		WeightTerm_Saturation = 2,
+		WeightTerm_Exposure = 4,
+		WeightTerm_All = 7
+	};
+
+	// The terms 'parameters' switch on (exponent not 0), as WeightTerm_ flags. Only those are computed.
+	int GetWeightTerms(const Parameters &parameters);
+
+	// The weight of every pixel of each CV_8UC3 image (CV_32FC1, not normalized).
+	void ComputeWeights(const std::vector<cv::Mat> &images, const Parameters &parameters, std::vector<cv::Mat> &weights);
+
+	// Scale the weights so they add up to 1 at every pixel.
+	void NormalizeWeights(std::vector<cv::Mat> &weights);
+
+	// How the pyramid levels are stored.
+	enum PyramidStorage
+	{
+		PyramidStorage_Float32,
+		PyramidStorage_Float16 // IEEE half floats: half the memory, about 11 bits of precision
+	};
+
+	// The number of pyramid levels below full resolution for images of 'size' (the same as MergeMertens).
+	int GetPyramidDepth(cv::Size size);
+	// The same, but at most 'maxDepth' (0: no limit).
+	int GetPyramidDepth(cv::Size size, int maxDepth);
+
+	// AUTO DEPTH: How much the normalized weights may still vary (standard deviation) at the coarsest level.
+	static const float c_autoDepthTolerance = 0.05f;
+	// AUTO DEPTH: The levels above full depth that are measured (on a thumbnail). Finer levels are always kept.
+	static const int c_autoDepthLevels = 6;
+
+	// AUTO DEPTH: The shallowest depth at which every image's normalized weights (as they are blended at that level)
+	// vary by no more than 'tolerance': below it, the scene's lighting changes too little for the blend to change.
+	// At least 1 (unless the images are too small for any level).
+	int GetAutoPyramidDepth(const std::vector<cv::Mat> &weights, float tolerance = c_autoDepthTolerance);
+
+	// Blend CV_8UC3 images by their normalized weights in a Laplacian pyramid. The result is CV_32FC3 BGR, 1.0 = white.
+	// 'maxDepth': at most this many levels below full resolution (0: as many as the images have, like MergeMertens).
+	void Blend(const std::vector<cv::Mat> &images, const std::vector<cv::Mat> &weights, cv::Mat &fusion, PyramidStorage storage = PyramidStorage_Float32,
+		int maxDepth = 0);
+	// The same, plus the blended pyramid's collapsed levels below full resolution: 'levels[0]' is half the size of the
+	// fusion, 'levels[1]' a quarter, ... (CV_32FC3, 'numLevels' of them, or as many as the pyramid has). They are what
+	// the fusion looks like at each scale, within a few 8 bit steps of pyrDown'ing it.
+	void Blend(const std::vector<cv::Mat> &images, const std::vector<cv::Mat> &weights, cv::Mat &fusion, std::vector<cv::Mat> &levels, int numLevels,
+		PyramidStorage storage = PyramidStorage_Float32, int maxDepth = 0);
+
+	// The memory (in bytes) Blend() works in for images of 'size', not counting the images, weights and result.
+	// (It is allocated in one piece.)
+	size_t GetBlendMemory(cv::Size size, PyramidStorage storage, int maxDepth = 0);
+
+	// All of the above.
+	void Fuse(const std::vector<cv::Mat> &images, const Parameters &parameters, cv::Mat &fusion);
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+namespace ExposureFusion
+{
+	namespace Detail
+	{
+		// x^exponent, without pow() for the exponent 1 (the default).
+		inline float Power(float x, float exponent)
+		{
+			return (exponent == 1.0f) ? x : std::pow(x, exponent);
+		}
+
+		// The width of the well-exposedness curve.
+		static const float c_exposureSigma = 0.2f;
+
+		// The weight of one pixel (0..1 values) whose contrast (the Laplacian of the grey image) is 'contrast', computing
+		// only the 'Terms' (WeightTerm_ flags). The others are x^0 = 1.
+		template<int Terms>
+		inline float Weight(float b, float g, float r, float contrast, const Parameters &parameters)
+		{
+			float weight = 1.0f;
+			if (Terms & WeightTerm_Contrast)
+				weight *= Power(std::fabs(contrast), parameters.contrastWeight);
+
+			// Saturation: how far the channels spread around their mean.
+			if (Terms & WeightTerm_Saturation)
+			{
+				float mean = (b + g + r) / 3.0f;
+				weight *= Power(std::sqrt((b - mean) * (b - mean) + (g - mean) * (g - mean) + (r - mean) * (r - mean)), parameters.saturationWeight);
+			}
+
+			// Well-exposedness: how close each channel is to the middle, on a Gaussian curve.
+			if (Terms & WeightTerm_Exposure)
+			{
+				const float sigma = c_exposureSigma;
+				weight *= Power(std::exp(-((b - 0.5f) * (b - 0.5f) + (g - 0.5f) * (g - 0.5f) + (r - 0.5f) * (r - 0.5f)) / (2 * sigma * sigma)),
+					parameters.exposureWeight);
+			}
+			return weight + 1e-12f;
+		}
+
+		// The weights of a range of rows of one image, computing only the 'Terms'. ('contrast' is only read with
+		// WeightTerm_Contrast.)
+		template<int Terms>
+		class WeightBody : public cv::ParallelLoopBody
+		{
+		private:
+			const cv::Mat &m_image;
+			const cv::Mat &m_contrast;
+			const Parameters &m_parameters;
+			cv::Mat &m_weights;
+
+		public:
+			WeightBody(const cv::Mat &image, const cv::Mat &contrast, const Parameters &parameters, cv::Mat &weights)
+				: m_image(image), m_contrast(contrast), m_parameters(parameters), m_weights(weights)
+			{
+			}
+
+			virtual void operator()(const cv::Range &range) const
+			{
+				for (int y = range.start; y < range.end; y++)
+				{
+					const uint8_t *pBGR = m_image.ptr<uint8_t>(y);
+					const float *pContrast = (Terms & WeightTerm_Contrast) ? m_contrast.ptr<float>(y) : NULL;
+					float *pWeight = m_weights.ptr<float>(y);
+					for (int x = 0; x < m_image.cols; x++, pBGR += 3)
+						pWeight[x] = Weight<Terms>(pBGR[0] / 255.0f, pBGR[1] / 255.0f, pBGR[2] / 255.0f, pContrast ? pContrast[x] : 0.0f, m_parameters);
+				}
+			}
+		};
+
+		// The well-exposedness of one channel value (0..255) raised to 'exponent'. The term is the product of the
+		// channels' curves, so with the other terms off a pixel's weight is the product of three of these.
+		inline float ChannelExposure(int value, float exponent)
+		{
+			const float sigma = c_exposureSigma;
+			float c = value / 255.0f - 0.5f;
+			return Power(std::exp(-c * c / (2 * sigma * sigma)), exponent);
+		}
+
+		// The weights of a range of rows of one image with only the well-exposedness on: three table lookups per pixel.
+		class ExposureTableBody : public cv::ParallelLoopBody
+		{
+		private:
+			const cv::Mat &m_image;
+			const float *m_pTable; // 256 entries
+			cv::Mat &m_weights;
+
+		public:
+			ExposureTableBody(const cv::Mat &image, const float *pTable, cv::Mat &weights)
+				: m_image(image), m_pTable(pTable), m_weights(weights)
+			{
+			}
+
+			virtual void operator()(const cv::Range &range) const
+			{
+				for (int y = range.start; y < range.end; y++)
+				{
+					const uint8_t *pBGR = m_image.ptr<uint8_t>(y);
+					float *pWeight = m_weights.ptr<float>(y);
+					for (int x = 0; x < m_image.cols; x++, pBGR += 3)
+						pWeight[x] = m_pTable[pBGR[0]] * m_pTable[pBGR[1]] * m_pTable[pBGR[2]] + 1e-12f;
+				}
+			}
+		};
+
+		// The weights of one image with the kernel for 'terms'.
+		inline void ComputeImageWeights(const cv::Mat &image, const cv::Mat &contrast, const Parameters &parameters, int terms, cv::Mat &weights)
+		{
+			cv::Range rows(0, image.rows);
+			switch (terms)
+			{
+			case 0: cv::parallel_for_(rows, WeightBody<0>(image, contrast, parameters, weights)); break;
+			case 1: cv::parallel_for_(rows, WeightBody<1>(image, contrast, parameters, weights)); break;
+			case 2: cv::parallel_for_(rows, WeightBody<2>(image, contrast, parameters, weights)); break;
+			case 3: cv::parallel_for_(rows, WeightBody<3>(image, contrast, parameters, weights)); break;
+			case 4: cv::parallel_for_(rows, WeightBody<4>(image, contrast, parameters, weights)); break;
+			case 5: cv::parallel_for_(rows, WeightBody<5>(image, contrast, parameters, weights)); break;
+			case 6: cv::parallel_for_(rows, WeightBody<6>(image, contrast, parameters, weights)); break;
+			default: cv::parallel_for_(rows, WeightBody<7>(image, contrast, parameters, weights)); break;
+			}
+		}
+
+		// Index i of a row or column of n, mirrored at the borders without repeating the border (OpenCV's BORDER_REFLECT_101).
+		inline int Reflect(int i, int n)
+		{
+			if (n == 1)
+				return 0;
+			while (i < 0 || i >= n)
+				i = (i < 0) ? -i : 2 * n - 2 - i;
+			return i;
+		}
+
+		// One channel of one pyramid level: 'height' rows of 'width' values, 'stride' bytes apart.
+		struct Plane
+		{
+			uint8_t *pData;
+			size_t stride;
+			int width;
+			int height;
+			int depth; // CV_8U (0..255, read as 0..1), CV_16U (half floats) or CV_32F
+		};
+
+		// A single channel CV_8U, CV_16U or CV_32F image as a plane.
+		inline Plane ToPlane(const cv::Mat &mat)
+		{
+			Plane plane = { mat.data, mat.step, mat.cols, mat.rows, mat.depth() };
+			return plane;
+		}
+
+		// Row y of a plane as floats.
+		inline void LoadRow(const Plane &plane, int y, float *pOut)
+		{
+			const uint8_t *pRow = plane.pData + (size_t)y * plane.stride;
+			switch (plane.depth)
+			{
+			case CV_8U:
+			{
+				int x = 0;
+#ifdef EXPOSUREFUSION_SSE2
+				const __m128i zero = _mm_setzero_si128();
+				const __m128 scale = _mm_set1_ps(1.0f / 255.0f);
+				for (; x + 8 <= plane.width; x += 8)
+				{
+					__m128i values = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pRow + x)), zero);
+					_mm_storeu_ps(pOut + x, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(values, zero)), scale));
+					_mm_storeu_ps(pOut + x + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(values, zero)), scale));
+				}
+#endif
+				for (; x < plane.width; x++)
+					pOut[x] = pRow[x] * (1.0f / 255.0f);
+				break;
+			}
+			case CV_16U:
+				HalfFloat::ToFloatRow((const uint16_t*)pRow, pOut, (size_t)plane.width);
+				break;
+			default:
+				memcpy(pOut, pRow, plane.width * sizeof(float));
+				break;
+			}
+		}
+
+		// Store floats into row y of a plane (CV_32F, or CV_16U for half floats).
+		inline void StoreRow(const Plane &plane, int y, const float *pIn)
+		{
+			uint8_t *pRow = plane.pData + (size_t)y * plane.stride;
+			if (plane.depth == CV_16U)
+				HalfFloat::FromFloatRow(pIn, (uint16_t*)pRow, (size_t)plane.width);
+			else
+				memcpy(pRow, pIn, plane.width * sizeof(float));
+		}
+
+		// Where every plane of every level that Blend() works in lives in one block of memory: one image's Gaussian
+		// pyramid (level 0 being the image itself, deinterleaved into 8 bit planes), its weights' Gaussian pyramid
+		// (level 0 being the weights as they are, so not in here) and the blended pyramid. The offsets are worked out once
+		// for the size of the images. Every plane and every row starts on a 64 byte boundary (a cache line, and the
+		// widest vector), so the kernels stream through memory a whole vector at a time.
+		class PyramidArena
+		{
+		private:
+			static const size_t c_alignment = 64;
+
+			struct Level
+			{
+				cv::Size size;
+				size_t stride;      // bytes per row of the levels stored as 'm_depth'
+				size_t image[3];    // offsets of the planes
+				size_t weight;
+				size_t result[3];
+			};
+			std::vector<Level> m_levels;
+			int m_depth;
+			size_t m_size;
+			cv::Mat m_memory;
+			uint8_t *m_pBase;
+
+			static size_t Align(size_t value)
+			{
+				return (value + c_alignment - 1) / c_alignment * c_alignment;
+			}
+
+			Plane GetPlane(int level, size_t offset, size_t stride, int depth) const
+			{
+				Plane plane = { m_pBase + offset, stride, m_levels[level].size.width, m_levels[level].size.height, depth };
+				return plane;
+			}
+
+		public:
+			PyramidArena(cv::Size size, int depth, PyramidStorage storage)
+				: m_levels(depth + 1), m_depth((storage == PyramidStorage_Float16) ? CV_16U : CV_32F), m_size(0), m_pBase(NULL)
+			{
+				size_t bytesPerValue = (storage == PyramidStorage_Float16) ? 2 : 4;
+				for (int level = 0; level <= depth; level++)
+				{
+					Level &layout = m_levels[level];
+					layout.size = size;
+					layout.stride = Align(size.width * bytesPerValue);
+					size_t planeSize = layout.stride * size.height;
+					size_t imagePlaneSize = (level > 0) ? planeSize : Align(size.width) * size.height;
+
+					for (int c = 0; c < 3; c++)
+					{
+						layout.image[c] = m_size;
+						m_size += imagePlaneSize;
+					}
+					layout.weight = m_size;
+					if (level > 0)
+						m_size += planeSize;
+					for (int c = 0; c < 3; c++)
+					{
+						layout.result[c] = m_size;
+						m_size += planeSize;
+					}
+					size = cv::Size((size.width + 1) / 2, (size.height + 1) / 2);
+				}
+			}
+
+			// The bytes all levels take.
+			size_t GetSize() const
+			{
+				return m_size;
+			}
+
+			void Allocate()
+			{
+				m_memory.create(1, (int)(m_size + c_alignment), CV_8UC1);
+				m_pBase = m_memory.data + (c_alignment - (size_t)m_memory.data % c_alignment) % c_alignment;
+			}
+
+			Plane Image(int level, int channel) const
+			{
+				return (level > 0) ? GetPlane(level, m_levels[level].image[channel], m_levels[level].stride, m_depth)
+					: GetPlane(level, m_levels[level].image[channel], Align(m_levels[level].size.width), CV_8U);
+			}
+
+			Plane Weight(int level) const // level > 0
+			{
+				return GetPlane(level, m_levels[level].weight, m_levels[level].stride, m_depth);
+			}
+
+			Plane Result(int level, int channel) const
+			{
+				return GetPlane(level, m_levels[level].result[channel], m_levels[level].stride, m_depth);
+			}
+		};
+
+		// Split an interleaved CV_8UC3 image into 3 planes, once, so everything after it reads one channel at a time.
+		class DeinterleaveBody : public cv::ParallelLoopBody
+		{
+		private:
+			const cv::Mat &m_image;
+			Plane m_planes[3];
+
+		public:
+			DeinterleaveBody(const cv::Mat &image, const Plane *pPlanes)
+				: m_image(image)
+			{
+				std::copy(pPlanes, pPlanes + 3, m_planes);
+			}
+
+			virtual void operator()(const cv::Range &range) const
+			{
+				for (int y = range.start; y < range.end; y++)
+				{
+					const uint8_t *pBGR = m_image.ptr<uint8_t>(y);
+					uint8_t *pB = m_planes[0].pData + (size_t)y * m_planes[0].stride;
+					uint8_t *pG = m_planes[1].pData + (size_t)y * m_planes[1].stride;
+					uint8_t *pR = m_planes[2].pData + (size_t)y * m_planes[2].stride;
+					for (int x = 0; x < m_image.cols; x++, pBGR += 3)
+					{
+						pB[x] = pBGR[0];
+						pG[x] = pBGR[1];
+						pR[x] = pBGR[2];
+					}
+				}
+			}
+		};
+
+		// The 5 tap filter [1 4 6 4 1] down 5 rows (x16).
+		inline void DownsampleColumns(const float *const *pRows, float *pOut, int width)
+		{
+			int x = 0;
+#ifdef EXPOSUREFUSION_SSE2
+			const __m128 four = _mm_set1_ps(4.0f);
+			const __m128 six = _mm_set1_ps(6.0f);
+			for (; x + 4 <= width; x += 4)
+			{
+				__m128 sum = _mm_add_ps(_mm_loadu_ps(pRows[0] + x), _mm_loadu_ps(pRows[4] + x));
+				sum = _mm_add_ps(sum, _mm_mul_ps(four, _mm_add_ps(_mm_loadu_ps(pRows[1] + x), _mm_loadu_ps(pRows[3] + x))));
+				sum = _mm_add_ps(sum, _mm_mul_ps(six, _mm_loadu_ps(pRows[2] + x)));
+				_mm_storeu_ps(pOut + x, sum);
+			}
+#endif
+			for (; x < width; x++)
+				pOut[x] = pRows[0][x] + pRows[4][x] + 4.0f * (pRows[1][x] + pRows[3][x]) + 6.0f * pRows[2][x];
+		}
+
+		// The 5 tap filter at value 2 * x of a row, mirrored at the borders.
+		inline float DownsampleAt(const float *pIn, int width, int x)
+		{
+			int center = 2 * x;
+			return pIn[Reflect(center - 2, width)] + pIn[Reflect(center + 2, width)]
+				+ 4.0f * (pIn[Reflect(center - 1, width)] + pIn[Reflect(center + 1, width)]) + 6.0f * pIn[center];
+		}
+
+		// The 5 tap filter along a row at every other value (x16), then both passes scaled back.
+		inline void DownsampleRow(const float *pIn, int width, float *pOut, int outWidth)
+		{
+			// Away from the borders all taps are inside the row.
+			int interiorEnd = std::min(outWidth, (width - 1) / 2);
+			int x = 0;
+			for (; x < std::min(1, outWidth); x++)
+				pOut[x] = DownsampleAt(pIn, width, x) * (1.0f / 256.0f);
+#ifdef EXPOSUREFUSION_SSE2
+			const __m128 four = _mm_set1_ps(4.0f);
+			const __m128 six = _mm_set1_ps(6.0f);
+			const __m128 scale = _mm_set1_ps(1.0f / 256.0f);
+			for (; x + 5 <= interiorEnd; x += 4)
+			{
+				// The taps of 4 outputs, split into the even and odd values of the row.
+				const float *pCenter = pIn + 2 * x;
+				__m128 left = _mm_loadu_ps(pCenter - 2);
+				__m128 center = _mm_loadu_ps(pCenter);
+				__m128 next = _mm_loadu_ps(pCenter + 2);
+				__m128 right = _mm_loadu_ps(pCenter + 4);
+				__m128 beyond = _mm_loadu_ps(pCenter + 6);
+				__m128 m2 = _mm_shuffle_ps(left, next, _MM_SHUFFLE(2, 0, 2, 0));
+				__m128 m1 = _mm_shuffle_ps(left, next, _MM_SHUFFLE(3, 1, 3, 1));
+				__m128 c = _mm_shuffle_ps(center, right, _MM_SHUFFLE(2, 0, 2, 0));
+				__m128 p1 = _mm_shuffle_ps(center, right, _MM_SHUFFLE(3, 1, 3, 1));
+				__m128 p2 = _mm_shuffle_ps(next, beyond, _MM_SHUFFLE(2, 0, 2, 0));
+				__m128 sum = _mm_add_ps(_mm_add_ps(_mm_add_ps(m2, p2), _mm_mul_ps(four, _mm_add_ps(m1, p1))), _mm_mul_ps(six, c));
+				_mm_storeu_ps(pOut + x, _mm_mul_ps(sum, scale));
+			}
+#endif
+			for (; x < interiorEnd; x++)
+			{
+				const float *pCenter = pIn + 2 * x;
+				pOut[x] = (pCenter[-2] + pCenter[2] + 4.0f * (pCenter[-1] + pCenter[1]) + 6.0f * pCenter[0]) * (1.0f / 256.0f);
+			}
+			for (; x < outWidth; x++)
+				pOut[x] = DownsampleAt(pIn, width, x) * (1.0f / 256.0f);
+		}
+
+		// Row k of the next (half size) level of 'src', like OpenCV's pyrDown. 'pScratch' holds 6 rows of 'src'.
+		inline void DownsampleRow(const Plane &src, int k, float *pOut, int outWidth, float *pScratch)
+		{
+			float *pRows[5];
+			for (int i = 0; i < 5; i++)
+			{
+				pRows[i] = pScratch + i * src.width;
+				LoadRow(src, Reflect(2 * k + i - 2, src.height), pRows[i]);
+			}
+			float *pColumns = pScratch + 5 * src.width;
+			DownsampleColumns(pRows, pColumns, src.width);
+			DownsampleRow(pColumns, src.width, pOut, outWidth);
+		}
+
+		// Fine row 2 * k (or 2 * k + 1 if 'odd') upsampled from rows k - 1, k and k + 1 of the coarser level, like
+		// OpenCV's pyrUp does vertically (x8).
+		inline void UpsampleColumns(const float *pAbove, const float *pRow, const float *pBelow, bool odd, float *pOut, int width)
+		{
+			int x = 0;
+#ifdef EXPOSUREFUSION_SSE2
+			const __m128 four = _mm_set1_ps(4.0f);
+			const __m128 six = _mm_set1_ps(6.0f);
+			for (; x + 4 <= width; x += 4)
+			{
+				__m128 row = _mm_loadu_ps(pRow + x);
+				__m128 below = _mm_loadu_ps(pBelow + x);
+				__m128 sum = odd ? _mm_mul_ps(four, _mm_add_ps(row, below))
+					: _mm_add_ps(_mm_add_ps(_mm_loadu_ps(pAbove + x), _mm_mul_ps(six, row)), below);
+				_mm_storeu_ps(pOut + x, sum);
+			}
+#endif
+			for (; x < width; x++)
+				pOut[x] = odd ? 4.0f * (pRow[x] + pBelow[x]) : pAbove[x] + 6.0f * pRow[x] + pBelow[x];
+		}
+
+		// Values 2 * x and 2 * x + 1 of a row upsampled like OpenCV's pyrUp does horizontally (x8): mirrored at the left
+		// border, repeated at the right.
+		inline void UpsampleAt(const float *pIn, int width, int x, float *pOut, int outWidth)
+		{
+			float center = pIn[x];
+			float right = pIn[std::min(x + 1, width - 1)];
+			pOut[2 * x] = (pIn[Reflect(x - 1, width)] + 6.0f * center + right) * (1.0f / 64.0f);
+			if (2 * x + 1 < outWidth)
+				pOut[2 * x + 1] = 4.0f * (center + right) * (1.0f / 64.0f);
+		}
+
+		// A row upsampled to 'outWidth' (at most twice as wide) horizontally (x8), then both passes scaled back.
+		inline void UpsampleRow(const float *pIn, int width, float *pOut, int outWidth)
+		{
+			// Away from the borders all taps are inside the row.
+			int count = (outWidth + 1) / 2;
+			int interiorEnd = std::min(outWidth / 2, width - 1);
+			int x = 0;
+			for (; x < std::min(1, count); x++)
+				UpsampleAt(pIn, width, x, pOut, outWidth);
+#ifdef EXPOSUREFUSION_SSE2
+			const __m128 four = _mm_set1_ps(4.0f);
+			const __m128 six = _mm_set1_ps(6.0f);
+			const __m128 scale = _mm_set1_ps(1.0f / 64.0f);
+			for (; x + 4 <= interiorEnd; x += 4)
+			{
+				__m128 left = _mm_loadu_ps(pIn + x - 1);
+				__m128 center = _mm_loadu_ps(pIn + x);
+				__m128 right = _mm_loadu_ps(pIn + x + 1);
+				__m128 even = _mm_mul_ps(_mm_add_ps(_mm_add_ps(left, _mm_mul_ps(six, center)), right), scale);
+				__m128 odd = _mm_mul_ps(_mm_mul_ps(four, _mm_add_ps(center, right)), scale);
+				_mm_storeu_ps(pOut + 2 * x, _mm_unpacklo_ps(even, odd));
+				_mm_storeu_ps(pOut + 2 * x + 4, _mm_unpackhi_ps(even, odd));
+			}
+#endif
+			for (; x < interiorEnd; x++)
+			{
+				pOut[2 * x] = (pIn[x - 1] + 6.0f * pIn[x] + pIn[x + 1]) * (1.0f / 64.0f);
+				pOut[2 * x + 1] = 4.0f * (pIn[x] + pIn[x + 1]) * (1.0f / 64.0f);
+			}
+			for (; x < count; x++)
+				UpsampleAt(pIn, width, x, pOut, outWidth);
+		}
+
+		// Row y of 'src' upsampled to 'outWidth', like OpenCV's pyrUp: the 5 tap filter over the plane with a zero
+		// between every two values (x4). Mirrored at the top and left border, repeated at the bottom and right.
+		// 'pScratch' holds 4 rows of 'src'.
+		inline void UpsampleRow(const Plane &src, int y, float *pOut, int outWidth, float *pScratch)
+		{
+			int width = src.width;
+			int sy = y / 2;
+			bool odd = (y & 1) != 0;
+			float *pAbove = pScratch;
+			float *pRow = pScratch + width;
+			float *pBelow = pScratch + 2 * width;
+			float *pColumns = pScratch + 3 * width;
+
+			LoadRow(src, sy, pRow);
+			LoadRow(src, std::min(sy + 1, src.height - 1), pBelow);
+			if (!odd)
+				LoadRow(src, Reflect(sy - 1, src.height), pAbove);
+			UpsampleColumns(pAbove, pRow, pBelow, odd, pColumns, width);
+			UpsampleRow(pColumns, width, pOut, outWidth);
+		}
+
+		// The next (half size) level of Gaussian pyramids, like OpenCV's pyrDown, for up to 4 planes at once.
+		class DownBody : public cv::ParallelLoopBody
+		{
+		private:
+			Plane m_src[4];
+			Plane m_dst[4];
+			int m_count;
+
+		public:
+			DownBody(const Plane *pSrc, const Plane *pDst, int count)
+				: m_count(count)
+			{
+				std::copy(pSrc, pSrc + count, m_src);
+				std::copy(pDst, pDst + count, m_dst);
+			}
+
+			virtual void operator()(const cv::Range &range) const
+			{
+				std::vector<float> buffer(6 * m_src[0].width + m_dst[0].width);
+				float *pOut = &buffer[6 * m_src[0].width];
+
+				for (int y = range.start; y < range.end; y++)
+				{
+					for (int p = 0; p < m_count; p++)
+					{
+						DownsampleRow(m_src[p], y, pOut, m_dst[p].width, &buffer[0]);
+						StoreRow(m_dst[p], y, pOut);
+					}
+				}
+			}
+		};
+
+		// One level of one image in a single pass over its rows: the next level of the image's and the weights'
+		// Gaussian pyramids, and at the same time this level of the image's Laplacian pyramid (gaussian - pyrUp(next)),
+		// times the weights, added to the blended pyramid. The range is one of rows of the next level: each of those
+		// rows is computed once, kept while the two rows of this level it covers need it, and stored for the next level.
+		class LaplacianLevelBody : public cv::ParallelLoopBody
+		{
+		private:
+			Plane m_gaussian[3];
+			Plane m_weight;
+			Plane m_next[3];
+			Plane m_nextWeight;
+			Plane m_result[3];
+			bool m_first;         // the first image sets the result instead of adding to it
+
+		public:
+			LaplacianLevelBody(const Plane *pGaussian, const Plane &weight, const Plane *pNext, const Plane &nextWeight, const Plane *pResult, bool first)
+				: m_weight(weight), m_nextWeight(nextWeight), m_first(first)
+			{
+				std::copy(pGaussian, pGaussian + 3, m_gaussian);
+				std::copy(pNext, pNext + 3, m_next);
+				std::copy(pResult, pResult + 3, m_result);
+			}
+
+			virtual void operator()(const cv::Range &range) const
+			{
+				int width = m_gaussian[0].width;
+				int height = m_gaussian[0].height;
+				int nextWidth = m_next[0].width;
+				int nextHeight = m_next[0].height;
+
+				// The last 3 rows of the next level (per channel), in the slot of their row number modulo 3.
+				std::vector<float> buffer(6 * width + 4 * width + 9 * nextWidth + 2 * nextWidth);
+				float *pScratch = &buffer[0];
+				float *pImage = &buffer[6 * width];
+				float *pUp = pImage + width;
+				float *pResult = pUp + width;
+				float *pWeight = pResult + width;
+				float *pSlots = pWeight + width;
+				float *pColumns = pSlots + 9 * nextWidth;
+				float *pNextWeight = pColumns + nextWidth;
+				int slotRows[3] = { -1, -1, -1 };
+
+				for (int k = range.start; k < range.end; k++)
+				{
+					DownsampleRow(m_weight, k, pNextWeight, nextWidth, pScratch);
+					StoreRow(m_nextWeight, k, pNextWeight);
+
+					// The rows of the next level that rows 2k and 2k + 1 of this level are upsampled from.
+					int rows[3] = { Reflect(k - 1, nextHeight), k, std::min(k + 1, nextHeight - 1) };
+					for (int r = 0; r < 3; r++)
+					{
+						int slot = rows[r] % 3;
+						if (slotRows[slot] == rows[r])
+							continue;
+						slotRows[slot] = rows[r];
+						for (int c = 0; c < 3; c++)
+						{
+							float *pNextRow = pSlots + (3 * c + slot) * nextWidth;
+							DownsampleRow(m_gaussian[c], rows[r], pNextRow, nextWidth, pScratch);
+							if (rows[r] >= range.start && rows[r] < range.end)
+								StoreRow(m_next[c], rows[r], pNextRow);
+						}
+					}
+
+					for (int y = 2 * k; y < std::min(2 * k + 2, height); y++)
+					{
+						LoadRow(m_weight, y, pWeight);
+						for (int c = 0; c < 3; c++)
+						{
+							const float *pChannelSlots = pSlots + 3 * c * nextWidth;
+							UpsampleColumns(pChannelSlots + (rows[0] % 3) * nextWidth, pChannelSlots + (rows[1] % 3) * nextWidth,
+								pChannelSlots + (rows[2] % 3) * nextWidth, y != 2 * k, pColumns, nextWidth);
+							UpsampleRow(pColumns, nextWidth, pUp, width);
+							LoadRow(m_gaussian[c], y, pImage);
+
+							if (m_first)
+							{
+								for (int x = 0; x < width; x++)
+									pResult[x] = (pImage[x] - pUp[x]) * pWeight[x];
+							}
+							else
+							{
+								LoadRow(m_result[c], y, pResult);
+								for (int x = 0; x < width; x++)
+									pResult[x] += (pImage[x] - pUp[x]) * pWeight[x];
+							}
+							StoreRow(m_result[c], y, pResult);
+						}
+					}
+				}
+			}
+		};
+
+		// One level of the last image, blended into the blended pyramid and collapsed in the same pass:
+		// level = result + (gaussian - pyrUp(coarser)) * weight + pyrUp(collapsed), for each of the 3 channels, where
+		// 'collapsed' is the coarser level of the blended pyramid, already collapsed. At the top level there is no
+		// coarser level, and the image's level is blended as it is. The level is stored in place of the result (with
+		// 'store'), and written interleaved into the CV_32FC3 'pOutput' (if any): the fusion, or one of its scales.
+		// Also blends the top level of the other images (without 'pCollapsed'), which needs no collapsing.
+		class BlendCollapseBody : public cv::ParallelLoopBody
+		{
+		private:
+			Plane m_gaussian[3];
+			Plane m_coarser[3];
+			bool m_hasCoarser;
+			Plane m_weight;
+			Plane m_result[3];
+			Plane m_collapsed[3];
+			bool m_hasCollapsed;
+			bool m_first;         // the first image sets the result instead of adding to it
+			cv::Mat *m_pOutput;
+			bool m_store;
+
+		public:
+			BlendCollapseBody(const Plane *pGaussian, const Plane *pCoarser, const Plane &weight, const Plane *pResult, const Plane *pCollapsed, bool first,
+				cv::Mat *pOutput, bool store)
+				: m_hasCoarser(pCoarser != NULL), m_weight(weight), m_hasCollapsed(pCollapsed != NULL), m_first(first), m_pOutput(pOutput), m_store(store)
+			{
+				std::copy(pGaussian, pGaussian + 3, m_gaussian);
+				if (m_hasCoarser)
+					std::copy(pCoarser, pCoarser + 3, m_coarser);
+				std::copy(pResult, pResult + 3, m_result);
+				if (m_hasCollapsed)
+					std::copy(pCollapsed, pCollapsed + 3, m_collapsed);
+			}
+
+			virtual void operator()(const cv::Range &range) const
+			{
+				int width = m_gaussian[0].width;
+				int coarserWidth = m_hasCoarser ? m_coarser[0].width : 0;
+				std::vector<float> buffer(4 * width + 4 * coarserWidth);
+				float *pImage = &buffer[0];
+				float *pUp = &buffer[width];
+				float *pResult = &buffer[2 * width];
+				float *pWeight = &buffer[3 * width];
+				float *pScratch = &buffer[4 * width];
+
+				for (int y = range.start; y < range.end; y++)
+				{
+					LoadRow(m_weight, y, pWeight);
+					for (int c = 0; c < 3; c++)
+					{
+						LoadRow(m_gaussian[c], y, pImage);
+						if (m_hasCoarser)
+						{
+							UpsampleRow(m_coarser[c], y, pUp, width, pScratch);
+							for (int x = 0; x < width; x++)
+								pImage[x] -= pUp[x];
+						}
+
+						if (m_first)
+						{
+							for (int x = 0; x < width; x++)
+								pResult[x] = pImage[x] * pWeight[x];
+						}
+						else
+						{
+							LoadRow(m_result[c], y, pResult);
+							for (int x = 0; x < width; x++)
+								pResult[x] += pImage[x] * pWeight[x];
+						}
+
+						if (m_hasCollapsed)
+						{
+							UpsampleRow(m_collapsed[c], y, pUp, width, pScratch);
+							for (int x = 0; x < width; x++)
+								pResult[x] += pUp[x];
+						}
+
+						if (m_store)
+							StoreRow(m_result[c], y, pResult);
+						if (m_pOutput == NULL)
+							continue;
+						float *pBGR = m_pOutput->ptr<float>(y) + c;
+						for (int x = 0; x < width; x++)
+							pBGR[3 * x] = pResult[x];
+					}
+				}
+			}
+		};
+	}
+}
+
+int ExposureFusion::GetWeightTerms(const Parameters &parameters)
+{
+	return ((parameters.contrastWeight != 0) ? WeightTerm_Contrast : 0)
+		| ((parameters.saturationWeight != 0) ? WeightTerm_Saturation : 0)
+		| ((parameters.exposureWeight != 0) ? WeightTerm_Exposure : 0);
+}
+
+void ExposureFusion::ComputeWeights(const std::vector<cv::Mat> &images, const Parameters &parameters, std::vector<cv::Mat> &weights)
+{
+	// Only the terms that are switched on are computed. The well-exposedness alone is a table lookup per channel.
+	int terms = GetWeightTerms(parameters);
+	float exposureTable[256];
+	if (terms == WeightTerm_Exposure)
+	{
+		for (int value = 0; value < 256; value++)
+			exposureTable[value] = Detail::ChannelExposure(value, parameters.exposureWeight);
+	}
+
+	weights.resize(images.size());
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		weights[i].create(images[i].size(), CV_32FC1);
+		if (terms == WeightTerm_Exposure)
+		{
+			cv::parallel_for_(cv::Range(0, images[i].rows), Detail::ExposureTableBody(images[i], exposureTable, weights[i]));
+			continue;
+		}
+
+		// Contrast: the Laplacian of the grey image. (MergeMertens takes the image for RGB here, so we do too.)
+		cv::Mat contrast;
+		if (terms & WeightTerm_Contrast)
+		{
+			cv::Mat image;
+			cv::Mat gray;
+			images[i].convertTo(image, CV_32FC3, 1.0 / 255);
+			cv::cvtColor(image, gray, cv::COLOR_RGB2GRAY);
+			cv::Laplacian(gray, contrast, CV_32F);
+		}
+		Detail::ComputeImageWeights(images[i], contrast, parameters, terms, weights[i]);
+	}
+}
+
+void ExposureFusion::NormalizeWeights(std::vector<cv::Mat> &weights)
+{
+	if (weights.empty())
+		return;
+
+	cv::Mat sum = weights[0].clone();
+	for (size_t i = 1; i < weights.size(); i++)
+		sum += weights[i];
+	for (size_t i = 0; i < weights.size(); i++)
+		cv::divide(weights[i], sum, weights[i]);
+}
+
+int ExposureFusion::GetPyramidDepth(cv::Size size)
+{
+	return (int)(logf((float)std::min(size.width, size.height)) / logf(2.0f));
+}
+
+int ExposureFusion::GetPyramidDepth(cv::Size size, int maxDepth)
+{
+	int depth = GetPyramidDepth(size);
+	return (maxDepth > 0) ? std::min(depth, maxDepth) : depth;
+}
+
+int ExposureFusion::GetAutoPyramidDepth(const std::vector<cv::Mat> &weights, float tolerance)
+{
+	if (weights.empty())
+		return 0;
+
+	// The coarse levels are all that is measured, so a thumbnail the size of the first of them is enough.
+	int fullDepth = GetPyramidDepth(weights[0].size());
+	int start = std::min(std::max(fullDepth - c_autoDepthLevels, 1), fullDepth);
+	cv::Size size = weights[0].size();
+	for (int level = 0; level < start; level++)
+		size = cv::Size((size.width + 1) / 2, (size.height + 1) / 2);
+
+	std::vector<cv::Mat> levels(weights.size());
+	for (size_t i = 0; i < weights.size(); i++)
+		cv::resize(weights[i], levels[i], size, 0, 0, cv::INTER_AREA);
+
+	for (int level = start; level < fullDepth; level++)
+	{
+		double deviation = 0;
+		for (size_t i = 0; i < levels.size(); i++)
+		{
+			cv::Scalar mean;
+			cv::Scalar standardDeviation;
+			cv::meanStdDev(levels[i], mean, standardDeviation);
+			deviation = std::max(deviation, standardDeviation[0]);
+		}
+		if (deviation <= tolerance)
+			return level;
+
+		// The next level, with the same filter as the blend.
+		size = cv::Size((size.width + 1) / 2, (size.height + 1) / 2);
+		for (size_t i = 0; i < levels.size(); i++)
+		{
+			cv::Mat next(size, CV_32FC1);
+			Detail::Plane src = Detail::ToPlane(levels[i]);
+			Detail::Plane dst = Detail::ToPlane(next);
+			cv::parallel_for_(cv::Range(0, size.height), Detail::DownBody(&src, &dst, 1));
+			levels[i] = next;
+		}
+	}
+	return fullDepth;
+}
+
+void ExposureFusion::Blend(const std::vector<cv::Mat> &images, const std::vector<cv::Mat> &weights, cv::Mat &fusion, PyramidStorage storage, int maxDepth)
+{
+	std::vector<cv::Mat> levels;
+	Blend(images, weights, fusion, levels, 0, storage, maxDepth);
+}
+
+void ExposureFusion::Blend(const std::vector<cv::Mat> &images, const std::vector<cv::Mat> &weights, cv::Mat &fusion, std::vector<cv::Mat> &levels, int numLevels,
+	PyramidStorage storage, int maxDepth)
+{
+	levels.clear();
+	if (images.empty())
+		return;
+
+	int depth = GetPyramidDepth(images[0].size(), maxDepth);
+	Detail::PyramidArena arena(images[0].size(), depth, storage);
+	arena.Allocate();
+
+	// The planes of every level, looked up once.
+	std::vector<Detail::Plane> imagePlanes(3 * (depth + 1));
+	std::vector<Detail::Plane> weightPlanes(depth + 1);
+	std::vector<Detail::Plane> resultPlanes(3 * (depth + 1));
+	for (int level = 0; level <= depth; level++)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			imagePlanes[3 * level + c] = arena.Image(level, c);
+			resultPlanes[3 * level + c] = arena.Result(level, c);
+		}
+		if (level > 0)
+			weightPlanes[level] = arena.Weight(level);
+	}
+
+	fusion.create(images[0].size(), CV_32FC3);
+	levels.resize(std::max(std::min(numLevels, depth), 0));
+	for (size_t level = 0; level < levels.size(); level++)
+		levels[level].create(weightPlanes[level + 1].height, weightPlanes[level + 1].width, CV_32FC3);
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		bool first = (i == 0);
+		cv::parallel_for_(cv::Range(0, images[i].rows), Detail::DeinterleaveBody(images[i], &imagePlanes[0]));
+		weightPlanes[0] = Detail::ToPlane(weights[i]);
+
+		if (i + 1 < images.size())
+		{
+			// Build the Gaussian pyramids and blend the Laplacian levels on the way down, one pass per level.
+			for (int level = 0; level < depth; level++)
+			{
+				cv::parallel_for_(cv::Range(0, weightPlanes[level + 1].height), Detail::LaplacianLevelBody(&imagePlanes[3 * level], weightPlanes[level],
+					&imagePlanes[3 * level + 3], weightPlanes[level + 1], &resultPlanes[3 * level], first));
+			}
+			cv::parallel_for_(cv::Range(0, weightPlanes[depth].height), Detail::BlendCollapseBody(&imagePlanes[3 * depth], NULL, weightPlanes[depth],
+				&resultPlanes[3 * depth], NULL, first, NULL, true));
+			continue;
+		}
+
+		// The last image: build its Gaussian pyramids first, then blend each level and collapse the blended pyramid in
+		// the same pass, from the top down. The last step writes the result, the ones before it the levels asked for.
+		for (int level = 1; level <= depth; level++)
+		{
+			Detail::Plane src[4] = { imagePlanes[3 * level - 3], imagePlanes[3 * level - 2], imagePlanes[3 * level - 1], weightPlanes[level - 1] };
+			Detail::Plane dst[4] = { imagePlanes[3 * level], imagePlanes[3 * level + 1], imagePlanes[3 * level + 2], weightPlanes[level] };
+			cv::parallel_for_(cv::Range(0, dst[0].height), Detail::DownBody(src, dst, 4));
+		}
+		for (int level = depth; level >= 0; level--)
+		{
+			const Detail::Plane *pCoarser = (level < depth) ? &imagePlanes[3 * level + 3] : NULL;
+			const Detail::Plane *pCollapsed = (level < depth) ? &resultPlanes[3 * level + 3] : NULL;
+			cv::Mat *pOutput = (level == 0) ? &fusion : (level <= (int)levels.size()) ? &levels[level - 1] : NULL;
+			cv::parallel_for_(cv::Range(0, weightPlanes[level].height), Detail::BlendCollapseBody(&imagePlanes[3 * level], pCoarser, weightPlanes[level],
+				&resultPlanes[3 * level], pCollapsed, first, pOutput, level > 0));
+		}
+	}
+}
+
+size_t ExposureFusion::GetBlendMemory(cv::Size size, PyramidStorage storage, int maxDepth)
+{
+	return Detail::PyramidArena(size, GetPyramidDepth(size, maxDepth), storage).GetSize();
+}
+
+void ExposureFusion::Fuse(const std::vector<cv::Mat> &images, const Parameters &parameters, cv::Mat &fusion)
+{
+	std::vector<cv::Mat> weights;
+	ComputeWeights(images, parameters, weights);
+	NormalizeWeights(weights);
+	Blend(images, weights, fusion);
+}
+
+// *********************************************************************************************************
+
+#endif
@@ -0,0 +1,252 @@
+// FrameRouter.h
+// Splits the frames of one camera into two streams by the sequencer set that took them:
+// the sets of the HDR bracket, and the sets of regular single-exposure frames (for example for tracking).
+//
+// The camera reports the set of each frame in its chunk data (SequencerSetActive), so routing doesn't depend
+// on counting frames and survives dropped frames: a bracket that misses an image is discarded, and the next one
+// starts clean at its first set. Complete brackets go to one handler, regular frames to another.
+// The handlers run on the grab thread, so they should only hand the frames off (see CLatestFrame).
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FRAMEROUTER_H
+#define FRAMEROUTER_H
+
+#include <stdint.h>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+namespace FrameRouter
+{
+	// Where the frames of a sequencer set go.
+	enum Stream
+	{
+		Stream_HDR,    // one image of the bracket
+		Stream_Normal, // a regular frame
+		Stream_None    // not routed (unknown set, or no chunk data)
+	};
+
+	struct Statistics
+	{
+		uint64_t hdrFrames = 0;
+		uint64_t normalFrames = 0;
+		uint64_t unroutedFrames = 0;
+		uint64_t brackets = 0;
+		uint64_t brokenBrackets = 0; // brackets discarded because an image was missing
+	};
+
+	// Frame is whatever the caller grabs into (a grab result, an image...).
+	template <class Frame>
+	class CFrameRouter
+	{
+	public:
+		typedef std::function<void(std::vector<Frame> &bracket)> BracketHandler;
+		typedef std::function<void(const Frame &frame)> FrameHandler;
+
+	private:
+		std::vector<Stream> m_setStreams;
+		std::vector<int> m_bracketPositions; // per set: its position in the bracket (-1 = not an HDR set)
+		BracketHandler m_onBracket;
+		FrameHandler m_onNormalFrame;
+		std::vector<Frame> m_bracket;
+		int m_nextPosition = 0; // the position the next HDR image must have (-1 = wait for the start of a bracket)
+		Statistics m_statistics;
+
+	public:
+		// setStreams: the stream of each sequencer set, by set index. The HDR sets make up the bracket, in the order of their index.
+		CFrameRouter(const std::vector<Stream> &setStreams, BracketHandler onBracket, FrameHandler onNormalFrame);
+
+		// Route one frame by the set that took it (setIndex < 0: unknown). Calls a handler when a bracket is complete or for a regular frame.
+		Stream Route(int64_t setIndex, const Frame &frame);
+
+		size_t GetBracketSize() const;
+		Statistics GetStatistics() const;
+	};
+
+	// A mailbox for the newest frame. Posting never waits: an unread frame is replaced by the newer one,
+	// which is what a consumer like a tracker wants when it falls behind.
+	template <class Frame>
+	class CLatestFrame
+	{
+	private:
+		std::mutex m_lock;
+		std::condition_variable m_posted;
+		Frame m_frame;
+		bool m_full = false;
+		bool m_closed = false;
+		uint64_t m_postedFrames = 0;
+		uint64_t m_replacedFrames = 0;
+
+	public:
+		void Post(const Frame &frame);
+
+		// Take the newest frame. Waits up to timeoutMs for one. Returns false on timeout, or when closed and empty.
+		bool Take(Frame &frame, unsigned int timeoutMs);
+
+		// No more frames will be posted.
+		void Close();
+		bool IsDrained();
+
+		uint64_t GetPostedFrames();
+		uint64_t GetReplacedFrames();
+	};
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+template <class Frame>
+FrameRouter::CFrameRouter<Frame>::CFrameRouter(const std::vector<Stream> &setStreams, BracketHandler onBracket, FrameHandler onNormalFrame)
+	: m_setStreams(setStreams), m_onBracket(onBracket), m_onNormalFrame(onNormalFrame)
+{
+	int position = 0;
+	for (size_t i = 0; i < m_setStreams.size(); i++)
+		m_bracketPositions.push_back(m_setStreams[i] == Stream_HDR ? position++ : -1);
+}
+
+template <class Frame>
+FrameRouter::Stream FrameRouter::CFrameRouter<Frame>::Route(int64_t setIndex, const Frame &frame)
+{
+	if (setIndex < 0 || setIndex >= (int64_t)m_setStreams.size() || m_setStreams[(size_t)setIndex] == Stream_None)
+	{
+		m_statistics.unroutedFrames++;
+		return Stream_None;
+	}
+
+	if (m_setStreams[(size_t)setIndex] == Stream_Normal)
+	{
+		m_statistics.normalFrames++;
+		m_onNormalFrame(frame);
+		return Stream_Normal;
+	}
+
+	m_statistics.hdrFrames++;
+	int position = m_bracketPositions[(size_t)setIndex];
+
+	// The first image of a bracket always starts a new one (discarding what is left of an incomplete one).
+	if (position == 0)
+	{
+		if (m_bracket.empty() == false)
+			m_statistics.brokenBrackets++;
+		m_bracket.clear();
+		m_nextPosition = 0;
+	}
+
+	if (position != m_nextPosition)
+	{
+		// An image is missing. Wait for the next bracket.
+		if (m_nextPosition >= 0)
+			m_statistics.brokenBrackets++;
+		m_bracket.clear();
+		m_nextPosition = -1;
+		return Stream_HDR;
+	}
+
+	m_bracket.push_back(frame);
+	m_nextPosition++;
+	if (m_bracket.size() == GetBracketSize())
+	{
+		m_statistics.brackets++;
+		m_onBracket(m_bracket);
+		m_bracket.clear();
+		m_nextPosition = 0;
+	}
+	return Stream_HDR;
+}
+
+template <class Frame>
+size_t FrameRouter::CFrameRouter<Frame>::GetBracketSize() const
+{
+	size_t size = 0;
+	for (size_t i = 0; i < m_setStreams.size(); i++)
+	{
+		if (m_setStreams[i] == Stream_HDR)
+			size++;
+	}
+	return size;
+}
+
+template <class Frame>
+FrameRouter::Statistics FrameRouter::CFrameRouter<Frame>::GetStatistics() const
+{
+	return m_statistics;
+}
+
+template <class Frame>
+void FrameRouter::CLatestFrame<Frame>::Post(const Frame &frame)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (m_closed)
+			return;
+		if (m_full)
+			m_replacedFrames++;
+		m_frame = frame;
+		m_full = true;
+		m_postedFrames++;
+	}
+	m_posted.notify_one();
+}
+
+template <class Frame>
+bool FrameRouter::CLatestFrame<Frame>::Take(Frame &frame, unsigned int timeoutMs)
+{
+	std::unique_lock<std::mutex> lock(m_lock);
+	if (m_posted.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this] { return m_full || m_closed; }) == false)
+		return false;
+	if (m_full == false)
+		return false;
+
+	frame = m_frame;
+	m_frame = Frame(); // don't hold on to the frame (a grab result would keep its buffer)
+	m_full = false;
+	return true;
+}
+
+template <class Frame>
+void FrameRouter::CLatestFrame<Frame>::Close()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_closed = true;
+	}
+	m_posted.notify_all();
+}
+
+template <class Frame>
+bool FrameRouter::CLatestFrame<Frame>::IsDrained()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_closed && m_full == false;
+}
+
+template <class Frame>
+uint64_t FrameRouter::CLatestFrame<Frame>::GetPostedFrames()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_postedFrames;
+}
+
+template <class Frame>
+uint64_t FrameRouter::CLatestFrame<Frame>::GetReplacedFrames()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_replacedFrames;
+}
+
+// *********************************************************************************************************
+
+#endif
@@ -0,0 +1,253 @@
+// FrameStatistics.h
+// Statistics of one exposure (histogram, mean level, dark and clipped fractions), computed straight from the raw
+// grab buffer in one pass, so auto exposure and bracketing decisions don't need a converted copy of the image.
+// Optionally only every n-th row is looked at, which is plenty for control decisions.
+//
+// Works on unpacked mono, Bayer and RGB/BGR formats of 8 to 16 bits (all samples count, whatever their colour).
+// 16 bit samples are reduced to their histogram bin, summed and checked for dark and clipped 8 at a time with SSE2
+// where available. 8 bit samples are their own bin, so they only go through the (scalar) histogram count, and their
+// sum, dark and clipped counts are read from the histogram afterwards.
+// CStatisticsBoard keeps the latest statistics of every exposure for the stages and control loops that read them.
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FRAMESTATISTICS_H
+#define FRAMESTATISTICS_H
+
+// Include Pylon libraries (if needed)
+#include <pylon/PylonIncludes.h>
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstring>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#    include <emmintrin.h>
+#    define FRAMESTATISTICS_SSE2
+#endif
+
+namespace FrameStatistics
+{
+	static const int c_numBins = 256;
+
+	struct Statistics
+	{
+		uint32_t histogram[c_numBins]; // of the samples, scaled to 8 bits
+		uint64_t samples;
+		double mean;            // 0..1 of full scale
+		double darkFraction;    // samples at 0
+		double clippedFraction; // samples at the largest value of the pixel format
+	};
+
+	// Statistics of a raw image. paddingX: bytes at the end of every row. rowStep: look at every rowStep-th row only.
+	// Returns 1 if the pixel format isn't supported.
+	int Compute(const void *pBuffer, Pylon::EPixelType pixelType, uint32_t width, uint32_t height, size_t paddingX, uint32_t rowStep, Statistics &statistics, std::string &errorMessage);
+
+	// The latest statistics of each exposure (by its index in the bracket, or its sequencer set). Safe to use from several threads.
+	class CStatisticsBoard
+	{
+	private:
+		struct Entry
+		{
+			Statistics statistics;
+			uint64_t frameCount = 0; // how many frames of this exposure were published
+		};
+
+		std::vector<Entry> m_entries;
+		std::mutex m_lock;
+
+	public:
+		void Publish(size_t exposureIndex, const Statistics &statistics);
+		// Returns false if nothing was published for this exposure yet.
+		bool Read(size_t exposureIndex, Statistics &statistics, uint64_t *pFrameCount = NULL);
+	};
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+namespace FrameStatistics
+{
+	namespace Detail
+	{
+		// Four histograms, used in turn, so back to back samples in the same bin don't wait on each other's increment.
+		struct SplitHistogram
+		{
+			uint32_t bins[4][c_numBins];
+		};
+
+		inline void CountBins(const uint8_t *pBins, size_t count, SplitHistogram &histogram)
+		{
+			size_t i = 0;
+			for (; i + 4 <= count; i += 4)
+			{
+				histogram.bins[0][pBins[i]]++;
+				histogram.bins[1][pBins[i + 1]]++;
+				histogram.bins[2][pBins[i + 2]]++;
+				histogram.bins[3][pBins[i + 3]]++;
+			}
+			for (; i < count; i++)
+				histogram.bins[0][pBins[i]]++;
+		}
+
+		// One row of 16 bit samples: write the bin of each sample to pBins, add up the samples, count those at 0 and at maxValue.
+		inline void ScanRow16(const uint16_t *pRow, size_t count, int shift, uint16_t maxValue, uint8_t *pBins, uint64_t &sum, uint64_t &dark, uint64_t &clipped)
+		{
+			size_t i = 0;
+#ifdef FRAMESTATISTICS_SSE2
+			// Lane sums stay below 2^32 for rows of up to 2^15 samples, and the per-lane counts below 2^15. Both are flushed every row.
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i max = _mm_set1_epi16((short)maxValue);
+			const __m128i shiftCount = _mm_cvtsi32_si128(shift);
+			__m128i sum32 = _mm_setzero_si128();
+			__m128i dark16 = _mm_setzero_si128();
+			__m128i clipped16 = _mm_setzero_si128();
+			for (; i + 8 <= count && i < 0x8000; i += 8)
+			{
+				__m128i v = _mm_loadu_si128((const __m128i*)(pRow + i));
+				sum32 = _mm_add_epi32(sum32, _mm_add_epi32(_mm_unpacklo_epi16(v, zero), _mm_unpackhi_epi16(v, zero)));
+				dark16 = _mm_sub_epi16(dark16, _mm_cmpeq_epi16(v, zero));
+				clipped16 = _mm_sub_epi16(clipped16, _mm_cmpeq_epi16(v, max));
+				__m128i bins = _mm_srl_epi16(v, shiftCount);
+				_mm_storel_epi64((__m128i*)(pBins + i), _mm_packus_epi16(bins, bins));
+			}
+
+			uint32_t sumLanes[4];
+			uint16_t darkLanes[8];
+			uint16_t clippedLanes[8];
+			_mm_storeu_si128((__m128i*)sumLanes, sum32);
+			_mm_storeu_si128((__m128i*)darkLanes, dark16);
+			_mm_storeu_si128((__m128i*)clippedLanes, clipped16);
+			for (int lane = 0; lane < 4; lane++)
+				sum += sumLanes[lane];
+			for (int lane = 0; lane < 8; lane++)
+			{
+				dark += darkLanes[lane];
+				clipped += clippedLanes[lane];
+			}
+#endif
+			for (; i < count; i++)
+			{
+				uint16_t value = pRow[i];
+				sum += value;
+				dark += (value == 0);
+				clipped += (value == maxValue);
+				uint32_t bin = (uint32_t)value >> shift;
+				pBins[i] = (uint8_t)(bin > 255 ? 255 : bin);
+			}
+		}
+	}
+}
+
+int FrameStatistics::Compute(const void *pBuffer, Pylon::EPixelType pixelType, uint32_t width, uint32_t height, size_t paddingX, uint32_t rowStep, Statistics &statistics, std::string &errorMessage)
+{
+	errorMessage = "ERROR: ";
+	errorMessage.append(__FUNCTION__);
+	errorMessage.append("(): ");
+
+	memset(&statistics, 0, sizeof(statistics));
+
+	if (Pylon::IsPacked(pixelType) || Pylon::IsYUV(pixelType))
+	{
+		errorMessage.append("Packed and YUV pixel formats are not supported.");
+		return 1;
+	}
+
+	uint32_t samplesPerPixel = Pylon::SamplesPerPixel(pixelType);
+	uint32_t bitsPerSample = Pylon::BitPerPixel(pixelType) / samplesPerPixel;
+	uint32_t bitDepth = Pylon::BitDepth(pixelType);
+	if ((bitsPerSample != 8 && bitsPerSample != 16) || bitDepth < 8 || bitDepth > bitsPerSample)
+	{
+		errorMessage.append("Pixel format is not supported.");
+		return 1;
+	}
+
+	if (rowStep == 0)
+		rowStep = 1;
+
+	size_t samplesPerRow = (size_t)width * samplesPerPixel;
+	size_t rowBytes = samplesPerRow * (bitsPerSample / 8) + paddingX;
+	const uint8_t *pImage = (const uint8_t*)pBuffer;
+
+	Detail::SplitHistogram histogram;
+	memset(&histogram, 0, sizeof(histogram));
+	uint64_t sum = 0;
+	uint64_t dark = 0;
+	uint64_t clipped = 0;
+	uint32_t maxValue = (1u << bitDepth) - 1;
+
+	// 8 bit: the histogram only (scalar). The sum, dark and clipped counts follow from it below.
+	if (bitsPerSample == 8)
+	{
+		for (uint32_t y = 0; y < height; y += rowStep)
+			Detail::CountBins(pImage + y * rowBytes, samplesPerRow, histogram);
+	}
+	else
+	{
+		std::vector<uint8_t> bins(samplesPerRow);
+		for (uint32_t y = 0; y < height; y += rowStep)
+		{
+			Detail::ScanRow16((const uint16_t*)(pImage + y * rowBytes), samplesPerRow, (int)bitDepth - 8, (uint16_t)maxValue, bins.data(), sum, dark, clipped);
+			Detail::CountBins(bins.data(), samplesPerRow, histogram);
+		}
+	}
+
+	for (int bin = 0; bin < c_numBins; bin++)
+	{
+		statistics.histogram[bin] = histogram.bins[0][bin] + histogram.bins[1][bin] + histogram.bins[2][bin] + histogram.bins[3][bin];
+		statistics.samples += statistics.histogram[bin];
+		if (bitsPerSample == 8)
+			sum += (uint64_t)bin * statistics.histogram[bin];
+	}
+
+	if (bitsPerSample == 8)
+	{
+		dark = statistics.histogram[0];
+		clipped = statistics.histogram[c_numBins - 1];
+	}
+
+	if (statistics.samples > 0)
+	{
+		statistics.mean = (double)sum / statistics.samples / maxValue;
+		statistics.darkFraction = (double)dark / statistics.samples;
+		statistics.clippedFraction = (double)clipped / statistics.samples;
+	}
+
+	return 0;
+}
+
+void FrameStatistics::CStatisticsBoard::Publish(size_t exposureIndex, const Statistics &statistics)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (exposureIndex >= m_entries.size())
+		m_entries.resize(exposureIndex + 1);
+	m_entries[exposureIndex].statistics = statistics;
+	m_entries[exposureIndex].frameCount++;
+}
+
+bool FrameStatistics::CStatisticsBoard::Read(size_t exposureIndex, Statistics &statistics, uint64_t *pFrameCount)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (exposureIndex >= m_entries.size() || m_entries[exposureIndex].frameCount == 0)
+		return false;
+	statistics = m_entries[exposureIndex].statistics;
+	if (pFrameCount != NULL)
+		*pFrameCount = m_entries[exposureIndex].frameCount;
+	return true;
+}
+
+// *********************************************************************************************************
+
+#endif
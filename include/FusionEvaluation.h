@@ -0,0 +1,166 @@
+// FusionEvaluation.h
+// Measures how fast and how well the fusion works, on synthetic brackets whose right answer is known.
+//
+// The scene spans three decades of brightness (more than any single 8 bit exposure holds) under a fine texture, and it is
+// taken at exposures two stops apart, like a real bracket. A square object can cross the scene during the bracket, so it
+// is somewhere else in every exposure. The same bracket with the object standing still where the reference exposure saw
+// it is what a perfectly deghosted fusion would give.
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Uses OpenCV libraries. License information can be found here:
+// https://opencv.org/license/
+
+#ifndef FUSIONEVALUATION_H
+#define FUSIONEVALUATION_H
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+
+namespace FusionEvaluation
+{
+	struct MovingObjectBracket
+	{
+		std::vector<cv::Mat> images;       // CV_8UC3, the object moves
+		std::vector<cv::Mat> staticImages; // the same, but the object stays where it is in the reference image
+		cv::Rect motionArea;               // everywhere the object is in any of the images
+	};
+
+	// A bracket of 'numImages' exposures of 'size'. The object ('objectSize' pixels square) moves 'motion' pixels to the
+	// right from one exposure to the next (0 = no object).
+	void CreateMovingObjectBracket(cv::Size size, size_t numImages, size_t referenceIndex, int objectSize, int motion, MovingObjectBracket &bracket);
+
+	// Peak signal to noise ratio (dB) of 'fusion' against 'reference' (both CV_32FC3, 1.0 = white, clipped to 0..1) within 'area'.
+	double Psnr(const cv::Mat &fusion, const cv::Mat &reference, const cv::Rect &area);
+
+	// Milliseconds 'function' takes: the median of 'runs' runs, after one run that isn't counted.
+	double TimeMs(const std::function<void()> &function, int runs);
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+namespace FusionEvaluation
+{
+	namespace Detail
+	{
+		// The scene's brightness at a pixel (relative: 1.0 is white in the middle exposure).
+		inline float SceneRadiance(int x, int y, cv::Size size)
+		{
+			float ramp = std::pow(10.0f, 3.0f * x / size.width - 1.5f);
+			float texture = ((x / 8 + y / 8) % 2 == 0) ? 1.0f : 0.6f;
+			float shading = 0.75f + 0.25f * std::sin(6.2831853f * y / size.height);
+			return 0.5f * ramp * texture * shading;
+		}
+
+		inline void RenderExposure(cv::Size size, float exposure, const cv::Rect &object, cv::Mat &image)
+		{
+			// The object: a saturated orange, about as bright as the middle of the scene.
+			const float objectColor[3] = { 0.1f, 0.35f, 0.6f };
+
+			image.create(size, CV_8UC3);
+			for (int y = 0; y < size.height; y++)
+			{
+				uint8_t *pBGR = image.ptr<uint8_t>(y);
+				for (int x = 0; x < size.width; x++, pBGR += 3)
+				{
+					bool inObject = object.contains(cv::Point(x, y));
+					float radiance = SceneRadiance(x, y, size);
+					for (int c = 0; c < 3; c++)
+					{
+						// A slightly bluish light on the scene, so saturation isn't 0 everywhere.
+						float value = inObject ? objectColor[c] : radiance * (0.9f + 0.05f * c);
+						pBGR[c] = cv::saturate_cast<uint8_t>(255.0f * value * exposure);
+					}
+				}
+			}
+		}
+	}
+}
+
+void FusionEvaluation::CreateMovingObjectBracket(cv::Size size, size_t numImages, size_t referenceIndex, int objectSize, int motion, MovingObjectBracket &bracket)
+{
+	bracket.images.resize(numImages);
+	bracket.staticImages.resize(numImages);
+	bracket.motionArea = cv::Rect();
+
+	// The object starts left of the middle and crosses it while the bracket is taken.
+	int startX = size.width / 2 - (int)(numImages * motion) / 2 - objectSize / 2;
+	int y = size.height / 2 - objectSize / 2;
+	cv::Rect referenceObject(startX + (int)referenceIndex * motion, y, objectSize, objectSize);
+
+	for (size_t i = 0; i < numImages; i++)
+	{
+		// Two stops between exposures, centred on the reference.
+		float exposure = std::pow(4.0f, (float)i - (float)referenceIndex);
+		cv::Rect object(startX + (int)i * motion, y, objectSize, objectSize);
+
+		Detail::RenderExposure(size, exposure, (objectSize > 0) ? object : cv::Rect(), bracket.images[i]);
+		Detail::RenderExposure(size, exposure, (objectSize > 0) ? referenceObject : cv::Rect(), bracket.staticImages[i]);
+		if (objectSize > 0)
+			bracket.motionArea = (i == 0) ? object : (bracket.motionArea | object);
+	}
+	bracket.motionArea &= cv::Rect(0, 0, size.width, size.height);
+}
+
+double FusionEvaluation::Psnr(const cv::Mat &fusion, const cv::Mat &reference, const cv::Rect &area)
+{
+	cv::Rect clipped = area & cv::Rect(0, 0, fusion.cols, fusion.rows);
+	if (clipped.empty())
+		return 0;
+
+	double sum = 0;
+	for (int y = clipped.y; y < clipped.y + clipped.height; y++)
+	{
+		const float *pFusion = fusion.ptr<float>(y) + 3 * clipped.x;
+		const float *pReference = reference.ptr<float>(y) + 3 * clipped.x;
+		for (int x = 0; x < 3 * clipped.width; x++)
+		{
+			double difference = std::min(std::max(pFusion[x], 0.0f), 1.0f) - std::min(std::max(pReference[x], 0.0f), 1.0f);
+			sum += difference * difference;
+		}
+	}
+
+	double meanSquare = sum / (3.0 * clipped.area());
+	if (meanSquare <= 0)
+		return 99.0;
+	return 10.0 * log10(1.0 / meanSquare);
+}
+
+double FusionEvaluation::TimeMs(const std::function<void()> &function, int runs)
+{
+	function();
+
+	std::vector<double> times;
+	for (int run = 0; run < runs; run++)
+	{
+		std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+		function();
+		times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count());
+	}
+	if (times.empty())
+		return 0;
+
+	std::sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+// *********************************************************************************************************
+
+#endif
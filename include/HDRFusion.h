@@ -0,0 +1,633 @@
+// HDRFusion.h
+// Generates an "HDR" image from a set of differently exposed images using OpenCV's Exposure Fusion.
+// Shared by the samples and tools so every one of them fuses the same way.
+// The fusion is either OpenCV's MergeMertens, or the same fusion step by step (ExposureFusion.h) for the stages
+// that need to get in between, like deghosting (Deghosting.h), or row by row (StreamingFusion.h).
+// The 8 bit formats can be written through a tone curve (ToneCurve.h).
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Uses OpenCV libraries. License information can be found here:
+// https://opencv.org/license/
+
+#ifndef HDRFUSION_H
+#define HDRFUSION_H
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/photo/photo.hpp>
+
+// Include Pylon libraries (if needed)
+#include <pylon/PylonIncludes.h>
+
+// The fusion step by step, and the stages that use it
+#include "ExposureFusion.h"
+#include "StreamingFusion.h"
+#include "Deghosting.h"
+#include "HalfFloat.h"
+#include "ToneCurve.h"
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+namespace HDRFusion
+{
+	// The pixel format the images are converted to before fusion, and the format of the fused image.
+	static const Pylon::EPixelType c_openCVPixelType = Pylon::EPixelType::PixelType_BGR8packed;
+
+	// Where an image of the bracket sits in the full frame, for exposures taken with their own ROI or binning.
+	// Offsets are in the image's own (binned) pixels, like the camera's OffsetX/OffsetY. Binning 0 or 1 = none.
+	struct FramePlacement
+	{
+		uint32_t offsetX;
+		uint32_t offsetY;
+		uint32_t binning;
+	};
+
+	// The layouts the fused image can be written in, so consumers get what they need without converting it again.
+	enum OutputFormat
+	{
+		OutputFormat_BGR8,       // CV_8UC3 (the default)
+		OutputFormat_Mono8,      // CV_8UC1, luma (BT.601)
+		OutputFormat_Mono16,     // CV_16UC1, luma over the full 16 bits
+		OutputFormat_RGB8Planar, // CV_8UC1 of 3 x rows: the R, G and B planes one after another
+		OutputFormat_NV12,       // CV_8UC1 of rows x 3/2: the Y plane, then Cb/Cr interleaved at half resolution (BT.601, video range).
+		                         // Odd widths and heights lose their last column or row.
+		OutputFormat_Float16     // CV_16UC3 holding BGR as half floats (1.0 = white, not clipped). OpenCV 3.0 has no half type.
+	};
+
+	// The pylon pixel type of an output format. PixelType_Undefined for NV12 and Float16, which pylon has no type for.
+	Pylon::EPixelType GetPylonPixelType(OutputFormat format);
+
+	// Which implementation fuses the images.
+	enum FusionEngine
+	{
+		FusionEngine_MergeMertens,  // OpenCV's MergeMertens (the default)
+		FusionEngine_ExposureFusion, // the same fusion step by step (see ExposureFusion.h). Deghosting always uses this one.
+		FusionEngine_Streaming       // the same fusion row by row, with a shallower pyramid (see StreamingFusion.h)
+	};
+
+	// PYRAMID DEPTH: As deep as the scene's lighting needs (see ExposureFusion::GetAutoPyramidDepth()).
+	static const int c_autoPyramidDepth = -1;
+
+	// How a bracket is fused. The defaults fuse the whole frame into BGR8 with MergeMertens.
+	struct FusionSettings
+	{
+		// PARTIAL ROI: Where each image goes in the full frame (one per image, or empty: every image is a full frame).
+		std::vector<FramePlacement> placements;
+		// OUTPUT FORMAT: Must have a pylon pixel type for CreateHDR() (NV12 and Float16 are only available from FuseImages()).
+		OutputFormat format = OutputFormat_BGR8;
+		// ROI FUSION: Only fuse these rectangles (empty: the whole frame). The rest of the frame is the reference image as it is.
+		std::vector<cv::Rect> regions;
+		int regionPadding = -1;  // see FuseRegions()
+		// The image of the bracket that fills the rest of the frame (ROI FUSION) and that the others are compared to (DEGHOSTING).
+		// -1: the middle one.
+		int referenceIndex = -1;
+		FusionEngine engine = FusionEngine_MergeMertens;
+		// (MergeMertens computes all three terms even where a weight is 0. ExposureFusion and Streaming skip those.)
+		ExposureFusion::Parameters weights;
+		// DEGHOSTING: Where an image shows something else than the reference (because it moved), only the reference is fused.
+		bool deghost = false;
+		Deghosting::Settings deghosting;
+		// FP16 PYRAMIDS: Keep the ExposureFusion pyramids as half floats, which halves their memory (and memory traffic).
+		// MergeMertens always uses floats, so Float16 fuses with ExposureFusion.
+		ExposureFusion::PyramidStorage pyramidStorage = ExposureFusion::PyramidStorage_Float32;
+		// STREAMING: The pyramid levels of FusionEngine_Streaming. Each level doubles the rows it lags behind the input.
+		int streamingDepth = 4;
+		// PYRAMID OUTPUT: How many reduced scales of the result (1/2, 1/4, 1/8, ...) to hand out as well, where asked for.
+		// ExposureFusion takes them from its collapse for the cost of a copy. The other engines (and ROI FUSION) pyrDown the result.
+		int pyramidOutputLevels = 0;
+		// PYRAMID DEPTH: At most this many levels below full resolution, the coarsest one blended as it is. 0: as many as
+		// the image has (like MergeMertens), c_autoPyramidDepth: as many as the scene needs. Fuses with ExposureFusion unless 0.
+		int pyramidDepth = 0;
+		// TONE CURVE: Gamma, contrast and a curve of the user's own for the 8 bit formats, in the pass that writes them
+		// (see ToneCurve::Create(), built once). Empty: the fusion is written as it is. Mono16 and Float16 always are.
+		std::shared_ptr<const ToneCurve::CToneLut> toneCurve;
+	};
+
+	// The index of the reference image in a bracket of 'numImages'.
+	size_t GetReferenceIndex(const FusionSettings &settings, size_t numImages);
+
+	// Write the exposure fusion result (CV_32FC3 BGR, 1.0 = white) in 'format', in one pass over the image.
+	// TONE CURVE: The 8 bit formats through 'pToneCurve' (if any).
+	void WriteOutput(const cv::Mat &fusion, OutputFormat format, cv::Mat &output, const ToneCurve::CToneLut *pToneCurve = NULL);
+
+	// Fuse a set of CV_8UC3 images into the exposure fusion result (CV_32FC3 BGR, 1.0 = white).
+	// Uses the engine, weights and deghosting of 'settings'.
+	// PYRAMID OUTPUT: 'pLevels' gets the pyramidOutputLevels scales of the result (as many as the pyramid has), each
+	// CV_32FC3 and half the size of the one before.
+	void FuseToFloat(std::vector<cv::Mat> &cv_images, cv::Mat &fusion, const FusionSettings &settings = FusionSettings(), std::vector<cv::Mat> *pLevels = NULL);
+
+	// Fuse a set of CV_8UC3 images into one image in 'format' (CV_8UC3 by default).
+	void FuseImages(std::vector<cv::Mat> &cv_images, cv::Mat &hdrMat, OutputFormat format = OutputFormat_BGR8);
+	// The same with all of 'settings' (but the regions: see FuseRegionsInFrame()). PYRAMID OUTPUT: 'pLevels' gets the
+	// scales of the result in the output format too.
+	void FuseImages(std::vector<cv::Mat> &cv_images, cv::Mat &hdrMat, const FusionSettings &settings, std::vector<cv::Mat> *pLevels = NULL);
+
+	// ROI FUSION: The levels of the fusion pyramid a region's padding covers. Past these, what is outside the region
+	// only has a faint effect on it (the coarsest levels only set the overall brightness).
+	static const int c_regionPyramidLevels = 5;
+
+	// How far (in pixels) the pyramid carries a pixel's influence in 'levels' levels: each level's 5 tap filter reaches
+	// 2 pixels of that level, which is 2^level pixels of the image.
+	int GetPyramidSupport(int levels);
+
+	// ROI FUSION: Fuse only the regions of 'settings' (clipped to the frame), each with 'regionPadding' pixels around it that
+	// are fused and then thrown away, so the region's borders look as if the whole frame was fused. regionPadding < 0: the
+	// pyramid support of c_regionPyramidLevels. 'fusedRegions' gets one CV_32FC3 fusion result per region, 'clippedRegions' where it goes.
+	void FuseRegions(std::vector<cv::Mat> &cv_images, const FusionSettings &settings, std::vector<cv::Rect> &clippedRegions, std::vector<cv::Mat> &fusedRegions);
+
+	// ROI FUSION: Each fused region on its own, in the format of 'settings'.
+	void FuseRegionCrops(std::vector<cv::Mat> &cv_images, const FusionSettings &settings, std::vector<cv::Mat> &crops);
+
+	// ROI FUSION: A full frame in the format of 'settings': the fused regions, and everywhere else the reference image as it is.
+	// PYRAMID OUTPUT: 'pLevels' gets the scales of the frame, in the same format.
+	void FuseRegionsInFrame(std::vector<cv::Mat> &cv_images, const FusionSettings &settings, cv::Mat &hdrMat, std::vector<cv::Mat> *pLevels = NULL);
+
+	// Bring every image to the full frame (the largest extent of all images): binned images are scaled up,
+	// partial images are placed at their offset. Pixels outside a partial image are black, which fusion gives no weight.
+	// Does nothing if 'placements' is empty.
+	void PlaceImages(std::vector<cv::Mat> &cv_images, const std::vector<FramePlacement> &placements);
+
+	// The function which will generate the "HDR" image from a set of pylon images.
+	// PYRAMID OUTPUT: 'pLevelImages' gets the pyramidOutputLevels scales of it (1/2, 1/4, ...), in the same pixel type.
+	void CreateHDR(std::vector<Pylon::CPylonImage> &images, Pylon::CPylonImage &OutputImage, const FusionSettings &settings = FusionSettings(),
+		std::vector<Pylon::CPylonImage> *pLevelImages = NULL);
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+namespace HDRFusion
+{
+	namespace Detail
+	{
+		inline float Luma(const float *pBGR)
+		{
+			return 0.114f * pBGR[0] + 0.587f * pBGR[1] + 0.299f * pBGR[2];
+		}
+
+		// Writes a range of rows (NV12: of row pairs) of the output. TONE CURVE: the 8 bit formats through 'pToneCurve'
+		// (if any): the colour formats channel by channel, Mono8 its luma.
+		class OutputBody : public cv::ParallelLoopBody
+		{
+		private:
+			const cv::Mat &m_fusion;
+			OutputFormat m_format;
+			cv::Mat &m_output;
+			const ToneCurve::CToneLut *m_pToneCurve;
+
+		public:
+			OutputBody(const cv::Mat &fusion, OutputFormat format, cv::Mat &output, const ToneCurve::CToneLut *pToneCurve)
+				: m_fusion(fusion), m_format(format), m_output(output), m_pToneCurve(pToneCurve)
+			{
+			}
+
+			virtual void operator()(const cv::Range &range) const
+			{
+				int width = m_fusion.cols;
+				int height = m_fusion.rows;
+				// TONE CURVE: rows of values after the curve (NV12: two of them, back on the fusion's scale).
+				std::vector<uint8_t> toned;
+				std::vector<float> tonedRows;
+				if (m_pToneCurve != NULL)
+				{
+					toned.resize(3 * (size_t)width);
+					if (m_format == OutputFormat_NV12)
+						tonedRows.resize(6 * (size_t)width);
+				}
+
+				for (int y = range.start; y < range.end; y++)
+				{
+					const float *pIn = m_fusion.ptr<float>(y);
+					switch (m_format)
+					{
+					case OutputFormat_BGR8:
+					{
+						// Only here with a tone curve.
+						m_pToneCurve->LookupRow(pIn, m_output.ptr<uint8_t>(y), 3 * (size_t)width);
+						break;
+					}
+					case OutputFormat_Mono8:
+					{
+						uint8_t *pOut = m_output.ptr<uint8_t>(y);
+						if (m_pToneCurve != NULL)
+						{
+							for (int x = 0; x < width; x++)
+								pOut[x] = m_pToneCurve->Lookup(Luma(pIn + 3 * x));
+							break;
+						}
+						for (int x = 0; x < width; x++)
+							pOut[x] = cv::saturate_cast<uint8_t>(Luma(pIn + 3 * x) * 255.0f);
+						break;
+					}
+					case OutputFormat_Mono16:
+					{
+						uint16_t *pOut = m_output.ptr<uint16_t>(y);
+						for (int x = 0; x < width; x++)
+							pOut[x] = cv::saturate_cast<uint16_t>(Luma(pIn + 3 * x) * 65535.0f);
+						break;
+					}
+					case OutputFormat_RGB8Planar:
+					{
+						uint8_t *pR = m_output.ptr<uint8_t>(y);
+						uint8_t *pG = m_output.ptr<uint8_t>(height + y);
+						uint8_t *pB = m_output.ptr<uint8_t>(2 * height + y);
+						if (m_pToneCurve != NULL)
+						{
+							m_pToneCurve->LookupRow(pIn, &toned[0], 3 * (size_t)width);
+							for (int x = 0; x < width; x++)
+							{
+								pB[x] = toned[3 * x];
+								pG[x] = toned[3 * x + 1];
+								pR[x] = toned[3 * x + 2];
+							}
+							break;
+						}
+						for (int x = 0; x < width; x++)
+						{
+							pB[x] = cv::saturate_cast<uint8_t>(pIn[3 * x] * 255.0f);
+							pG[x] = cv::saturate_cast<uint8_t>(pIn[3 * x + 1] * 255.0f);
+							pR[x] = cv::saturate_cast<uint8_t>(pIn[3 * x + 2] * 255.0f);
+						}
+						break;
+					}
+					case OutputFormat_NV12:
+					{
+						// y is a pair of rows: two rows of Y, one row of Cb/Cr.
+						int evenHeight = height & ~1;
+						const float *pRows[2] = { m_fusion.ptr<float>(2 * y), m_fusion.ptr<float>(2 * y + 1) };
+						if (m_pToneCurve != NULL)
+						{
+							for (int row = 0; row < 2; row++)
+							{
+								float *pToned = &tonedRows[row * 3 * (size_t)width];
+								m_pToneCurve->LookupRow(pRows[row], &toned[0], 3 * (size_t)width);
+								for (int x = 0; x < 3 * width; x++)
+									pToned[x] = toned[x] * (1.0f / 255.0f);
+								pRows[row] = pToned;
+							}
+						}
+						uint8_t *pY[2] = { m_output.ptr<uint8_t>(2 * y), m_output.ptr<uint8_t>(2 * y + 1) };
+						uint8_t *pCbCr = m_output.ptr<uint8_t>(evenHeight + y);
+						for (int x = 0; x < m_output.cols; x += 2)
+						{
+							float b = 0, g = 0, r = 0;
+							for (int row = 0; row < 2; row++)
+							{
+								for (int column = x; column < x + 2; column++)
+								{
+									const float *pBGR = pRows[row] + 3 * column;
+									pY[row][column] = cv::saturate_cast<uint8_t>(16.0f + 219.0f * Luma(pBGR));
+									b += pBGR[0];
+									g += pBGR[1];
+									r += pBGR[2];
+								}
+							}
+							float luma = 0.114f * b / 4 + 0.587f * g / 4 + 0.299f * r / 4;
+							pCbCr[x] = cv::saturate_cast<uint8_t>(128.0f + 224.0f * (b / 4 - luma) / 1.772f);
+							pCbCr[x + 1] = cv::saturate_cast<uint8_t>(128.0f + 224.0f * (r / 4 - luma) / 1.402f);
+						}
+						break;
+					}
+					case OutputFormat_Float16:
+					{
+						HalfFloat::FromFloatRow(pIn, m_output.ptr<uint16_t>(y), 3 * (size_t)width);
+						break;
+					}
+					default:
+						break;
+					}
+				}
+			}
+		};
+
+		// PYRAMID OUTPUT: Where the engine has no levels of its own (or fewer than asked for), each further level is the
+		// one below it, pyrDown'ed. The levels 'levels' already holds are kept.
+		inline void ReduceLevels(const cv::Mat &fusion, int numLevels, std::vector<cv::Mat> &levels)
+		{
+			size_t existing = levels.size();
+			levels.resize(std::max(std::min(numLevels, ExposureFusion::GetPyramidDepth(fusion.size())), (int)existing));
+			for (size_t level = existing; level < levels.size(); level++)
+				cv::pyrDown((level == 0) ? fusion : levels[level - 1], levels[level]);
+		}
+
+		// An output in 'format' as a pylon image (planar: the planes are stacked, so the image is a third as tall).
+		inline void ToPylonImage(const cv::Mat &output, OutputFormat format, Pylon::CPylonImage &image)
+		{
+			int height = (format == OutputFormat_RGB8Planar) ? output.rows / 3 : output.rows;
+			Pylon::CPylonImage attached;
+			attached.AttachUserBuffer(output.data, (output.total() * output.elemSize()), GetPylonPixelType(format), output.cols, height, 0);
+			image.CopyImage(attached);
+		}
+	}
+}
+
+Pylon::EPixelType HDRFusion::GetPylonPixelType(OutputFormat format)
+{
+	switch (format)
+	{
+	case OutputFormat_BGR8:
+		return Pylon::EPixelType::PixelType_BGR8packed;
+	case OutputFormat_Mono8:
+		return Pylon::EPixelType::PixelType_Mono8;
+	case OutputFormat_Mono16:
+		return Pylon::EPixelType::PixelType_Mono16;
+	case OutputFormat_RGB8Planar:
+		return Pylon::EPixelType::PixelType_RGB8planar;
+	default:
+		return Pylon::EPixelType::PixelType_Undefined;
+	}
+}
+
+void HDRFusion::WriteOutput(const cv::Mat &fusion, OutputFormat format, cv::Mat &output, const ToneCurve::CToneLut *pToneCurve)
+{
+	int rows = fusion.rows;
+	switch (format)
+	{
+	case OutputFormat_BGR8:
+		// The one format OpenCV writes as fast as we could. (TONE CURVE: as fast as a lookup, through our own.)
+		if (pToneCurve == NULL)
+		{
+			fusion.convertTo(output, CV_8UC3, 255);
+			return;
+		}
+		output.create(fusion.rows, fusion.cols, CV_8UC3);
+		break;
+	case OutputFormat_Mono8:
+		output.create(fusion.rows, fusion.cols, CV_8UC1);
+		break;
+	case OutputFormat_Mono16:
+		output.create(fusion.rows, fusion.cols, CV_16UC1);
+		break;
+	case OutputFormat_RGB8Planar:
+		output.create(3 * fusion.rows, fusion.cols, CV_8UC1);
+		break;
+	case OutputFormat_NV12:
+		output.create((fusion.rows & ~1) * 3 / 2, fusion.cols & ~1, CV_8UC1);
+		rows = fusion.rows / 2;
+		break;
+	case OutputFormat_Float16:
+		output.create(fusion.rows, fusion.cols, CV_16UC3);
+		break;
+	}
+
+	cv::parallel_for_(cv::Range(0, rows), Detail::OutputBody(fusion, format, output, pToneCurve));
+}
+
+size_t HDRFusion::GetReferenceIndex(const FusionSettings &settings, size_t numImages)
+{
+	if (numImages == 0)
+		return 0;
+	if (settings.referenceIndex >= 0)
+		return std::min((size_t)settings.referenceIndex, numImages - 1);
+	return numImages / 2;
+}
+
+void HDRFusion::FuseToFloat(std::vector<cv::Mat> &cv_images, cv::Mat &fusion, const FusionSettings &settings, std::vector<cv::Mat> *pLevels)
+{
+	cv::Ptr<cv::AlignMTB> alignMTB = cv::createAlignMTB();
+
+	// Step 2: align the images (in case the camera moved. But this decreases speed and modifies the final image size)
+	// OPTIMIZATION: If speed is preferred over image quality, comment this out.
+	// (DEGHOSTING handles things that move within the image, which aligning can't.)
+	// alignMTB->process(cv_images, cv_images);
+
+	// Step 3: Create the HDR image
+	if (pLevels != NULL)
+		pLevels->clear();
+	if (settings.engine == FusionEngine_MergeMertens && settings.deghost == false && settings.pyramidStorage == ExposureFusion::PyramidStorage_Float32
+		&& settings.pyramidDepth == 0)
+	{
+		// merge_mertens will perform the exposure fusion to get the HDR image
+		cv::Ptr<cv::MergeMertens> mergeMertens = cv::createMergeMertens(settings.weights.contrastWeight, settings.weights.saturationWeight, settings.weights.exposureWeight);
+		mergeMertens->process(cv_images, fusion);
+		if (pLevels != NULL)
+			Detail::ReduceLevels(fusion, settings.pyramidOutputLevels, *pLevels);
+		return;
+	}
+	if (settings.engine == FusionEngine_Streaming && settings.deghost == false)
+	{
+		StreamingFusion::Settings streaming;
+		streaming.depth = settings.streamingDepth;
+		streaming.weights = settings.weights;
+		StreamingFusion::Fuse(cv_images, streaming, fusion);
+		if (pLevels != NULL)
+			Detail::ReduceLevels(fusion, settings.pyramidOutputLevels, *pLevels);
+		return;
+	}
+
+	std::vector<cv::Mat> weights;
+	ExposureFusion::ComputeWeights(cv_images, settings.weights, weights);
+	if (settings.deghost)
+	{
+		std::vector<cv::Mat> masks;
+		Deghosting::ComputeMotionMasks(cv_images, GetReferenceIndex(settings, cv_images.size()), settings.deghosting, masks);
+		Deghosting::SuppressMotion(weights, masks);
+	}
+	ExposureFusion::NormalizeWeights(weights);
+	int maxDepth = (settings.pyramidDepth == c_autoPyramidDepth) ? ExposureFusion::GetAutoPyramidDepth(weights) : std::max(settings.pyramidDepth, 0);
+	if (pLevels == NULL)
+	{
+		ExposureFusion::Blend(cv_images, weights, fusion, settings.pyramidStorage, maxDepth);
+		return;
+	}
+	ExposureFusion::Blend(cv_images, weights, fusion, *pLevels, settings.pyramidOutputLevels, settings.pyramidStorage, maxDepth);
+	// (A shallower pyramid has fewer levels to hand out.)
+	Detail::ReduceLevels(fusion, settings.pyramidOutputLevels, *pLevels);
+}
+
+void HDRFusion::FuseImages(std::vector<cv::Mat> &cv_images, cv::Mat &hdrMat, OutputFormat format)
+{
+	FusionSettings settings;
+	settings.format = format;
+	FuseImages(cv_images, hdrMat, settings);
+}
+
+void HDRFusion::FuseImages(std::vector<cv::Mat> &cv_images, cv::Mat &hdrMat, const FusionSettings &settings, std::vector<cv::Mat> *pLevels)
+{
+	// Steps 2 and 3: align (optional) and fuse
+	cv::Mat fusion;
+	std::vector<cv::Mat> levels;
+	FuseToFloat(cv_images, fusion, settings, (pLevels != NULL) ? &levels : NULL);
+
+	// Step 4: Write the result straight into the output format
+	WriteOutput(fusion, settings.format, hdrMat, settings.toneCurve.get());
+	if (pLevels == NULL)
+		return;
+	pLevels->resize(levels.size());
+	for (size_t level = 0; level < levels.size(); level++)
+		WriteOutput(levels[level], settings.format, (*pLevels)[level], settings.toneCurve.get());
+}
+
+int HDRFusion::GetPyramidSupport(int levels)
+{
+	return 2 * ((1 << levels) - 1);
+}
+
+void HDRFusion::FuseRegions(std::vector<cv::Mat> &cv_images, const FusionSettings &settings, std::vector<cv::Rect> &clippedRegions, std::vector<cv::Mat> &fusedRegions)
+{
+	clippedRegions.clear();
+	fusedRegions.clear();
+	if (cv_images.empty())
+		return;
+
+	const std::vector<cv::Rect> &regions = settings.regions;
+	int padding = settings.regionPadding;
+	if (padding < 0)
+		padding = GetPyramidSupport(c_regionPyramidLevels);
+
+	cv::Rect frame(0, 0, cv_images[0].cols, cv_images[0].rows);
+	for (size_t r = 0; r < regions.size(); r++)
+	{
+		cv::Rect region = regions[r] & frame;
+		if (region.empty())
+			continue;
+
+		// Fuse the region plus its padding (as far as the frame goes), then keep only the region.
+		cv::Rect padded(region.x - padding, region.y - padding, region.width + 2 * padding, region.height + 2 * padding);
+		padded &= frame;
+
+		std::vector<cv::Mat> regionImages;
+		for (size_t i = 0; i < cv_images.size(); i++)
+			regionImages.push_back(cv_images[i](padded));
+
+		cv::Mat fusion;
+		FuseToFloat(regionImages, fusion, settings);
+
+		clippedRegions.push_back(region);
+		fusedRegions.push_back(fusion(cv::Rect(region.x - padded.x, region.y - padded.y, region.width, region.height)));
+	}
+}
+
+void HDRFusion::FuseRegionCrops(std::vector<cv::Mat> &cv_images, const FusionSettings &settings, std::vector<cv::Mat> &crops)
+{
+	std::vector<cv::Rect> clippedRegions;
+	std::vector<cv::Mat> fusedRegions;
+	FuseRegions(cv_images, settings, clippedRegions, fusedRegions);
+
+	crops.resize(fusedRegions.size());
+	for (size_t r = 0; r < fusedRegions.size(); r++)
+		WriteOutput(fusedRegions[r], settings.format, crops[r], settings.toneCurve.get());
+}
+
+void HDRFusion::FuseRegionsInFrame(std::vector<cv::Mat> &cv_images, const FusionSettings &settings, cv::Mat &hdrMat, std::vector<cv::Mat> *pLevels)
+{
+	if (cv_images.empty())
+		return;
+
+	std::vector<cv::Rect> clippedRegions;
+	std::vector<cv::Mat> fusedRegions;
+	FuseRegions(cv_images, settings, clippedRegions, fusedRegions);
+
+	// The reference image on the fusion's scale, with the fused regions on top. Then one pass into the output format.
+	cv::Mat frame;
+	cv_images[GetReferenceIndex(settings, cv_images.size())].convertTo(frame, CV_32FC3, 1.0 / 255);
+	for (size_t r = 0; r < fusedRegions.size(); r++)
+	{
+		cv::Mat target = frame(clippedRegions[r]);
+		fusedRegions[r].copyTo(target);
+	}
+
+	WriteOutput(frame, settings.format, hdrMat, settings.toneCurve.get());
+	if (pLevels == NULL)
+		return;
+	std::vector<cv::Mat> levels;
+	Detail::ReduceLevels(frame, settings.pyramidOutputLevels, levels);
+	pLevels->resize(levels.size());
+	for (size_t level = 0; level < levels.size(); level++)
+		WriteOutput(levels[level], settings.format, (*pLevels)[level], settings.toneCurve.get());
+}
+
+void HDRFusion::PlaceImages(std::vector<cv::Mat> &cv_images, const std::vector<FramePlacement> &placements)
+{
+	if (placements.empty())
+		return;
+
+	// The full frame covers every image.
+	cv::Size fullSize(0, 0);
+	for (size_t i = 0; i < cv_images.size() && i < placements.size(); i++)
+	{
+		int binning = (placements[i].binning > 1) ? (int)placements[i].binning : 1;
+		fullSize.width = std::max(fullSize.width, ((int)placements[i].offsetX + cv_images[i].cols) * binning);
+		fullSize.height = std::max(fullSize.height, ((int)placements[i].offsetY + cv_images[i].rows) * binning);
+	}
+
+	for (size_t i = 0; i < cv_images.size() && i < placements.size(); i++)
+	{
+		int binning = (placements[i].binning > 1) ? (int)placements[i].binning : 1;
+		if (cv_images[i].size() == fullSize)
+			continue;
+
+		cv::Mat scaled = cv_images[i];
+		if (binning > 1)
+			cv::resize(cv_images[i], scaled, cv::Size(cv_images[i].cols * binning, cv_images[i].rows * binning), 0, 0, cv::INTER_LINEAR);
+
+		cv::Mat placed(fullSize, cv_images[i].type(), cv::Scalar::all(0));
+		cv::Mat target = placed(cv::Rect(placements[i].offsetX * binning, placements[i].offsetY * binning, scaled.cols, scaled.rows));
+		scaled.copyTo(target);
+		cv_images[i] = placed;
+	}
+}
+
+void HDRFusion::CreateHDR(std::vector<Pylon::CPylonImage> &images, Pylon::CPylonImage &OutputImage, const FusionSettings &settings,
+	std::vector<Pylon::CPylonImage> *pLevelImages)
+{
+	OutputFormat format = settings.format;
+	Pylon::EPixelType outputPixelType = GetPylonPixelType(format);
+	if (outputPixelType == Pylon::EPixelType::PixelType_Undefined)
+		throw RUNTIME_EXCEPTION("CreateHDR: this output format has no pylon pixel type. Use FuseImages() instead.");
+
+	// we will use pylon's image format converter to convert the image to openCV format.
+	Pylon::CImageFormatConverter myConverter;
+	myConverter.OutputPixelFormat.SetValue(c_openCVPixelType);
+
+	// Step 1: Convert all stored pylon images to opencv format
+	std::vector<cv::Mat> cv_images;
+	for (int i = 0; i < images.size(); i++)
+	{
+		Pylon::CPylonImage convertedImage;
+		myConverter.Convert(convertedImage, images[i]);
+		cv::Mat cv_image(convertedImage.GetHeight(), convertedImage.GetWidth(), CV_8UC3, (uint8_t*)convertedImage.GetBuffer());
+		cv_images.push_back(cv_image.clone());
+	}
+
+	// Partial-ROI and binned exposures go to their place in the full frame
+	PlaceImages(cv_images, settings.placements);
+
+	// Steps 2 to 4: align (optional), fuse and write the output format (ROI FUSION: only the regions)
+	// (PYRAMID OUTPUT: and its scales)
+	cv::Mat hdrMat;
+	std::vector<cv::Mat> levels;
+	std::vector<cv::Mat> *pLevels = (pLevelImages != NULL) ? &levels : NULL;
+	if (settings.regions.empty())
+		FuseImages(cv_images, hdrMat, settings, pLevels);
+	else
+		FuseRegionsInFrame(cv_images, settings, hdrMat, pLevels);
+
+	// Step 5: recovert the HDR image to a pylon image and display it
+	Detail::ToPylonImage(hdrMat, format, OutputImage);
+	if (pLevelImages != NULL)
+	{
+		pLevelImages->resize(levels.size());
+		for (size_t level = 0; level < levels.size(); level++)
+			Detail::ToPylonImage(levels[level], format, (*pLevelImages)[level]);
+	}
+
+	// Step 6: Clean up for the next HDR image
+	cv_images.clear();
+}
+
+// *********************************************************************************************************
+
+#endif
@@ -0,0 +1,663 @@
+// HDRPipelineAsync.h
+// An asynchronous API for embedding the HDR pipeline in another application, based on C++20 coroutines.
+//
+//   HDRAsync::CFusionService service(0, settings);     // backed by a work-stealing thread pool, fuses with 'settings'
+//   FusionResult r = co_await service.Fuse(images);      // fuse a bracket, resume when it is done
+//   FusionResult f = co_await service.NextFrame();       // wait for the next frame fused from SubmitBracket()
+//
+// No thread waits for an outstanding request: a suspended coroutine is only a small heap frame,
+// and it is resumed on a pool thread when its result is ready. Every request can be cancelled with a
+// token from a CCancellationSource.
+//
+// The requests already run in parallel on the pool, so OpenCV's own threads only compete with it. The service leaves
+// that setting to the host application (it is process wide): call cv::setNumThreads(1) if nothing else needs them.
+//
+// Requires a C++20 compiler. With older compilers this header is empty.
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HDRPIPELINEASYNC_H
+#define HDRPIPELINEASYNC_H
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define HDRPIPELINEASYNC_AVAILABLE
+#endif
+#endif
+
+#ifdef HDRPIPELINEASYNC_AVAILABLE
+
+#include "HDRFusion.h"
+#include "WorkStealingPool.h"
+
+#include <coroutine>
+#include <optional>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <string>
+
+namespace HDRAsync
+{
+	// What a fusion request or a frame wait resumes with.
+	struct FusionResult
+	{
+		cv::Mat hdrMat;
+		bool cancelled = false;
+		std::string error; // empty on success
+	};
+
+	struct CancellationState
+	{
+		std::atomic<bool> cancelled{ false };
+		std::mutex lock;
+		std::vector<std::pair<uint64_t, std::function<void()>>> callbacks;
+		uint64_t nextId = 1;
+	};
+
+	// Passed to a request. Copies share the same state.
+	class CCancellationToken
+	{
+	private:
+		std::shared_ptr<CancellationState> m_state;
+
+	public:
+		CCancellationToken();
+		CCancellationToken(std::shared_ptr<CancellationState> state);
+
+		bool IsCancelled() const;
+		// Call 'callback' on cancellation (right away if already cancelled). Returns an id for Unregister(), 0 if none.
+		uint64_t Register(std::function<void()> callback);
+		void Unregister(uint64_t id);
+	};
+
+	class CCancellationSource
+	{
+	private:
+		std::shared_ptr<CancellationState> m_state;
+
+	public:
+		CCancellationSource();
+		void Cancel();
+		CCancellationToken GetToken();
+	};
+
+	// The return type of a coroutine. It starts when it is awaited, or when Start() is called.
+	// Non-coroutine code can block on Get() (one waiting thread for any number of tasks, not one per task).
+	// The task must not be destroyed while it is still running.
+	template <typename T>
+	class Task
+	{
+	public:
+		struct promise_type
+		{
+			std::optional<T> value;
+			std::exception_ptr error;
+			std::coroutine_handle<> continuation;
+			std::mutex lock;
+			std::condition_variable finished;
+			bool done = false;
+
+			Task get_return_object()
+			{
+				return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+			}
+
+			std::suspend_always initial_suspend() noexcept
+			{
+				return {};
+			}
+
+			struct FinalAwaiter
+			{
+				bool await_ready() noexcept
+				{
+					return false;
+				}
+
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+				{
+					promise_type &promise = handle.promise();
+					if (promise.continuation)
+						return promise.continuation;
+
+					std::lock_guard<std::mutex> lock(promise.lock);
+					promise.done = true;
+					promise.finished.notify_all();
+					return std::noop_coroutine();
+				}
+
+				void await_resume() noexcept
+				{
+				}
+			};
+
+			FinalAwaiter final_suspend() noexcept
+			{
+				return {};
+			}
+
+			void return_value(T result)
+			{
+				value = std::move(result);
+			}
+
+			void unhandled_exception()
+			{
+				error = std::current_exception();
+			}
+		};
+
+	private:
+		std::coroutine_handle<promise_type> m_handle;
+
+	public:
+		explicit Task(std::coroutine_handle<promise_type> handle) : m_handle(handle)
+		{
+		}
+
+		Task(Task &&other) noexcept : m_handle(other.m_handle)
+		{
+			other.m_handle = nullptr;
+		}
+
+		Task(const Task&) = delete;
+		Task &operator=(const Task&) = delete;
+
+		~Task()
+		{
+			if (m_handle)
+				m_handle.destroy();
+		}
+
+		// Run the coroutine up to its first suspension, without waiting for it.
+		void Start()
+		{
+			m_handle.resume();
+		}
+
+		// Block until the coroutine (started with Start()) has finished, and return its result.
+		T Get()
+		{
+			promise_type &promise = m_handle.promise();
+			{
+				std::unique_lock<std::mutex> lock(promise.lock);
+				promise.finished.wait(lock, [&promise] { return promise.done; });
+			}
+			if (promise.error)
+				std::rethrow_exception(promise.error);
+			return std::move(*promise.value);
+		}
+
+		// co_await task: start it and resume the awaiting coroutine when it finishes.
+		bool await_ready() noexcept
+		{
+			return false;
+		}
+
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+		{
+			m_handle.promise().continuation = continuation;
+			return m_handle;
+		}
+
+		T await_resume()
+		{
+			promise_type &promise = m_handle.promise();
+			if (promise.error)
+				std::rethrow_exception(promise.error);
+			return std::move(*promise.value);
+		}
+	};
+
+	class CFusionService;
+
+	// co_await service.Fuse(images)
+	class FuseAwaitable
+	{
+	private:
+		// Shared by the queued request and the cancellation callback: whichever claims it first resumes the coroutine.
+		struct State
+		{
+			std::atomic<bool> claimed{ false };
+			std::atomic<uint64_t> callbackId{ 0 };
+		};
+
+		CFusionService &m_service;
+		std::vector<cv::Mat> m_images;
+		CCancellationToken m_token;
+		FusionResult m_result;
+		std::shared_ptr<State> m_state;
+
+	public:
+		FuseAwaitable(CFusionService &service, std::vector<cv::Mat> images, CCancellationToken token);
+		bool await_ready();
+		void await_suspend(std::coroutine_handle<> handle);
+		FusionResult await_resume();
+	};
+
+	// Delivers each published frame to every coroutine waiting for one.
+	// The channel must outlive the cancellation tokens passed to Next().
+	class CFrameChannel
+	{
+	private:
+		struct Waiter
+		{
+			uint64_t id;
+			std::coroutine_handle<> handle;
+			FusionResult *pResult;
+		};
+
+		WorkStealingPool::CWorkStealingPool &m_pool;
+		std::mutex m_lock;
+		std::deque<Waiter> m_waiters;
+		uint64_t m_nextId = 1;
+		bool m_closed = false;
+
+	public:
+		class NextAwaitable
+		{
+		private:
+			CFrameChannel &m_channel;
+			CCancellationToken m_token;
+			FusionResult m_result;
+			uint64_t m_waiterId = 0;
+			uint64_t m_callbackId = 0;
+
+		public:
+			NextAwaitable(CFrameChannel &channel, CCancellationToken token);
+			bool await_ready();
+			void await_suspend(std::coroutine_handle<> handle);
+			FusionResult await_resume();
+		};
+
+		CFrameChannel(WorkStealingPool::CWorkStealingPool &pool);
+
+		NextAwaitable Next(CCancellationToken token = CCancellationToken());
+		// Resume every waiting coroutine with 'frame' (a shared, read-only header). Waiters resume on the pool.
+		void Publish(const cv::Mat &frame);
+		// Resume every waiting coroutine as cancelled, and cancel every later Next() right away.
+		void Close();
+
+		// Take a waiter out of the channel (if still there) and resume it as cancelled.
+		void CancelWaiter(uint64_t id);
+	};
+
+	class CFusionService
+	{
+	private:
+		WorkStealingPool::CWorkStealingPool m_pool;
+		CFrameChannel m_frames;
+		HDRFusion::FusionSettings m_settings;
+
+		friend class FuseAwaitable;
+
+	public:
+		// numThreads = 0 uses one thread per core. Every bracket is fused with 'settings' (see HDRFusion::FusionSettings).
+		CFusionService(size_t numThreads = 0, const HDRFusion::FusionSettings &settings = HDRFusion::FusionSettings());
+		~CFusionService();
+
+		// Fuse a bracket. The images must stay valid until the request has finished.
+		FuseAwaitable Fuse(std::vector<cv::Mat> images, CCancellationToken token = CCancellationToken());
+
+		// Fuse a bracket from a live source and publish the result to NextFrame() waiters. Doesn't wait.
+		void SubmitBracket(std::vector<cv::Mat> images);
+		FusionResult FuseNow(std::vector<cv::Mat> &images);
+
+		CFrameChannel::NextAwaitable NextFrame(CCancellationToken token = CCancellationToken());
+		void PublishFrame(const cv::Mat &frame);
+
+		// Wait for every queued fusion to finish, and resume all NextFrame() waiters as cancelled.
+		void Shutdown();
+
+		size_t GetNumThreads();
+	};
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+HDRAsync::CCancellationToken::CCancellationToken()
+{
+	// nothing: a default token is never cancelled
+}
+
+HDRAsync::CCancellationToken::CCancellationToken(std::shared_ptr<CancellationState> state) : m_state(state)
+{
+}
+
+bool HDRAsync::CCancellationToken::IsCancelled() const
+{
+	return m_state && m_state->cancelled;
+}
+
+uint64_t HDRAsync::CCancellationToken::Register(std::function<void()> callback)
+{
+	if (!m_state)
+		return 0;
+
+	{
+		std::lock_guard<std::mutex> lock(m_state->lock);
+		if (m_state->cancelled == false)
+		{
+			uint64_t id = m_state->nextId++;
+			m_state->callbacks.push_back(std::make_pair(id, callback));
+			return id;
+		}
+	}
+
+	callback();
+	return 0;
+}
+
+void HDRAsync::CCancellationToken::Unregister(uint64_t id)
+{
+	if (!m_state || id == 0)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_state->lock);
+	for (size_t i = 0; i < m_state->callbacks.size(); i++)
+	{
+		if (m_state->callbacks[i].first == id)
+		{
+			m_state->callbacks.erase(m_state->callbacks.begin() + i);
+			return;
+		}
+	}
+}
+
+HDRAsync::CCancellationSource::CCancellationSource() : m_state(new CancellationState())
+{
+}
+
+void HDRAsync::CCancellationSource::Cancel()
+{
+	std::vector<std::pair<uint64_t, std::function<void()>>> callbacks;
+	{
+		std::lock_guard<std::mutex> lock(m_state->lock);
+		if (m_state->cancelled)
+			return;
+		m_state->cancelled = true;
+		callbacks.swap(m_state->callbacks);
+	}
+
+	for (size_t i = 0; i < callbacks.size(); i++)
+		callbacks[i].second();
+}
+
+HDRAsync::CCancellationToken HDRAsync::CCancellationSource::GetToken()
+{
+	return CCancellationToken(m_state);
+}
+
+HDRAsync::FuseAwaitable::FuseAwaitable(CFusionService &service, std::vector<cv::Mat> images, CCancellationToken token)
+	: m_service(service), m_images(std::move(images)), m_token(token)
+{
+}
+
+bool HDRAsync::FuseAwaitable::await_ready()
+{
+	// Cancelled before it was even queued: don't suspend at all.
+	if (m_token.IsCancelled())
+	{
+		m_result.cancelled = true;
+		return true;
+	}
+	return false;
+}
+
+void HDRAsync::FuseAwaitable::await_suspend(std::coroutine_handle<> handle)
+{
+	std::shared_ptr<State> state = std::make_shared<State>();
+	m_state = state;
+	CFusionService *pService = &m_service;
+	FusionResult *pResult = &m_result;
+	CCancellationToken token = m_token;
+
+	// A request cancelled while it is queued resumes right away, without fusing. (Once the pool has claimed it, it
+	// runs to the end.) From here on the coroutine may already have been resumed (and this awaitable destroyed):
+	// only use the local copies, and 'this' only after claiming the request.
+	state->callbackId = token.Register([state, pService, pResult, handle]
+	{
+		if (state->claimed.exchange(true) == false)
+		{
+			pResult->cancelled = true;
+			pService->m_pool.Submit([handle] { handle.resume(); });
+		}
+	});
+
+	pService->m_pool.Submit([this, state, handle]
+	{
+		if (state->claimed.exchange(true))
+			return;
+
+		m_result = m_service.FuseNow(m_images);
+		handle.resume();
+	});
+}
+
+HDRAsync::FusionResult HDRAsync::FuseAwaitable::await_resume()
+{
+	if (m_state)
+		m_token.Unregister(m_state->callbackId);
+	m_images.clear();
+	return std::move(m_result);
+}
+
+HDRAsync::CFrameChannel::NextAwaitable::NextAwaitable(CFrameChannel &channel, CCancellationToken token)
+	: m_channel(channel), m_token(token)
+{
+}
+
+bool HDRAsync::CFrameChannel::NextAwaitable::await_ready()
+{
+	if (m_token.IsCancelled())
+	{
+		m_result.cancelled = true;
+		return true;
+	}
+	return false;
+}
+
+void HDRAsync::CFrameChannel::NextAwaitable::await_suspend(std::coroutine_handle<> handle)
+{
+	CFrameChannel *pChannel = &m_channel;
+	{
+		std::lock_guard<std::mutex> lock(pChannel->m_lock);
+		if (pChannel->m_closed == false)
+			m_waiterId = pChannel->m_nextId++;
+	}
+
+	if (m_waiterId == 0)
+	{
+		m_result.cancelled = true;
+		pChannel->m_pool.Submit([handle] { handle.resume(); });
+		return;
+	}
+
+	// Register for cancellation first. If the token is cancelled right now, there is no waiter to cancel yet,
+	// which is why it is checked again below.
+	uint64_t waiterId = m_waiterId;
+	CCancellationToken token = m_token;
+	m_callbackId = token.Register([pChannel, waiterId] { pChannel->CancelWaiter(waiterId); });
+
+	bool closed = false;
+	{
+		std::lock_guard<std::mutex> lock(pChannel->m_lock);
+		Waiter waiter = { waiterId, handle, &m_result };
+		closed = pChannel->m_closed;
+		if (closed)
+			m_result.cancelled = true;
+		else
+			pChannel->m_waiters.push_back(waiter);
+	}
+
+	// From here on the coroutine may already have been resumed (and this awaitable destroyed) by Publish().
+	// Only use the local copies.
+	if (closed)
+		pChannel->m_pool.Submit([handle] { handle.resume(); });
+	else if (token.IsCancelled())
+		pChannel->CancelWaiter(waiterId);
+}
+
+HDRAsync::FusionResult HDRAsync::CFrameChannel::NextAwaitable::await_resume()
+{
+	m_token.Unregister(m_callbackId);
+	return std::move(m_result);
+}
+
+HDRAsync::CFrameChannel::CFrameChannel(WorkStealingPool::CWorkStealingPool &pool) : m_pool(pool)
+{
+}
+
+HDRAsync::CFrameChannel::NextAwaitable HDRAsync::CFrameChannel::Next(CCancellationToken token)
+{
+	return NextAwaitable(*this, token);
+}
+
+void HDRAsync::CFrameChannel::Publish(const cv::Mat &frame)
+{
+	std::deque<Waiter> waiters;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		waiters.swap(m_waiters);
+	}
+
+	for (size_t i = 0; i < waiters.size(); i++)
+	{
+		Waiter waiter = waiters[i];
+		waiter.pResult->hdrMat = frame;
+		m_pool.Submit([waiter] { waiter.handle.resume(); });
+	}
+}
+
+void HDRAsync::CFrameChannel::Close()
+{
+	std::deque<Waiter> waiters;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_closed = true;
+		waiters.swap(m_waiters);
+	}
+
+	for (size_t i = 0; i < waiters.size(); i++)
+	{
+		Waiter waiter = waiters[i];
+		waiter.pResult->cancelled = true;
+		m_pool.Submit([waiter] { waiter.handle.resume(); });
+	}
+}
+
+void HDRAsync::CFrameChannel::CancelWaiter(uint64_t id)
+{
+	Waiter waiter = { 0, nullptr, NULL };
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		for (size_t i = 0; i < m_waiters.size(); i++)
+		{
+			if (m_waiters[i].id == id)
+			{
+				waiter = m_waiters[i];
+				m_waiters.erase(m_waiters.begin() + i);
+				break;
+			}
+		}
+	}
+
+	// Already resumed by Publish() or Close(): nothing to do.
+	if (waiter.id == 0)
+		return;
+
+	waiter.pResult->cancelled = true;
+	m_pool.Submit([waiter] { waiter.handle.resume(); });
+}
+
+HDRAsync::CFusionService::CFusionService(size_t numThreads, const HDRFusion::FusionSettings &settings) : m_pool(numThreads), m_frames(m_pool), m_settings(settings)
+{
+}
+
+HDRAsync::CFusionService::~CFusionService()
+{
+	Shutdown();
+}
+
+HDRAsync::FuseAwaitable HDRAsync::CFusionService::Fuse(std::vector<cv::Mat> images, CCancellationToken token)
+{
+	return FuseAwaitable(*this, std::move(images), token);
+}
+
+HDRAsync::FusionResult HDRAsync::CFusionService::FuseNow(std::vector<cv::Mat> &images)
+{
+	FusionResult result;
+	try
+	{
+		// The same steps as HDRFusion::CreateHDR(), on images that are already cv::Mat.
+		HDRFusion::PlaceImages(images, m_settings.placements);
+		if (m_settings.regions.empty())
+		{
+			cv::Mat fusion;
+			HDRFusion::FuseToFloat(images, fusion, m_settings);
+			HDRFusion::WriteOutput(fusion, m_settings.format, result.hdrMat, m_settings.toneCurve.get());
+		}
+		else
+			HDRFusion::FuseRegionsInFrame(images, m_settings, result.hdrMat);
+	}
+	catch (std::exception &e)
+	{
+		result.error = e.what();
+	}
+	return result;
+}
+
+void HDRAsync::CFusionService::SubmitBracket(std::vector<cv::Mat> images)
+{
+	m_pool.Submit([this, images]() mutable
+	{
+		FusionResult result = FuseNow(images);
+		if (result.error.empty())
+			m_frames.Publish(result.hdrMat);
+	});
+}
+
+HDRAsync::CFrameChannel::NextAwaitable HDRAsync::CFusionService::NextFrame(CCancellationToken token)
+{
+	return m_frames.Next(token);
+}
+
+void HDRAsync::CFusionService::PublishFrame(const cv::Mat &frame)
+{
+	m_frames.Publish(frame);
+}
+
+void HDRAsync::CFusionService::Shutdown()
+{
+	m_pool.Wait();
+	m_frames.Close();
+	m_pool.Wait();
+}
+
+size_t HDRAsync::CFusionService::GetNumThreads()
+{
+	return m_pool.GetNumThreads();
+}
+
+// *********************************************************************************************************
+
+#endif // HDRPIPELINEASYNC_AVAILABLE
+
+#endif
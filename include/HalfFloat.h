@@ -0,0 +1,215 @@
+// HalfFloat.h
+// Conversion between float and IEEE 754 half floats (binary16), for storing images and pyramids in half the memory.
+// Arithmetic stays in float: halves are only converted on the way in and out.
+//
+// Whole rows are converted 16 at a time with AVX-512, or 8 at a time with F16C, where the build targets them
+// (F16C comes with every CPU that has AVX2; MSVC only says so for /arch:AVX2). Otherwise 4 at a time with SSE2,
+// which does the rounding with integer arithmetic (after Fabian Giesen's conversions).
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HALFFLOAT_H
+#define HALFFLOAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <cstring>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#    include <emmintrin.h>
+#    define HALFFLOAT_SSE2
+#endif
+#if defined(__F16C__) || defined(__AVX2__)
+#    include <immintrin.h>
+#    define HALFFLOAT_F16C
+#endif
+#if defined(__AVX512F__)
+#    define HALFFLOAT_AVX512
+#endif
+
+namespace HalfFloat
+{
+	// Rounded to nearest even. Values too large for a half become infinity.
+	uint16_t FromFloat(float value);
+	float ToFloat(uint16_t half);
+
+	void FromFloatRow(const float *pIn, uint16_t *pOut, size_t count);
+	void ToFloatRow(const uint16_t *pIn, float *pOut, size_t count);
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+#ifdef HALFFLOAT_SSE2
+namespace HalfFloat
+{
+	namespace Detail
+	{
+		// 4 floats to halves (in the low 16 bits of each 32 bit lane, sign extended), rounded to nearest even.
+		inline __m128i FromFloat4(__m128 value)
+		{
+			const __m128i signMask = _mm_set1_epi32((int)0x80000000u);
+			const __m128i overflow = _mm_set1_epi32((127 + 16) << 23);               // from here on: infinity
+			const __m128i smallestNormal = _mm_set1_epi32((127 - 14) << 23);         // below: a subnormal half
+			const __m128i subnormalMagic = _mm_set1_epi32(((127 - 15) + (23 - 10) + 1) << 23);
+			const __m128i normalBias = _mm_set1_epi32(0xfff - ((127 - 15) << 23));  // rebias the exponent, round half up
+
+			__m128 sign = _mm_and_ps(_mm_castsi128_ps(signMask), value);
+			__m128 magnitude = _mm_xor_ps(value, sign);
+			__m128i bits = _mm_castps_si128(magnitude);
+
+			__m128i isNaN = _mm_castps_si128(_mm_cmpunord_ps(magnitude, magnitude));
+			__m128i isRegular = _mm_cmpgt_epi32(overflow, bits);
+			__m128i special = _mm_or_si128(_mm_and_si128(isNaN, _mm_set1_epi32(0x200)), _mm_set1_epi32(0x7c00));
+
+			// Subnormal: adding the magic number makes the FPU round the mantissa into place.
+			__m128i isSubnormal = _mm_cmpgt_epi32(smallestNormal, bits);
+			__m128i subnormal = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(magnitude, _mm_castsi128_ps(subnormalMagic))), subnormalMagic);
+
+			// Normal: round half up, plus one more if the kept mantissa is odd (= to even).
+			__m128i odd = _mm_srai_epi32(_mm_slli_epi32(bits, 31 - 13), 31);
+			__m128i normal = _mm_srli_epi32(_mm_sub_epi32(_mm_add_epi32(bits, normalBias), odd), 13);
+
+			__m128i regular = _mm_or_si128(_mm_and_si128(isSubnormal, subnormal), _mm_andnot_si128(isSubnormal, normal));
+			__m128i half = _mm_or_si128(_mm_and_si128(isRegular, regular), _mm_andnot_si128(isRegular, special));
+			return _mm_or_si128(half, _mm_srai_epi32(_mm_castps_si128(sign), 16));
+		}
+
+		// 4 halves (in the low 16 bits of each 32 bit lane) to floats.
+		inline __m128 ToFloat4(__m128i half)
+		{
+			const __m128 magic = _mm_castsi128_ps(_mm_set1_epi32((254 - 15) << 23));
+
+			__m128i exponentMantissa = _mm_and_si128(half, _mm_set1_epi32(0x7fff));
+			__m128i sign = _mm_slli_epi32(_mm_xor_si128(half, exponentMantissa), 16);
+			// Shifted into place and multiplied by 2^112, which also turns subnormal halves into normal floats.
+			__m128 scaled = _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(exponentMantissa, 13)), magic);
+			__m128i wasInfNaN = _mm_cmpgt_epi32(exponentMantissa, _mm_set1_epi32(0x7bff));
+			__m128 infNaNExponent = _mm_and_ps(_mm_castsi128_ps(wasInfNaN), _mm_castsi128_ps(_mm_set1_epi32(255 << 23)));
+			return _mm_or_ps(scaled, _mm_or_ps(_mm_castsi128_ps(sign), infNaNExponent));
+		}
+	}
+}
+#endif
+
+inline uint16_t HalfFloat::FromFloat(float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	uint32_t sign = (bits >> 16) & 0x8000;
+	uint32_t magnitude = bits & 0x7fffffff;
+
+	if (magnitude >= 0x7f800000) // inf or NaN
+		return (uint16_t)(sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0));
+	if (magnitude >= 0x477ff000) // rounds to more than the largest half
+		return (uint16_t)(sign | 0x7c00);
+	if (magnitude < 0x38800000) // subnormal half (or zero)
+	{
+		if (magnitude < 0x33000000)
+			return (uint16_t)sign;
+		uint32_t mantissa = (magnitude & 0x007fffff) | 0x00800000;
+		int shift = 126 - (int)(magnitude >> 23);
+		uint32_t half = mantissa >> shift;
+		uint32_t rest = mantissa & ((1u << shift) - 1);
+		uint32_t midpoint = 1u << (shift - 1);
+		if (rest > midpoint || (rest == midpoint && (half & 1)))
+			half++;
+		return (uint16_t)(sign | half);
+	}
+
+	uint32_t half = (magnitude - 0x38000000) >> 13;
+	uint32_t rest = magnitude & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+		half++;
+	return (uint16_t)(sign | half);
+}
+
+inline float HalfFloat::ToFloat(uint16_t half)
+{
+	uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+	uint32_t exponent = (half >> 10) & 0x1f;
+	uint32_t mantissa = half & 0x3ff;
+	uint32_t bits;
+
+	if (exponent == 0x1f) // inf or NaN
+		bits = sign | 0x7f800000 | (mantissa << 13);
+	else if (exponent != 0)
+		bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+	else if (mantissa == 0)
+		bits = sign;
+	else
+	{
+		// Subnormal half: a normal float.
+		exponent = 113;
+		while ((mantissa & 0x400) == 0)
+		{
+			mantissa <<= 1;
+			exponent--;
+		}
+		bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+	}
+
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+inline void HalfFloat::FromFloatRow(const float *pIn, uint16_t *pOut, size_t count)
+{
+	size_t i = 0;
+#ifdef HALFFLOAT_AVX512
+	for (; i + 16 <= count; i += 16)
+		_mm256_storeu_si256((__m256i*)(pOut + i), _mm512_cvtps_ph(_mm512_loadu_ps(pIn + i), _MM_FROUND_TO_NEAREST_INT));
+#endif
+#ifdef HALFFLOAT_F16C
+	for (; i + 8 <= count; i += 8)
+		_mm_storeu_si128((__m128i*)(pOut + i), _mm256_cvtps_ph(_mm256_loadu_ps(pIn + i), _MM_FROUND_TO_NEAREST_INT));
+#endif
+#ifdef HALFFLOAT_SSE2
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i low = Detail::FromFloat4(_mm_loadu_ps(pIn + i));
+		__m128i high = Detail::FromFloat4(_mm_loadu_ps(pIn + i + 4));
+		_mm_storeu_si128((__m128i*)(pOut + i), _mm_packs_epi32(low, high));
+	}
+#endif
+	for (; i < count; i++)
+		pOut[i] = FromFloat(pIn[i]);
+}
+
+inline void HalfFloat::ToFloatRow(const uint16_t *pIn, float *pOut, size_t count)
+{
+	size_t i = 0;
+#ifdef HALFFLOAT_AVX512
+	for (; i + 16 <= count; i += 16)
+		_mm512_storeu_ps(pOut + i, _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(pIn + i))));
+#endif
+#ifdef HALFFLOAT_F16C
+	for (; i + 8 <= count; i += 8)
+		_mm256_storeu_ps(pOut + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(pIn + i))));
+#endif
+#ifdef HALFFLOAT_SSE2
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i halves = _mm_loadu_si128((const __m128i*)(pIn + i));
+		_mm_storeu_ps(pOut + i, Detail::ToFloat4(_mm_unpacklo_epi16(halves, _mm_setzero_si128())));
+		_mm_storeu_ps(pOut + i + 4, Detail::ToFloat4(_mm_unpackhi_epi16(halves, _mm_setzero_si128())));
+	}
+#endif
+	for (; i < count; i++)
+		pOut[i] = ToFloat(pIn[i]);
+}
+
+// *********************************************************************************************************
+
+#endif
@@ -0,0 +1,171 @@
+// PipelineWarmUp.h
+// Gets the fusion pipeline up to speed before acquisition starts, so the first HDR image is as fast as every other one.
+//
+// The first fusion is slow for reasons that have nothing to do with the images: OpenCV starts its thread pool,
+// the converter, the pyramids and the output are allocated and every page of them is faulted in, and the allocator
+// grows its heap. Fusing a synthetic bracket of the same pixel format and sizes does all of that up front.
+// LockMemory() can then keep everything the process has (and will) allocate in RAM.
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PIPELINEWARMUP_H
+#define PIPELINEWARMUP_H
+
+#ifndef LINUX_BUILD
+#define WIN_BUILD
+#endif
+
+// Include Pylon libraries (if needed)
+#include <pylon/PylonIncludes.h>
+
+// The fusion being warmed up
+#include "HDRFusion.h"
+
+#ifndef WIN_BUILD
+#include <sys/mman.h>
+#endif
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstring>
+
+namespace PipelineWarmUp
+{
+	// A bracket of 'sizes.size()' images in 'pixelType': the same gradient in each, brighter from one image to the next.
+	int CreateSyntheticBracket(Pylon::EPixelType pixelType, const std::vector<cv::Size> &sizes, std::vector<Pylon::CPylonImage> &images, std::string &errorMessage);
+
+	// Fuse 'images' 'numRuns' times with 'settings', the way the grab loop will. 'fusionMs' gets the time of every run
+	// (the first one is the cold start, the last one should be the steady state).
+	int WarmUpFusion(std::vector<Pylon::CPylonImage> &images, const HDRFusion::FusionSettings &settings, uint32_t numRuns, std::vector<double> &fusionMs, std::string &errorMessage);
+
+	// Lock all memory of the process into RAM, including what it allocates later (so that is faulted in when allocated).
+	// Needs the right to lock that much memory (RLIMIT_MEMLOCK). Not available on Windows: lock the grab buffers there instead.
+	int LockMemory(std::string &errorMessage);
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+int PipelineWarmUp::CreateSyntheticBracket(Pylon::EPixelType pixelType, const std::vector<cv::Size> &sizes, std::vector<Pylon::CPylonImage> &images, std::string &errorMessage)
+{
+	errorMessage = "ERROR: ";
+	errorMessage.append(__FUNCTION__);
+	errorMessage.append("(): ");
+
+	try
+	{
+		// Unpacked formats get proper sample values. Anything else just gets the gradient in every byte, which converts all the same.
+		uint32_t samplesPerPixel = Pylon::SamplesPerPixel(pixelType);
+		uint32_t bitsPerSample = (samplesPerPixel > 0) ? Pylon::BitPerPixel(pixelType) / samplesPerPixel : 0;
+		bool sixteenBit = (Pylon::IsPacked(pixelType) == false && Pylon::IsYUV(pixelType) == false && bitsPerSample == 16);
+		uint32_t maxValue = sixteenBit ? (1u << Pylon::BitDepth(pixelType)) - 1 : 255;
+
+		images.resize(sizes.size());
+		for (size_t i = 0; i < sizes.size(); i++)
+		{
+			images[i].Reset(pixelType, (uint32_t)sizes[i].width, (uint32_t)sizes[i].height);
+
+			double brightness = (double)(i + 1) / sizes.size();
+			size_t rowBytes = images[i].GetImageSize() / sizes[i].height;
+			uint8_t *pRow = (uint8_t*)images[i].GetBuffer();
+			for (int y = 0; y < sizes[i].height; y++, pRow += rowBytes)
+			{
+				if (sixteenBit)
+				{
+					uint16_t *pSamples = (uint16_t*)pRow;
+					size_t numSamples = rowBytes / 2;
+					for (size_t x = 0; x < numSamples; x++)
+						pSamples[x] = (uint16_t)(maxValue * brightness * x / numSamples);
+				}
+				else
+				{
+					for (size_t x = 0; x < rowBytes; x++)
+						pRow[x] = (uint8_t)(maxValue * brightness * x / rowBytes);
+				}
+			}
+		}
+
+		return 0;
+	}
+	catch (GenICam::GenericException &e)
+	{
+		errorMessage.append("EXCEPTION: ");
+		errorMessage.append(e.GetDescription());
+		return 1;
+	}
+	catch (std::exception &e)
+	{
+		errorMessage.append("EXCEPTION: ");
+		errorMessage.append(e.what());
+		return 1;
+	}
+}
+
+int PipelineWarmUp::WarmUpFusion(std::vector<Pylon::CPylonImage> &images, const HDRFusion::FusionSettings &settings, uint32_t numRuns, std::vector<double> &fusionMs, std::string &errorMessage)
+{
+	errorMessage = "ERROR: ";
+	errorMessage.append(__FUNCTION__);
+	errorMessage.append("(): ");
+
+	fusionMs.clear();
+
+	try
+	{
+		for (uint32_t run = 0; run < numRuns; run++)
+		{
+			std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+			Pylon::CPylonImage hdrImage;
+			HDRFusion::CreateHDR(images, hdrImage, settings);
+			fusionMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count());
+		}
+
+		return 0;
+	}
+	catch (GenICam::GenericException &e)
+	{
+		errorMessage.append("EXCEPTION: ");
+		errorMessage.append(e.GetDescription());
+		return 1;
+	}
+	catch (std::exception &e)
+	{
+		errorMessage.append("EXCEPTION: ");
+		errorMessage.append(e.what());
+		return 1;
+	}
+}
+
+int PipelineWarmUp::LockMemory(std::string &errorMessage)
+{
+	errorMessage = "ERROR: ";
+	errorMessage.append(__FUNCTION__);
+	errorMessage.append("(): ");
+
+#ifdef WIN_BUILD
+	errorMessage.append("Locking all memory is not available on Windows");
+	return 1;
+#else
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+	{
+		errorMessage.append("mlockall() failed (not allowed to lock that much memory? see ulimit -l)");
+		return 1;
+	}
+	return 0;
+#endif
+}
+
+// *********************************************************************************************************
+
+#endif
@@ -0,0 +1,218 @@
+// SequencerCache.h
+// Remembers which sequencer configuration each camera was last programmed with, so it doesn't have to be programmed again.
+//
+// The configuration is reduced to a fingerprint. The samples save the programmed sequencer into a user set on the camera
+// (and, only if asked, make the camera load it at power-up), and record the fingerprint here, in a small text file on the host:
+//   <serial number> <fingerprint> <number of sets> then for each set: <exposure time> <gain> <offset x> <offset y> <width> <height> <binning>
+// On the next start, a matching fingerprint means loading the user set is enough (one command instead of dozens).
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SEQUENCERCACHE_H
+#define SEQUENCERCACHE_H
+
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <mutex>
+
+// What each sequencer set holds
+#include "BracketPlanner.h"
+
+namespace SequencerCache
+{
+	// Everything that decides what ends up in the sequencer sets. If any of it changes, the camera is programmed again.
+	struct SequencerConfig
+	{
+		std::string serialNumber;
+		std::string firmwareVersion;
+		uint32_t imagesPerHDR;
+		double lowExposureTime;
+		double highExposureTime;
+		double maxExposureTime; // gain-assisted bracketing (0 = off)
+		double maxGain;
+		bool optimizedOrder;
+		bool sensorOverlapsExposure; // the timing model the order was optimized for
+		bool partialROI;
+		int64_t partialOffsetX; // the short exposure's ROI and binning (partial ROI only)
+		int64_t partialOffsetY;
+		int64_t partialWidth;
+		int64_t partialHeight;
+		int64_t partialBinning;
+		uint32_t normalFramesPerBracket; // interleaved regular frames (0 = none)
+		double normalExposureTime;
+	};
+
+	// FNV-1a over the configuration.
+	uint64_t Fingerprint(const SequencerConfig &config);
+
+	// The cache file. Safe to use from several threads (one per camera).
+	class CSequencerCache
+	{
+	private:
+		struct Entry
+		{
+			uint64_t fingerprint;
+			std::vector<BracketPlanner::BracketEntry> sets;
+		};
+
+		std::string m_path;
+		std::map<std::string, Entry> m_entries;
+		std::mutex m_lock;
+
+	public:
+		// A missing file is an empty cache, not an error.
+		int Load(const std::string &path, std::string &errorMessage);
+		int Save(std::string &errorMessage);
+
+		// Is the camera known to hold this configuration? If so, also returns what its sets were programmed with.
+		bool Lookup(const std::string &serialNumber, uint64_t fingerprint, std::vector<BracketPlanner::BracketEntry> &sets);
+		void Update(const std::string &serialNumber, uint64_t fingerprint, const std::vector<BracketPlanner::BracketEntry> &sets);
+		// Forget a camera, for example after loading its user set failed.
+		void Remove(const std::string &serialNumber);
+	};
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+uint64_t SequencerCache::Fingerprint(const SequencerConfig &config)
+{
+	std::stringstream text;
+	text.precision(17);
+	text << config.serialNumber << '|' << config.firmwareVersion << '|' << config.imagesPerHDR << '|'
+		<< config.lowExposureTime << '|' << config.highExposureTime << '|' << config.maxExposureTime << '|' << config.maxGain << '|' << config.optimizedOrder << '|' << config.sensorOverlapsExposure << '|' << config.partialROI << '|'
+		<< config.partialOffsetX << '|' << config.partialOffsetY << '|' << config.partialWidth << '|' << config.partialHeight << '|' << config.partialBinning << '|'
+		<< config.normalFramesPerBracket << '|' << config.normalExposureTime;
+	std::string s = text.str();
+
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < s.size(); i++)
+	{
+		hash ^= (uint8_t)s[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+int SequencerCache::CSequencerCache::Load(const std::string &path, std::string &errorMessage)
+{
+	errorMessage = "ERROR: ";
+	errorMessage.append(__FUNCTION__);
+	errorMessage.append("(): ");
+
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_path = path;
+	m_entries.clear();
+
+	std::ifstream file(path.c_str());
+	if (!file.is_open())
+		return 0;
+
+	std::string line;
+	while (std::getline(file, line))
+	{
+		std::stringstream fields(line);
+		std::string serialNumber;
+		Entry entry;
+		size_t numSets = 0;
+		if (!(fields >> serialNumber >> std::hex >> entry.fingerprint >> std::dec >> numSets))
+			continue;
+
+		entry.sets.resize(numSets);
+		bool valid = true;
+		for (size_t i = 0; i < numSets && valid; i++)
+		{
+			BracketPlanner::BracketEntry &set = entry.sets[i];
+			valid = (bool)(fields >> set.exposureTime >> set.gain >> set.offsetX >> set.offsetY >> set.width >> set.height >> set.binning);
+		}
+
+		// A damaged line only costs that camera a reprogramming.
+		if (valid)
+			m_entries[serialNumber] = entry;
+	}
+
+	return 0;
+}
+
+int SequencerCache::CSequencerCache::Save(std::string &errorMessage)
+{
+	errorMessage = "ERROR: ";
+	errorMessage.append(__FUNCTION__);
+	errorMessage.append("(): ");
+
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	std::ofstream file(m_path.c_str(), std::ios::trunc);
+	if (!file.is_open())
+	{
+		errorMessage.append("Could not write ");
+		errorMessage.append(m_path);
+		return 1;
+	}
+
+	file.precision(17);
+	for (std::map<std::string, Entry>::iterator it = m_entries.begin(); it != m_entries.end(); ++it)
+	{
+		file << it->first << ' ' << std::hex << it->second.fingerprint << std::dec << ' ' << it->second.sets.size();
+		for (size_t i = 0; i < it->second.sets.size(); i++)
+		{
+			const BracketPlanner::BracketEntry &set = it->second.sets[i];
+			file << ' ' << set.exposureTime << ' ' << set.gain << ' ' << set.offsetX << ' ' << set.offsetY << ' ' << set.width << ' ' << set.height << ' ' << set.binning;
+		}
+		file << '\n';
+	}
+
+	if (!file.good())
+	{
+		errorMessage.append("Could not write ");
+		errorMessage.append(m_path);
+		return 1;
+	}
+
+	return 0;
+}
+
+bool SequencerCache::CSequencerCache::Lookup(const std::string &serialNumber, uint64_t fingerprint, std::vector<BracketPlanner::BracketEntry> &sets)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	std::map<std::string, Entry>::iterator it = m_entries.find(serialNumber);
+	if (it == m_entries.end() || it->second.fingerprint != fingerprint)
+		return false;
+
+	sets = it->second.sets;
+	return true;
+}
+
+void SequencerCache::CSequencerCache::Update(const std::string &serialNumber, uint64_t fingerprint, const std::vector<BracketPlanner::BracketEntry> &sets)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	Entry &entry = m_entries[serialNumber];
+	entry.fingerprint = fingerprint;
+	entry.sets = sets;
+}
+
+void SequencerCache::CSequencerCache::Remove(const std::string &serialNumber)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_entries.erase(serialNumber);
+}
+
+// *********************************************************************************************************
+
+#endif
@@ -0,0 +1,545 @@
+// StreamingFusion.h
+// Exposure fusion row by row, for sensors too large (or boxes too small) to hold the whole bracket in float.
+//
+// The exposures are handed over one row at a time, as they are converted, and the fused rows come out in order, a
+// fixed number of rows behind. Every pyramid level only keeps the last few rows it has computed, in a ring, so the
+// working memory grows with the width of the image (and the depth of the pyramid), not with its area.
+//
+// The catch is the depth. A pyramid level is computed from rows twice as far apart as the level above it, so every
+// level doubles how far ahead of the output the input has to be. The full depth (down to a few pixels, like
+// ExposureFusion::Blend()) would mean waiting for the whole image. So the stream stops at 'depth' levels and blends
+// the coarsest one as it is, which is what Blend() does with its top level. 4 levels (the default) lag about 60 rows,
+// and come out around 40 dB from the full depth: the difference is in the large-scale brightness, not in the detail.
+// Deghosting needs the whole frame, so it isn't available here.
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Uses OpenCV libraries. License information can be found here:
+// https://opencv.org/license/
+
+#ifndef STREAMINGFUSION_H
+#define STREAMINGFUSION_H
+
+#include <opencv2/opencv.hpp>
+
+// The weights and the pyramid filters are the same as for the whole image
+#include "ExposureFusion.h"
+
+#include <stdint.h>
+#include <vector>
+#include <functional>
+#include <cstring>
+#include <algorithm>
+
+namespace StreamingFusion
+{
+	struct Settings
+	{
+		int depth = 4;                      // pyramid levels below full resolution (fewer if the image is too small for them)
+		ExposureFusion::Parameters weights;
+	};
+
+	namespace Detail
+	{
+		// The newest rows of a sequence of rows that are computed (or arrive) one after the other, kept in a ring.
+		class RowRing
+		{
+		private:
+			std::vector<float> m_memory;
+			size_t m_rowSize;
+			int m_capacity;
+			int m_count;
+
+		public:
+			RowRing()
+				: m_rowSize(0), m_capacity(0), m_count(0)
+			{
+			}
+
+			void Create(size_t rowSize, int capacity)
+			{
+				m_memory.assign(rowSize * capacity, 0.0f);
+				m_rowSize = rowSize;
+				m_capacity = capacity;
+				m_count = 0;
+			}
+
+			// The number of rows so far (the next row's index).
+			int GetCount() const
+			{
+				return m_count;
+			}
+
+			// Where to put the next row. It replaces the oldest one.
+			float *Append()
+			{
+				return &m_memory[(size_t)(m_count++ % m_capacity) * m_rowSize];
+			}
+
+			// One of the last 'capacity' rows.
+			float *Row(int y)
+			{
+				return &m_memory[(size_t)(y % m_capacity) * m_rowSize];
+			}
+
+			const float *Row(int y) const
+			{
+				return &m_memory[(size_t)(y % m_capacity) * m_rowSize];
+			}
+
+			size_t GetMemory() const
+			{
+				return m_memory.size() * sizeof(float);
+			}
+		};
+
+		// The weights of one full resolution row (planar BGR, 0..1), computing only the 'Terms' (see ExposureFusion.h).
+		// The grey rows around it are only read with WeightTerm_Contrast.
+		template<int Terms>
+		inline void WeightRow(const float *pBGR, const float *pAbove, const float *pGray, const float *pBelow, int width,
+			const ExposureFusion::Parameters &parameters, float *pWeight)
+		{
+			using namespace ExposureFusion::Detail;
+
+			for (int x = 0; x < width; x++)
+			{
+				float contrast = 0;
+				if (Terms & ExposureFusion::WeightTerm_Contrast)
+					contrast = pGray[Reflect(x - 1, width)] + pGray[Reflect(x + 1, width)] + pAbove[x] + pBelow[x] - 4.0f * pGray[x];
+				pWeight[x] = Weight<Terms>(pBGR[x], pBGR[width + x], pBGR[2 * width + x], contrast, parameters);
+			}
+		}
+
+		// The same with only the well-exposedness on: the product of the channels' table entries (256 of them, by the
+		// 8 bit value the row was made from).
+		inline void ExposureTableRow(const float *pBGR, int width, const float *pTable, float *pWeight)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				pWeight[x] = pTable[(int)(pBGR[x] * 255.0f + 0.5f)] * pTable[(int)(pBGR[width + x] * 255.0f + 0.5f)]
+					* pTable[(int)(pBGR[2 * width + x] * 255.0f + 0.5f)] + 1e-12f;
+			}
+		}
+	}
+
+	class CStreamingFusion
+	{
+	public:
+		// Row y of the fusion: 3 floats (BGR, 1.0 = white) per pixel, like a row of a CV_32FC3 image.
+		typedef std::function<void(int y, const float *pBGR)> RowHandler;
+
+	private:
+		cv::Size m_size;
+		size_t m_numImages;
+		ExposureFusion::Parameters m_parameters;
+		int m_weightTerms;                  // the WeightTerm_ flags that are on
+		std::vector<float> m_exposureTable; // the well-exposedness per 8 bit value, if it is the only term
+		int m_depth;
+		RowHandler m_onRow;
+		std::vector<cv::Size> m_levelSizes;
+
+		// Per image and level (index image * (depth + 1) + level): the Gaussian pyramid (rows of 3 planar channels) and
+		// the normalized weights' Gaussian pyramid. Per image: the grey rows the contrast is computed from.
+		std::vector<Detail::RowRing> m_gaussian;
+		std::vector<Detail::RowRing> m_weights;
+		std::vector<Detail::RowRing> m_gray;
+		// Per level below full resolution: the blended pyramid, collapsed up to that level.
+		std::vector<Detail::RowRing> m_collapsed;
+
+		// Per level: room for one collapsed row, one Laplacian row, one upsampled row of one channel, and for the filters.
+		std::vector<std::vector<float> > m_collapsedRows;
+		std::vector<std::vector<float> > m_laplacianRows;
+		std::vector<std::vector<float> > m_upRows;
+		std::vector<std::vector<float> > m_columns;
+		std::vector<float> m_weightSum;
+		std::vector<float> m_output;
+		int m_nextRow;
+
+		Detail::RowRing &Gaussian(size_t image, int level) { return m_gaussian[image * (m_depth + 1) + level]; }
+		Detail::RowRing &Weights(size_t image, int level) { return m_weights[image * (m_depth + 1) + level]; }
+
+		bool EnsureGaussian(size_t image, int level, int row);
+		bool EnsureGray(size_t image, int row);
+		bool EnsureWeights(int level, int row);
+		void ComputeWeightRow(const float *pBGR, const float *pAbove, const float *pGray, const float *pBelow, float *pWeight);
+		bool EnsureCollapsed(int level, int row);
+		bool ComputeCollapsedRow(int level, int row, float *pOut);
+		void Upsample(const Detail::RowRing &coarser, int level, int row, int channel, float *pOut);
+
+	public:
+		// A stream for brackets of 'numImages' exposures of 'size'. Fused rows are handed to 'onRow'.
+		CStreamingFusion(cv::Size size, size_t numImages, const Settings &settings, RowHandler onRow);
+
+		// Hand over the next row of every exposure (CV_8UC3 BGR rows, one per image). Every fused row this completes is
+		// handed to the row handler before it returns, in order. With the last row, the rest of the fusion is handed over.
+		void PushRow(const std::vector<const uint8_t*> &rows);
+
+		// The depth actually used for this size.
+		int GetDepth() const;
+		// How many rows the input has to be ahead of the output, at most.
+		int GetLatency() const;
+		// Bytes of working memory.
+		size_t GetMemory() const;
+	};
+
+	// Fuse whole CV_8UC3 images through a stream into a CV_32FC3 fusion (BGR, 1.0 = white).
+	void Fuse(const std::vector<cv::Mat> &images, const Settings &settings, cv::Mat &fusion);
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+StreamingFusion::CStreamingFusion::CStreamingFusion(cv::Size size, size_t numImages, const Settings &settings, RowHandler onRow)
+	: m_size(size), m_numImages(numImages), m_parameters(settings.weights), m_onRow(onRow), m_nextRow(0)
+{
+	m_depth = std::max(std::min(settings.depth, ExposureFusion::GetPyramidDepth(size)), 0);
+	m_weightTerms = ExposureFusion::GetWeightTerms(m_parameters);
+	if (m_weightTerms == ExposureFusion::WeightTerm_Exposure)
+	{
+		for (int value = 0; value < 256; value++)
+			m_exposureTable.push_back(ExposureFusion::Detail::ChannelExposure(value, m_parameters.exposureWeight));
+	}
+	for (int level = 0; level <= m_depth; level++)
+	{
+		m_levelSizes.push_back(size);
+		size = cv::Size((size.width + 1) / 2, (size.height + 1) / 2);
+	}
+
+	// How many rows each level has to keep: a level runs ahead of the rows the level above it needs by twice
+	// what the level below it runs ahead, plus the 5 tap filter's reach. (With room for the rows still being read.)
+	m_gaussian.resize(numImages * (m_depth + 1));
+	m_weights.resize(numImages * (m_depth + 1));
+	m_gray.resize(numImages);
+	for (int level = 0; level <= m_depth; level++)
+	{
+		int width = m_levelSizes[level].width;
+		int capacity = std::min(4 * (1 << (m_depth - level)) + 8, m_levelSizes[level].height);
+		for (size_t i = 0; i < numImages; i++)
+		{
+			Gaussian(i, level).Create(3 * (size_t)width, capacity);
+			Weights(i, level).Create((size_t)width, capacity);
+		}
+	}
+	for (size_t i = 0; i < numImages; i++)
+		m_gray[i].Create((size_t)m_size.width, 4);
+
+	m_collapsed.resize(m_depth + 1);
+	m_collapsedRows.resize(m_depth + 1);
+	m_laplacianRows.resize(m_depth + 1);
+	m_upRows.resize(m_depth + 1);
+	m_columns.resize(m_depth + 1);
+	for (int level = 0; level <= m_depth; level++)
+	{
+		int width = m_levelSizes[level].width;
+		if (level > 0)
+			m_collapsed[level].Create(3 * (size_t)width, 4);
+		m_collapsedRows[level].resize(3 * (size_t)width);
+		m_laplacianRows[level].resize(3 * (size_t)width);
+		m_upRows[level].resize((size_t)width);
+		m_columns[level].resize((size_t)width);
+	}
+	m_weightSum.resize((size_t)m_size.width);
+	m_output.resize(3 * (size_t)m_size.width);
+}
+
+bool StreamingFusion::CStreamingFusion::EnsureGaussian(size_t image, int level, int row)
+{
+	using namespace ExposureFusion::Detail;
+
+	Detail::RowRing &ring = Gaussian(image, level);
+	while (ring.GetCount() <= row)
+	{
+		// Level 0 is the input itself.
+		if (level == 0)
+			return false;
+
+		int k = ring.GetCount();
+		int width = m_levelSizes[level - 1].width;
+		int height = m_levelSizes[level - 1].height;
+		if (EnsureGaussian(image, level - 1, std::min(2 * k + 2, height - 1)) == false)
+			return false;
+
+		const Detail::RowRing &finer = Gaussian(image, level - 1);
+		float *pOut = ring.Append();
+		for (int c = 0; c < 3; c++)
+		{
+			const float *pRows[5];
+			for (int i = 0; i < 5; i++)
+				pRows[i] = finer.Row(Reflect(2 * k + i - 2, height)) + c * width;
+			DownsampleColumns(pRows, &m_columns[level - 1][0], width);
+			DownsampleRow(&m_columns[level - 1][0], width, pOut + c * m_levelSizes[level].width, m_levelSizes[level].width);
+		}
+	}
+	return true;
+}
+
+bool StreamingFusion::CStreamingFusion::EnsureGray(size_t image, int row)
+{
+	Detail::RowRing &ring = m_gray[image];
+	while (ring.GetCount() <= row)
+	{
+		int y = ring.GetCount();
+		if (Gaussian(image, 0).GetCount() <= y)
+			return false;
+
+		// Like ExposureFusion::ComputeWeights() (and MergeMertens), which takes the image for RGB.
+		int width = m_size.width;
+		const float *pBGR = Gaussian(image, 0).Row(y);
+		float *pGray = ring.Append();
+		for (int x = 0; x < width; x++)
+			pGray[x] = 0.299f * pBGR[x] + 0.587f * pBGR[width + x] + 0.114f * pBGR[2 * width + x];
+	}
+	return true;
+}
+
+bool StreamingFusion::CStreamingFusion::EnsureWeights(int level, int row)
+{
+	using namespace ExposureFusion::Detail;
+
+	int width = m_levelSizes[level].width;
+	while (Weights(0, level).GetCount() <= row)
+	{
+		int y = Weights(0, level).GetCount();
+		if (level > 0)
+		{
+			int finerWidth = m_levelSizes[level - 1].width;
+			int finerHeight = m_levelSizes[level - 1].height;
+			if (EnsureWeights(level - 1, std::min(2 * y + 2, finerHeight - 1)) == false)
+				return false;
+
+			for (size_t i = 0; i < m_numImages; i++)
+			{
+				const Detail::RowRing &finer = Weights(i, level - 1);
+				const float *pRows[5];
+				for (int k = 0; k < 5; k++)
+					pRows[k] = finer.Row(Reflect(2 * y + k - 2, finerHeight));
+				DownsampleColumns(pRows, &m_columns[level - 1][0], finerWidth);
+				DownsampleRow(&m_columns[level - 1][0], finerWidth, Weights(i, level).Append(), width);
+			}
+			continue;
+		}
+
+		// Full resolution: the contrast needs the grey rows above and below. (Without it, only the row itself.)
+		int height = m_size.height;
+		bool contrast = (m_weightTerms & ExposureFusion::WeightTerm_Contrast) != 0;
+		for (size_t i = 0; i < m_numImages; i++)
+		{
+			if (contrast && EnsureGray(i, std::min(y + 1, height - 1)) == false)
+				return false;
+			if (contrast == false && Gaussian(i, 0).GetCount() <= y)
+				return false;
+		}
+
+		std::fill(m_weightSum.begin(), m_weightSum.end(), 0.0f);
+		for (size_t i = 0; i < m_numImages; i++)
+		{
+			const float *pAbove = contrast ? m_gray[i].Row(Reflect(y - 1, height)) : NULL;
+			const float *pGray = contrast ? m_gray[i].Row(y) : NULL;
+			const float *pBelow = contrast ? m_gray[i].Row(Reflect(y + 1, height)) : NULL;
+			float *pWeight = Weights(i, 0).Append();
+			ComputeWeightRow(Gaussian(i, 0).Row(y), pAbove, pGray, pBelow, pWeight);
+			for (int x = 0; x < width; x++)
+				m_weightSum[x] += pWeight[x];
+		}
+		for (size_t i = 0; i < m_numImages; i++)
+		{
+			float *pWeight = Weights(i, 0).Row(y);
+			for (int x = 0; x < width; x++)
+				pWeight[x] /= m_weightSum[x];
+		}
+	}
+	return true;
+}
+
+void StreamingFusion::CStreamingFusion::ComputeWeightRow(const float *pBGR, const float *pAbove, const float *pGray, const float *pBelow, float *pWeight)
+{
+	// The kernel is picked once per row, like ExposureFusion::ComputeWeights() picks it once per image.
+	int width = m_size.width;
+	switch (m_weightTerms)
+	{
+	case 0: Detail::WeightRow<0>(pBGR, pAbove, pGray, pBelow, width, m_parameters, pWeight); break;
+	case 1: Detail::WeightRow<1>(pBGR, pAbove, pGray, pBelow, width, m_parameters, pWeight); break;
+	case 2: Detail::WeightRow<2>(pBGR, pAbove, pGray, pBelow, width, m_parameters, pWeight); break;
+	case 3: Detail::WeightRow<3>(pBGR, pAbove, pGray, pBelow, width, m_parameters, pWeight); break;
+	case 4: Detail::ExposureTableRow(pBGR, width, &m_exposureTable[0], pWeight); break;
+	case 5: Detail::WeightRow<5>(pBGR, pAbove, pGray, pBelow, width, m_parameters, pWeight); break;
+	case 6: Detail::WeightRow<6>(pBGR, pAbove, pGray, pBelow, width, m_parameters, pWeight); break;
+	default: Detail::WeightRow<7>(pBGR, pAbove, pGray, pBelow, width, m_parameters, pWeight); break;
+	}
+}
+
+void StreamingFusion::CStreamingFusion::Upsample(const Detail::RowRing &coarser, int level, int row, int channel, float *pOut)
+{
+	using namespace ExposureFusion::Detail;
+
+	// 'coarser' is level + 1. Row 'row' of 'level' is upsampled from rows row / 2 - 1 to row / 2 + 1 of it.
+	int coarserWidth = m_levelSizes[level + 1].width;
+	int coarserHeight = m_levelSizes[level + 1].height;
+	int k = row / 2;
+	size_t offset = (size_t)channel * coarserWidth;
+	const float *pAbove = coarser.Row(Reflect(k - 1, coarserHeight)) + offset;
+	const float *pRow = coarser.Row(k) + offset;
+	const float *pBelow = coarser.Row(std::min(k + 1, coarserHeight - 1)) + offset;
+	UpsampleColumns(pAbove, pRow, pBelow, (row & 1) != 0, &m_columns[level + 1][0], coarserWidth);
+	UpsampleRow(&m_columns[level + 1][0], coarserWidth, pOut, m_levelSizes[level].width);
+}
+
+bool StreamingFusion::CStreamingFusion::ComputeCollapsedRow(int level, int row, float *pOut)
+{
+	int width = m_levelSizes[level].width;
+	int coarserRow = (level < m_depth) ? std::min(row / 2 + 1, m_levelSizes[level + 1].height - 1) : 0;
+
+	// Everything this row is made of.
+	if (EnsureWeights(level, row) == false)
+		return false;
+	for (size_t i = 0; i < m_numImages; i++)
+	{
+		if (EnsureGaussian(i, level, row) == false || (level < m_depth && EnsureGaussian(i, level + 1, coarserRow) == false))
+			return false;
+	}
+	if (level < m_depth && EnsureCollapsed(level + 1, coarserRow) == false)
+		return false;
+
+	// This level of the blended pyramid: each image's Laplacian level times its weights...
+	float *pUp = &m_upRows[level][0];
+	std::fill(pOut, pOut + 3 * width, 0.0f);
+	for (size_t i = 0; i < m_numImages; i++)
+	{
+		const float *pGaussian = Gaussian(i, level).Row(row);
+		const float *pWeight = Weights(i, level).Row(row);
+		float *pLaplacian = &m_laplacianRows[level][0];
+		memcpy(pLaplacian, pGaussian, 3 * width * sizeof(float));
+		if (level < m_depth)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				Upsample(Gaussian(i, level + 1), level, row, c, pUp);
+				for (int x = 0; x < width; x++)
+					pLaplacian[c * width + x] -= pUp[x];
+			}
+		}
+		for (int c = 0; c < 3; c++)
+		{
+			for (int x = 0; x < width; x++)
+				pOut[c * width + x] += pLaplacian[c * width + x] * pWeight[x];
+		}
+	}
+
+	// ... plus the coarser levels, collapsed.
+	if (level < m_depth)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			Upsample(m_collapsed[level + 1], level, row, c, pUp);
+			for (int x = 0; x < width; x++)
+				pOut[c * width + x] += pUp[x];
+		}
+	}
+	return true;
+}
+
+bool StreamingFusion::CStreamingFusion::EnsureCollapsed(int level, int row)
+{
+	Detail::RowRing &ring = m_collapsed[level];
+	std::vector<float> &collapsed = m_collapsedRows[level];
+	while (ring.GetCount() <= row)
+	{
+		// Computed aside first: a row that can't be finished yet must not take a place in the ring.
+		if (ComputeCollapsedRow(level, ring.GetCount(), &collapsed[0]) == false)
+			return false;
+		memcpy(ring.Append(), &collapsed[0], collapsed.size() * sizeof(float));
+	}
+	return true;
+}
+
+void StreamingFusion::CStreamingFusion::PushRow(const std::vector<const uint8_t*> &rows)
+{
+	int width = m_size.width;
+	for (size_t i = 0; i < m_numImages && i < rows.size(); i++)
+	{
+		// Into planar channels, 0..1.
+		const uint8_t *pBGR = rows[i];
+		float *pRow = Gaussian(i, 0).Append();
+		for (int x = 0; x < width; x++, pBGR += 3)
+		{
+			pRow[x] = pBGR[0] * (1.0f / 255.0f);
+			pRow[width + x] = pBGR[1] * (1.0f / 255.0f);
+			pRow[2 * width + x] = pBGR[2] * (1.0f / 255.0f);
+		}
+	}
+
+	// Every row that can be finished now.
+	float *pCollapsed = &m_collapsedRows[0][0];
+	while (m_nextRow < m_size.height && ComputeCollapsedRow(0, m_nextRow, pCollapsed))
+	{
+		float *pBGR = &m_output[0];
+		for (int x = 0; x < width; x++)
+		{
+			pBGR[3 * x] = pCollapsed[x];
+			pBGR[3 * x + 1] = pCollapsed[width + x];
+			pBGR[3 * x + 2] = pCollapsed[2 * width + x];
+		}
+		m_onRow(m_nextRow++, pBGR);
+	}
+}
+
+int StreamingFusion::CStreamingFusion::GetDepth() const
+{
+	return m_depth;
+}
+
+int StreamingFusion::CStreamingFusion::GetLatency() const
+{
+	// Each level needs 2 rows more of the level above it than the level below it needs, and twice as many:
+	// 4 x (2^depth - 1) rows at full resolution. Plus one row for the contrast, and one for the rounding.
+	return std::min(4 * ((1 << m_depth) - 1) + 2, m_size.height);
+}
+
+size_t StreamingFusion::CStreamingFusion::GetMemory() const
+{
+	size_t bytes = 0;
+	for (size_t i = 0; i < m_gaussian.size(); i++)
+		bytes += m_gaussian[i].GetMemory() + m_weights[i].GetMemory();
+	for (size_t i = 0; i < m_gray.size(); i++)
+		bytes += m_gray[i].GetMemory();
+	for (int level = 0; level <= m_depth; level++)
+	{
+		bytes += m_collapsed[level].GetMemory();
+		bytes += (m_collapsedRows[level].size() + m_laplacianRows[level].size() + m_upRows[level].size() + m_columns[level].size()) * sizeof(float);
+	}
+	return bytes + (m_weightSum.size() + m_output.size()) * sizeof(float);
+}
+
+void StreamingFusion::Fuse(const std::vector<cv::Mat> &images, const Settings &settings, cv::Mat &fusion)
+{
+	if (images.empty())
+		return;
+
+	fusion.create(images[0].size(), CV_32FC3);
+	CStreamingFusion stream(images[0].size(), images.size(), settings, [&fusion](int y, const float *pBGR)
+	{
+		memcpy(fusion.ptr<float>(y), pBGR, 3 * (size_t)fusion.cols * sizeof(float));
+	});
+
+	std::vector<const uint8_t*> rows(images.size());
+	for (int y = 0; y < fusion.rows; y++)
+	{
+		for (size_t i = 0; i < images.size(); i++)
+			rows[i] = images[i].ptr<uint8_t>(y);
+		stream.PushRow(rows);
+	}
+}
+
+// *********************************************************************************************************
+
+#endif
@@ -0,0 +1,162 @@
+// ToneCurve.h
+// The last step from the fusion (floats, 1.0 = white) to 8 bit output: a gamma, a contrast S-curve and a curve of the
+// user's own, folded into one lookup table that is built once. Writing the output then costs one table lookup per
+// value instead of a float pass per adjustment, and the clamping to 0..255 comes with the table.
+//
+// The table has 2^12 entries over 0..1 by default, finer than the 8 bit output everywhere but in the deepest shadows
+// under a strong gamma (2^16 entries take care of those). Whole rows are looked up 8 at a time with AVX2's gather
+// where the build targets it. Otherwise the indices are computed 4 at a time with SSE2 and looked up one by one.
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TONECURVE_H
+#define TONECURVE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <cmath>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#    include <emmintrin.h>
+#    define TONECURVE_SSE2
+#endif
+#if defined(__AVX2__)
+#    include <immintrin.h>
+#    define TONECURVE_AVX2
+#endif
+
+namespace ToneCurve
+{
+	// The curve, applied in this order. The defaults do nothing.
+	struct Settings
+	{
+		float gamma = 1.0f;           // output = input^(1 / gamma): 2.2 lifts the shadows like a display gamma
+		float contrast = 0.0f;        // S-curve around the middle, -1..1 (0: none, 1: smoothstep, below 0: flatter)
+		std::vector<float> userCurve; // outputs (0..1) for inputs evenly spaced over 0..1, linearly interpolated (empty: none)
+		int bits = 12;                // the table has 2^bits entries (8 to 16)
+	};
+
+	// The curve of one value (clamped to 0..1), computed the slow way. The table is built from it.
+	float Evaluate(const Settings &settings, float value);
+
+	// The table of a tone curve, from 0..1 to 0..255.
+	class CToneLut
+	{
+	private:
+		std::vector<uint8_t> m_table; // plus 3 bytes, so a 4 byte gather at the last entry stays inside
+		int m_last;
+
+	public:
+		explicit CToneLut(const Settings &settings);
+
+		// One value (clamped to 0..1, NaN: 0).
+		uint8_t Lookup(float value) const;
+		// 'count' values.
+		void LookupRow(const float *pIn, uint8_t *pOut, size_t count) const;
+	};
+
+	// The table for 'settings', or NULL if they leave the values as they are.
+	std::shared_ptr<const CToneLut> Create(const Settings &settings);
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+inline float ToneCurve::Evaluate(const Settings &settings, float value)
+{
+	float x = std::min(std::max(value, 0.0f), 1.0f);
+	if (settings.gamma > 0 && settings.gamma != 1.0f)
+		x = std::pow(x, 1.0f / settings.gamma);
+	if (settings.contrast != 0)
+	{
+		float s = x * x * (3.0f - 2.0f * x);
+		x += settings.contrast * (s - x);
+	}
+
+	const std::vector<float> &curve = settings.userCurve;
+	if (curve.size() == 1)
+		x = curve[0];
+	else if (curve.size() > 1)
+	{
+		float position = x * (curve.size() - 1);
+		size_t k = std::min((size_t)position, curve.size() - 2);
+		x = curve[k] + (position - k) * (curve[k + 1] - curve[k]);
+	}
+	return x;
+}
+
+inline ToneCurve::CToneLut::CToneLut(const Settings &settings)
+{
+	int bits = std::min(std::max(settings.bits, 8), 16);
+	m_last = (1 << bits) - 1;
+	m_table.assign((size_t)m_last + 1 + 3, 0);
+	for (int i = 0; i <= m_last; i++)
+		m_table[i] = (uint8_t)std::min(std::max(Evaluate(settings, (float)i / m_last) * 255.0f + 0.5f, 0.0f), 255.0f);
+}
+
+inline uint8_t ToneCurve::CToneLut::Lookup(float value) const
+{
+	// (NaN fails the comparison inside std::max and comes out as 0.)
+	float index = std::min((float)m_last, std::max(0.0f, value * m_last + 0.5f));
+	return m_table[(int)index];
+}
+
+inline void ToneCurve::CToneLut::LookupRow(const float *pIn, uint8_t *pOut, size_t count) const
+{
+	size_t i = 0;
+#if defined(TONECURVE_AVX2)
+	const __m256 scale = _mm256_set1_ps((float)m_last);
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 last = _mm256_set1_ps((float)m_last);
+	const __m256i byteMask = _mm256_set1_epi32(0xff);
+	const int *pTable = (const int*)&m_table[0];
+	for (; i + 8 <= count; i += 8)
+	{
+		// (max with 0 first: it returns 0 for NaN.)
+		__m256 index = _mm256_min_ps(_mm256_max_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(pIn + i), scale), half), _mm256_setzero_ps()), last);
+		__m256i entries = _mm256_and_si256(_mm256_i32gather_epi32(pTable, _mm256_cvttps_epi32(index), 1), byteMask);
+		__m128i words = _mm_packus_epi32(_mm256_castsi256_si128(entries), _mm256_extracti128_si256(entries, 1));
+		_mm_storel_epi64((__m128i*)(pOut + i), _mm_packus_epi16(words, words));
+	}
+#elif defined(TONECURVE_SSE2)
+	const __m128 scale = _mm_set1_ps((float)m_last);
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 last = _mm_set1_ps((float)m_last);
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 index = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(pIn + i), scale), half), _mm_setzero_ps()), last);
+		__m128i indices = _mm_cvttps_epi32(index);
+		pOut[i] = m_table[_mm_cvtsi128_si32(indices)];
+		pOut[i + 1] = m_table[_mm_cvtsi128_si32(_mm_srli_si128(indices, 4))];
+		pOut[i + 2] = m_table[_mm_cvtsi128_si32(_mm_srli_si128(indices, 8))];
+		pOut[i + 3] = m_table[_mm_cvtsi128_si32(_mm_srli_si128(indices, 12))];
+	}
+#endif
+	for (; i < count; i++)
+		pOut[i] = Lookup(pIn[i]);
+}
+
+inline std::shared_ptr<const ToneCurve::CToneLut> ToneCurve::Create(const Settings &settings)
+{
+	bool linear = (settings.gamma <= 0 || settings.gamma == 1.0f) && settings.contrast == 0 && settings.userCurve.empty();
+	if (linear)
+		return std::shared_ptr<const CToneLut>();
+	return std::make_shared<const CToneLut>(settings);
+}
+
+// *********************************************************************************************************
+
+#endif
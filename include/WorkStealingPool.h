@@ -0,0 +1,213 @@
+// WorkStealingPool.h
+// A small thread pool where every worker has its own task deque.
+// A worker runs its newest task first (so work it splits up stays hot in its cache) and,
+// when it runs dry, steals the oldest task of another worker.
+// Copyright (c) 2019 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef WORKSTEALINGPOOL_H
+#define WORKSTEALINGPOOL_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+
+#ifdef _MSC_VER
+#define WORKSTEALINGPOOL_THREAD_LOCAL __declspec(thread)
+#else
+#define WORKSTEALINGPOOL_THREAD_LOCAL thread_local
+#endif
+
+namespace WorkStealingPool
+{
+	class CWorkStealingPool
+	{
+	private:
+		struct Worker
+		{
+			std::deque<std::function<void()>> tasks;
+			std::mutex lock;
+		};
+
+		std::vector<std::unique_ptr<Worker>> m_workers;
+		std::vector<std::thread> m_threads;
+		std::atomic<size_t> m_queued;
+		std::atomic<size_t> m_pending;
+		std::atomic<size_t> m_nextWorker;
+		std::atomic<uint64_t> m_steals;
+		std::mutex m_sleepLock;
+		std::condition_variable m_wake;
+		std::condition_variable m_done;
+		bool m_stop = false;
+
+		void WorkerLoop(size_t index);
+		bool TakeTask(size_t index, std::function<void()> &task);
+
+	public:
+		// numThreads = 0 uses one thread per core.
+		CWorkStealingPool(size_t numThreads = 0);
+		~CWorkStealingPool();
+
+		// Queue a task. Called from a worker, the task goes to that worker's own deque.
+		// Tasks must not throw: catch and report errors inside the task.
+		void Submit(std::function<void()> task);
+
+		// Block until every submitted task (and every task those submitted) has finished.
+		void Wait();
+
+		size_t GetNumThreads();
+		uint64_t GetStealCount();
+	};
+
+	// Which pool and worker the calling thread belongs to (NULL / -1 outside a pool).
+	WORKSTEALINGPOOL_THREAD_LOCAL CWorkStealingPool *g_currentPool = NULL;
+	WORKSTEALINGPOOL_THREAD_LOCAL int g_currentWorker = -1;
+}
+
+// *********************************************************************************************************
+// DEFINITIONS
+WorkStealingPool::CWorkStealingPool::CWorkStealingPool(size_t numThreads)
+	: m_queued(0), m_pending(0), m_nextWorker(0), m_steals(0)
+{
+	if (numThreads == 0)
+		numThreads = std::thread::hardware_concurrency();
+	if (numThreads == 0)
+		numThreads = 1;
+
+	for (size_t i = 0; i < numThreads; i++)
+		m_workers.push_back(std::unique_ptr<Worker>(new Worker()));
+	for (size_t i = 0; i < numThreads; i++)
+		m_threads.push_back(std::thread(&CWorkStealingPool::WorkerLoop, this, i));
+}
+
+WorkStealingPool::CWorkStealingPool::~CWorkStealingPool()
+{
+	Wait();
+
+	{
+		std::lock_guard<std::mutex> lock(m_sleepLock);
+		m_stop = true;
+	}
+	m_wake.notify_all();
+
+	for (size_t i = 0; i < m_threads.size(); i++)
+		m_threads[i].join();
+}
+
+void WorkStealingPool::CWorkStealingPool::Submit(std::function<void()> task)
+{
+	size_t index = (g_currentPool == this) ? (size_t)g_currentWorker : (m_nextWorker++ % m_workers.size());
+
+	m_pending++;
+	{
+		std::lock_guard<std::mutex> lock(m_workers[index]->lock);
+		m_workers[index]->tasks.push_back(task);
+		m_queued++;
+	}
+
+	// Taking the lock makes sure a worker that just found nothing to do is already waiting when we notify.
+	{
+		std::lock_guard<std::mutex> lock(m_sleepLock);
+	}
+	m_wake.notify_one();
+}
+
+void WorkStealingPool::CWorkStealingPool::Wait()
+{
+	std::unique_lock<std::mutex> lock(m_sleepLock);
+	m_done.wait(lock, [this] { return m_pending == 0; });
+}
+
+size_t WorkStealingPool::CWorkStealingPool::GetNumThreads()
+{
+	return m_threads.size();
+}
+
+uint64_t WorkStealingPool::CWorkStealingPool::GetStealCount()
+{
+	return m_steals;
+}
+
+bool WorkStealingPool::CWorkStealingPool::TakeTask(size_t index, std::function<void()> &task)
+{
+	// Own deque first, newest task first.
+	{
+		Worker &own = *m_workers[index];
+		std::lock_guard<std::mutex> lock(own.lock);
+		if (!own.tasks.empty())
+		{
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			m_queued--;
+			return true;
+		}
+	}
+
+	// Then steal the oldest task of the others.
+	for (size_t i = 1; i < m_workers.size(); i++)
+	{
+		Worker &victim = *m_workers[(index + i) % m_workers.size()];
+		std::lock_guard<std::mutex> lock(victim.lock);
+		if (!victim.tasks.empty())
+		{
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			m_queued--;
+			m_steals++;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void WorkStealingPool::CWorkStealingPool::WorkerLoop(size_t index)
+{
+	g_currentPool = this;
+	g_currentWorker = (int)index;
+
+	while (true)
+	{
+		std::function<void()> task;
+		if (TakeTask(index, task))
+		{
+			task();
+			task = nullptr;
+
+			if (--m_pending == 0)
+			{
+				std::lock_guard<std::mutex> lock(m_sleepLock);
+				m_done.notify_all();
+			}
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_sleepLock);
+		m_wake.wait(lock, [this] { return m_queued > 0 || m_stop; });
+		if (m_stop && m_queued == 0)
+			break;
+	}
+
+	g_currentPool = NULL;
+	g_currentWorker = -1;
+}
+
+// *********************************************************************************************************
+
+#endif